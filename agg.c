@@ -0,0 +1,187 @@
+/*
+   p0f - aggregate host counters
+   -----------------------------
+
+   Number of cached hosts per OS name, HTTP application name and link type,
+   adjusted whenever a host's verdict changes or the host goes away, so that
+   the API can answer "how many of each" without walking the host cache.
+   Counters are kept for all hosts, and separately for every prefix given
+   with -G; a host is counted in each prefix it falls in.
+
+   Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>
+
+   Distributed under the terms and conditions of GNU LGPL.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "types.h"
+#include "config.h"
+#include "debug.h"
+#include "alloc-inl.h"
+#include "process.h"
+#include "tcp.h"
+#include "agg.h"
+
+struct agg_scope agg_scope[1 + AGG_MAX_PREFIX];
+
+u32 agg_scope_cnt = 1;
+
+
+/* Parse a -G prefix (addr or addr/len) and start counting for it. */
+
+void agg_add_prefix(u8* spec) {
+
+  struct agg_scope* s;
+  u8* sl = (u8*)strchr((char*)spec, '/');
+  u32 max_len;
+
+  if (agg_scope_cnt > AGG_MAX_PREFIX)
+    FATAL("Too many -G prefixes (limit: %u).", AGG_MAX_PREFIX);
+
+  s = agg_scope + agg_scope_cnt;
+
+  if (sl) *sl = 0;
+
+  if (inet_pton(AF_INET, (char*)spec, s->addr) == 1) {
+    s->ip_ver = IP_VER4;
+    max_len   = 32;
+  } else if (inet_pton(AF_INET6, (char*)spec, s->addr) == 1) {
+    s->ip_ver = IP_VER6;
+    max_len   = 128;
+  } else FATAL("Bad IPv4 or IPv6 address for -G.");
+
+  if (sl) {
+
+    u32 len;
+
+    *sl = '/';
+
+    if (sscanf((char*)sl + 1, "%u", &len) != 1 || len > max_len)
+      FATAL("Bad prefix length for -G.");
+
+    s->len = len;
+
+  } else s->len = max_len;
+
+  agg_scope_cnt++;
+
+}
+
+
+/* Does the prefix of a scope cover an address? */
+
+static u8 in_prefix(struct agg_scope* s, u8* addr, u8 ip_ver) {
+
+  u32 full = s->len / 8, rest = s->len % 8;
+
+  if (s->ip_ver != ip_ver || memcmp(s->addr, addr, full)) return 0;
+
+  if (rest && ((s->addr[full] ^ addr[full]) & (0xff << (8 - rest))))
+    return 0;
+
+  return 1;
+
+}
+
+
+/* Adjust the count for one ID in every scope the host is in. */
+
+static void bump(struct host_data* h, u8 kind, s32 id, s32 delta) {
+
+  u32 i;
+
+  if (id < 0) return;
+
+  for (i = 0; i < agg_scope_cnt; i++) {
+
+    struct agg_scope* s = agg_scope + i;
+
+    if (i && !(h->agg_pfx & (1 << (i - 1)))) continue;
+
+    if ((u32)id >= s->size[kind]) {
+
+      u32 nsize = s->size[kind] ? s->size[kind] : 64;
+
+      while (nsize <= (u32)id) nsize *= 2;
+
+      s->cnt[kind]  = ck_realloc(s->cnt[kind], nsize * sizeof(u32));
+      s->size[kind] = nsize;
+
+    }
+
+    s->cnt[kind][id] += delta;
+
+  }
+
+}
+
+
+/* Start counting a new host (nothing known about it yet). */
+
+void agg_new_host(struct host_data* h) {
+
+  u32 i;
+
+  h->agg_pfx = 0;
+  h->agg_os  = h->agg_app = h->agg_link = -1;
+
+  agg_scope[0].hosts++;
+
+  for (i = 1; i < agg_scope_cnt; i++)
+    if (in_prefix(agg_scope + i, h->addr, h->ip_ver)) {
+      h->agg_pfx |= (1 << (i - 1));
+      agg_scope[i].hosts++;
+    }
+
+}
+
+
+/* Move the host to its current categories, if they changed. Called after
+   anything that may update last_name_id, http_name_id or link_id. */
+
+void agg_update_host(struct host_data* h) {
+
+  if (h->last_name_id != h->agg_os) {
+    bump(h, AGG_OS, h->agg_os, -1);
+    bump(h, AGG_OS, h->last_name_id, 1);
+    h->agg_os = h->last_name_id;
+  }
+
+  if (h->http_name_id != h->agg_app) {
+    bump(h, AGG_APP, h->agg_app, -1);
+    bump(h, AGG_APP, h->http_name_id, 1);
+    h->agg_app = h->http_name_id;
+  }
+
+  if (h->link_id != h->agg_link) {
+    bump(h, AGG_LINK, h->agg_link, -1);
+    bump(h, AGG_LINK, h->link_id, 1);
+    h->agg_link = h->link_id;
+  }
+
+}
+
+
+/* Stop counting a host that is about to be destroyed. */
+
+void agg_drop_host(struct host_data* h) {
+
+  u32 i;
+
+  bump(h, AGG_OS, h->agg_os, -1);
+  bump(h, AGG_APP, h->agg_app, -1);
+  bump(h, AGG_LINK, h->agg_link, -1);
+
+  agg_scope[0].hosts--;
+
+  for (i = 1; i < agg_scope_cnt; i++)
+    if (h->agg_pfx & (1 << (i - 1))) agg_scope[i].hosts--;
+
+}
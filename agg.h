@@ -0,0 +1,61 @@
+/*
+   p0f - aggregate host counters
+   -----------------------------
+
+   Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>
+
+   Distributed under the terms and conditions of GNU LGPL.
+
+ */
+
+#ifndef _HAVE_AGG_H
+#define _HAVE_AGG_H
+
+#include "types.h"
+#include "config.h"
+
+/* Kinds of counters: */
+
+#define AGG_OS               0x00       /* By OS name ID                      */
+#define AGG_APP              0x01       /* By HTTP application name ID        */
+#define AGG_LINK             0x02       /* By link type ID                    */
+
+#define AGG_KINDS            3
+
+/* Counters for all hosts (scope 0), or for those in one -G prefix: */
+
+struct agg_scope {
+
+  u8  ip_ver;                           /* Prefix address type                */
+  u8  addr[16];                         /* Prefix address                     */
+  u8  len;                              /* Prefix length (bits)               */
+
+  u32 hosts;                            /* Cached hosts in scope              */
+
+  u32* cnt[AGG_KINDS];                  /* Hosts per ID                       */
+  u32  size[AGG_KINDS];                 /* Entries allocated in cnt[]         */
+
+};
+
+extern struct agg_scope agg_scope[1 + AGG_MAX_PREFIX];
+extern u32 agg_scope_cnt;
+
+struct host_data;
+
+void agg_add_prefix(u8* spec);
+
+void agg_new_host(struct host_data* h);
+
+void agg_update_host(struct host_data* h);
+
+void agg_drop_host(struct host_data* h);
+
+static inline u32 agg_get(u32 scope, u8 kind, u32 id) {
+
+  struct agg_scope* s = agg_scope + scope;
+
+  return (id < s->size[kind]) ? s->cnt[kind][id] : 0;
+
+}
+
+#endif /* !_HAVE_AGG_H */
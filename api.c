@@ -14,6 +14,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <sys/time.h>
+
 #include "types.h"
 #include "config.h"
 #include "debug.h"
@@ -22,26 +24,22 @@
 #include "api.h"
 #include "process.h"
 #include "readfp.h"
+#include "fp_mtu.h"
+#include "fp_http.h"
+#include "hash.h"
+#include "agg.h"
+#include "hll.h"
 
-/* Process API queries. */
-
-void handle_query(struct p0f_api_query* q, struct p0f_api_response* r) {
-
-  struct host_data* h;
-
-  memset(r, 0, sizeof(struct p0f_api_response));
-
-  r->magic = P0F_RESP_MAGIC;
-
-  if (q->magic != P0F_QUERY_MAGIC) {
+static struct api_client* wait_b[API_WAIT_BUCKETS]; /* Parked wait queries   */
+static u32 wait_cnt;                                /* Number of them        */
 
-    WARN("Query with bad magic (0x%x).", q->magic);
+/* Look up the host named in a query, return P0F_STATUS_*. */
 
-    r->status = P0F_STATUS_BADQUERY;
+static u32 query_host(struct p0f_api_query* q, struct host_data** hp) {
 
-    return;
+  struct host_data* h;
 
-  }
+  *hp = NULL;
 
   switch (q->addr_type) {
 
@@ -53,17 +51,41 @@ void handle_query(struct p0f_api_query* q, struct p0f_api_response* r) {
     default:
 
       WARN("Query with unknown address type %u.\n", q->addr_type);
-      r->status = P0F_STATUS_BADQUERY;
-      return;
+      return P0F_STATUS_BADQUERY;
 
   }
 
-  if (!h) {
-    r->status = P0F_STATUS_NOMATCH;
+  *hp = h;
+  return h ? P0F_STATUS_OK : P0F_STATUS_NOMATCH;
+
+}
+
+
+/* Process host queries. */
+
+static void handle_host_query(struct p0f_api_query* q,
+                              struct p0f_api_response* r) {
+
+  struct host_data* h;
+
+  memset(r, 0, sizeof(struct p0f_api_response));
+
+  r->magic = P0F_RESP_MAGIC;
+
+  if (q->magic != P0F_QUERY_MAGIC) {
+
+    WARN("Query with bad magic (0x%x).", q->magic);
+
+    r->status = P0F_STATUS_BADQUERY;
+
     return;
+
   }
 
-  r->status     = P0F_STATUS_OK;
+  r->status = query_host(q, &h);
+
+  if (!h) return;
+
   r->first_seen = h->first_seen;
   r->last_seen  = h->last_seen;
   r->total_conn = h->total_conn;
@@ -104,3 +126,600 @@ void handle_query(struct p0f_api_query* q, struct p0f_api_response* r) {
   if (h->last_up_min != -1) r->uptime_min = h->last_up_min;
 
 }
+
+
+/* Process history queries. */
+
+static void handle_hist_query(struct p0f_api_query* q,
+                              struct p0f_hist_response* r) {
+
+  struct host_data* h;
+  u32 i;
+
+  memset(r, 0, sizeof(struct p0f_hist_response));
+
+  r->magic = P0F_HIST_RESP_MAGIC;
+
+  r->status = query_host(q, &h);
+
+  if (!h || !h->hist) return;
+
+  /* Walk back from the most recent entry. */
+
+  for (i = 0; i < h->hist_cnt; i++) {
+
+    struct host_hist* e = h->hist + (h->hist_next + HOST_HISTORY - 1 - i) %
+                          HOST_HISTORY;
+
+    r->entry[i].time     = e->time;
+    r->entry[i].sig_id   = e->sig_id;
+    r->entry[i].name_id  = e->name_id;
+    r->entry[i].port     = e->port;
+    r->entry[i].distance = e->dist;
+    r->entry[i].flags    = e->flags;
+
+  }
+
+  r->count = h->hist_cnt;
+
+}
+
+
+/* Process service set queries. */
+
+static void handle_svc_query(struct p0f_api_query* q,
+                             struct p0f_svc_response* r) {
+
+  struct host_data* h;
+  u32 i;
+
+  memset(r, 0, sizeof(struct p0f_svc_response));
+
+  r->magic       = P0F_SVC_RESP_MAGIC;
+  r->fp_revision = fp_revision;
+  r->fp_digest   = fp_digest;
+
+  r->status = query_host(q, &h);
+
+  if (!h || !h->svc) return;
+
+  for (i = 0; i < h->svc_cnt; i++) {
+
+    struct host_svc* e = h->svc + i;
+
+    r->entry[i].port       = e->port;
+    r->entry[i].flags      = e->flags;
+    r->entry[i].name_id    = e->name_id;
+    r->entry[i].flavor_id  = e->name_id != -1 ? e->label_id : -1;
+    r->entry[i].first_seen = e->first_seen;
+    r->entry[i].last_seen  = e->last_seen;
+
+  }
+
+  r->count = h->svc_cnt;
+
+}
+
+
+/* Process v2 host queries. Nothing to copy but numbers. */
+
+static void handle_host2_query(struct p0f_api_query* q,
+                               struct p0f_api_response2* r) {
+
+  struct host_data* h;
+
+  memset(r, 0, sizeof(struct p0f_api_response2));
+
+  r->magic       = P0F_RESP2_MAGIC;
+  r->fp_revision = fp_revision;
+  r->fp_digest   = fp_digest;
+
+  r->status = query_host(q, &h);
+
+  if (!h) return;
+
+  r->first_seen     = h->first_seen;
+  r->last_seen      = h->last_seen;
+  r->total_conn     = h->total_conn;
+
+  if (h->last_up_min != -1) {
+    r->uptime_min   = h->last_up_min;
+    r->up_freq      = h->up_freq;
+  }
+
+  r->up_mod_days    = h->up_mod_days;
+  r->last_nat       = h->last_nat;
+  r->last_chg       = h->last_chg;
+  r->nat_reasons    = h->last_nat_reasons;
+  r->distance       = h->distance;
+  r->bad_sw         = h->bad_sw;
+  r->os_match_q     = h->last_quality;
+  r->http_match_q   = h->http_quality;
+
+  r->os_name_id     = h->last_name_id;
+  r->os_flavor_id   = h->last_name_id != -1 ? h->last_label_id : -1;
+  r->http_name_id   = h->http_name_id;
+  r->http_flavor_id = h->http_name_id != -1 ? h->http_label_id : -1;
+  r->link_id        = h->link_id;
+  r->language_id    = h->lang_id;
+
+}
+
+
+/* Process wait queries. Returns 0 if the answer should be held back,
+   sizeof(struct p0f_api_response2) otherwise. */
+
+static u32 handle_wait_query(struct p0f_wait_query* q,
+                             struct p0f_api_response2* r, u8 expired) {
+
+  struct host_data* h;
+
+  handle_host2_query((struct p0f_api_query*)q, r);
+
+  if (r->status == P0F_STATUS_BADQUERY)
+    return sizeof(struct p0f_api_response2);
+
+  h = lookup_host(q->addr, q->addr_type);
+
+  if (h && h->last_tcp >= q->since) return sizeof(struct p0f_api_response2);
+
+  if (!expired && q->timeout_ms) return 0;
+
+  r->status = P0F_STATUS_TIMEOUT;
+  return sizeof(struct p0f_api_response2);
+
+}
+
+
+/* Process tuple queries. */
+
+static void handle_tuple_query(struct p0f_tuple_query* q,
+                               struct p0f_tuple_response* r) {
+
+  struct conn_verdict* cv;
+
+  memset(r, 0, sizeof(struct p0f_tuple_response));
+
+  r->magic       = P0F_TUPLE_RESP_MAGIC;
+  r->fp_revision = fp_revision;
+  r->fp_digest   = fp_digest;
+
+  if (q->addr_type != P0F_ADDR_IPV4 && q->addr_type != P0F_ADDR_IPV6) {
+    WARN("Query with unknown address type %u.\n", q->addr_type);
+    r->status = P0F_STATUS_BADQUERY;
+    return;
+  }
+
+  cv = lookup_conn(q->addr_type, q->cli_addr, q->cli_port, q->srv_addr,
+                   q->srv_port);
+
+  if (!cv) {
+    r->status = P0F_STATUS_NOMATCH;
+    return;
+  }
+
+  r->status         = P0F_STATUS_OK;
+  r->first_seen     = cv->created;
+  r->closed         = cv->closed;
+  r->distance       = cv->distance;
+  r->bad_sw         = cv->bad_sw;
+  r->os_match_q     = cv->os_quality;
+  r->http_match_q   = cv->http_quality;
+
+  r->os_name_id     = cv->os_name_id;
+  r->os_flavor_id   = cv->os_name_id != -1 ? cv->os_label_id : -1;
+  r->http_name_id   = cv->http_name_id;
+  r->http_flavor_id = cv->http_name_id != -1 ? cv->http_label_id : -1;
+  r->link_id        = cv->link_id;
+  r->language_id    = cv->lang_id;
+
+}
+
+
+/* Process dictionary queries. */
+
+static void handle_dict_query(struct p0f_dict_query* q,
+                              struct p0f_dict_response* r) {
+
+  u32 id, used = 0;
+
+  memset(r, 0, sizeof(struct p0f_dict_response));
+
+  r->magic       = P0F_DICT_RESP_MAGIC;
+  r->fp_revision = fp_revision;
+  r->fp_digest   = fp_digest;
+
+  switch (q->dict) {
+    case P0F_DICT_NAME:   r->total = fp_name_cnt; break;
+    case P0F_DICT_FLAVOR: r->total = fp_flavor_cnt; break;
+    case P0F_DICT_LINK:   r->total = fp_link_cnt; break;
+    case P0F_DICT_LANG:   r->total = HTTP_LANG_IDS; break;
+
+    default:
+      WARN("Dictionary query for unknown dictionary %u.", q->dict);
+      r->status = P0F_STATUS_BADQUERY;
+      return;
+  }
+
+  r->first_id = q->first_id;
+
+  if (q->first_id >= r->total) {
+    r->status = P0F_STATUS_NOMATCH;
+    return;
+  }
+
+  r->status = P0F_STATUS_OK;
+
+  for (id = q->first_id; id < r->total; id++) {
+
+    u8* str = NULL;
+    u32 len;
+
+    switch (q->dict) {
+      case P0F_DICT_NAME:   str = fp_os_names[id]; break;
+      case P0F_DICT_FLAVOR: str = fp_flavors[id]; break;
+      case P0F_DICT_LINK:   str = fp_links[id]; break;
+      case P0F_DICT_LANG:   str = http_lang_name(id); break;
+    }
+
+    len = str ? strlen((char*)str) : 0;
+
+    if (used + len + 1 > P0F_DICT_DATA) break;
+
+    if (len) memcpy(r->data + used, str, len);
+    used += len + 1;
+
+    r->count++;
+
+  }
+
+}
+
+
+/* Process aggregate queries. */
+
+static void handle_agg_query(struct p0f_agg_query* q,
+                             struct p0f_agg_response* r) {
+
+  struct agg_scope* s;
+  u32 id;
+  u8  kind;
+
+  memset(r, 0, sizeof(struct p0f_agg_response));
+
+  r->magic       = P0F_AGG_RESP_MAGIC;
+  r->fp_revision = fp_revision;
+  r->fp_digest   = fp_digest;
+
+  switch (q->kind) {
+    case P0F_AGG_OS:   kind = AGG_OS;   r->total = fp_name_cnt; break;
+    case P0F_AGG_APP:  kind = AGG_APP;  r->total = fp_name_cnt; break;
+    case P0F_AGG_LINK: kind = AGG_LINK; r->total = fp_link_cnt; break;
+
+    default:
+      WARN("Aggregate query for unknown kind %u.", q->kind);
+      r->status = P0F_STATUS_BADQUERY;
+      return;
+  }
+
+  if (q->prefix >= agg_scope_cnt) {
+    r->status = P0F_STATUS_NOMATCH;
+    return;
+  }
+
+  s = agg_scope + q->prefix;
+
+  if (q->prefix) {
+    r->addr_type  = s->ip_ver;
+    r->prefix_len = s->len;
+    memcpy(r->addr, s->addr, 16);
+  }
+
+  r->status = P0F_STATUS_OK;
+  r->hosts  = s->hosts;
+
+  for (id = q->first_id; id < r->total && r->count < P0F_AGG_MAX; id++) {
+
+    u32 cnt = agg_get(q->prefix, kind, id);
+
+    if (!cnt) continue;
+
+    r->entry[r->count].id    = id;
+    r->entry[r->count].hosts = cnt;
+    r->count++;
+
+  }
+
+  r->next_id = id;
+
+}
+
+
+/* Process distinct count queries. */
+
+static void handle_card_query(struct p0f_card_query* q,
+                              struct p0f_card_response* r) {
+
+  struct hll_sketch* sk;
+
+  memset(r, 0, sizeof(struct p0f_card_response));
+
+  r->magic       = P0F_CARD_RESP_MAGIC;
+  r->fp_revision = fp_revision;
+  r->fp_digest   = fp_digest;
+  r->window      = HLL_WINDOW;
+  r->cur_start   = hll_window_start();
+
+  switch (q->kind) {
+
+    case P0F_CARD_SERVER:
+
+      if (q->addr_type != P0F_ADDR_IPV4 && q->addr_type != P0F_ADDR_IPV6) {
+        WARN("Query with unknown address type %u.\n", q->addr_type);
+        r->status = P0F_STATUS_BADQUERY;
+        return;
+      }
+
+      sk = hll_server_get(q->addr_type, q->addr, q->port);
+      break;
+
+    case P0F_CARD_OS:
+
+      if (q->name_id < 0 || q->name_id >= fp_name_cnt) {
+        r->status = P0F_STATUS_BADQUERY;
+        return;
+      }
+
+      sk = hll_os_get(q->name_id);
+      break;
+
+    default:
+      WARN("Distinct count query of unknown kind %u.", q->kind);
+      r->status = P0F_STATUS_BADQUERY;
+      return;
+
+  }
+
+  if (!sk) {
+    r->status = P0F_STATUS_NOMATCH;
+    return;
+  }
+
+  r->status   = P0F_STATUS_OK;
+  r->cur_est  = hll_estimate(sk->cur);
+  r->prev_est = hll_estimate(sk->prev);
+
+}
+
+
+/* Size of the query that starts with a given magic. Unknown magic values
+   get the size of a legacy query, so that they can be rejected in the usual
+   way. */
+
+u32 api_query_len(u32 magic) {
+
+  switch (magic) {
+
+    case P0F_STATS_QUERY_MAGIC:
+      return sizeof(u32);
+
+    case P0F_DICT_QUERY_MAGIC:
+      return sizeof(struct p0f_dict_query);
+
+    case P0F_WAIT_QUERY_MAGIC:
+      return sizeof(struct p0f_wait_query);
+
+    case P0F_TUPLE_QUERY_MAGIC:
+      return sizeof(struct p0f_tuple_query);
+
+    case P0F_AGG_QUERY_MAGIC:
+      return sizeof(struct p0f_agg_query);
+
+    case P0F_CARD_QUERY_MAGIC:
+      return sizeof(struct p0f_card_query);
+
+    case P0F_QUERY_MAGIC:
+    case P0F_HIST_QUERY_MAGIC:
+    case P0F_SVC_QUERY_MAGIC:
+    case P0F_QUERY2_MAGIC:
+    default:
+      return sizeof(struct p0f_api_query);
+
+  }
+
+}
+
+
+/* Dispatch a complete query. Returns the length of the response, or 0 if
+   it's a wait query that should be parked with api_park(). */
+
+u32 handle_query(u8* q, u8* r) {
+
+  switch (*(u32*)q) {
+
+    case P0F_STATS_QUERY_MAGIC:
+      fill_api_stats((struct p0f_stats_response*)r);
+      return sizeof(struct p0f_stats_response);
+
+    case P0F_QUERY2_MAGIC:
+      handle_host2_query((struct p0f_api_query*)q,
+                         (struct p0f_api_response2*)r);
+      return sizeof(struct p0f_api_response2);
+
+    case P0F_DICT_QUERY_MAGIC:
+      handle_dict_query((struct p0f_dict_query*)q,
+                        (struct p0f_dict_response*)r);
+      return sizeof(struct p0f_dict_response);
+
+    case P0F_WAIT_QUERY_MAGIC:
+      return handle_wait_query((struct p0f_wait_query*)q,
+                               (struct p0f_api_response2*)r, 0);
+
+    case P0F_TUPLE_QUERY_MAGIC:
+      handle_tuple_query((struct p0f_tuple_query*)q,
+                         (struct p0f_tuple_response*)r);
+      return sizeof(struct p0f_tuple_response);
+
+    case P0F_AGG_QUERY_MAGIC:
+      handle_agg_query((struct p0f_agg_query*)q, (struct p0f_agg_response*)r);
+      return sizeof(struct p0f_agg_response);
+
+    case P0F_CARD_QUERY_MAGIC:
+      handle_card_query((struct p0f_card_query*)q,
+                        (struct p0f_card_response*)r);
+      return sizeof(struct p0f_card_response);
+
+    case P0F_HIST_QUERY_MAGIC:
+      handle_hist_query((struct p0f_api_query*)q, (struct p0f_hist_response*)r);
+      return sizeof(struct p0f_hist_response);
+
+    case P0F_SVC_QUERY_MAGIC:
+      handle_svc_query((struct p0f_api_query*)q, (struct p0f_svc_response*)r);
+      return sizeof(struct p0f_svc_response);
+
+    default:
+      handle_host_query((struct p0f_api_query*)q, (struct p0f_api_response*)r);
+      return sizeof(struct p0f_api_response);
+
+  }
+
+}
+
+
+/* Current wall clock time, in milliseconds. Wait deadlines don't follow
+   capture time, so that they work the same with -F. */
+
+static u64 wall_ms(void) {
+
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (u64)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+}
+
+
+/* Hash bucket for an address. */
+
+static u32 wait_bucket(u8* addr, u8 ip_ver) {
+
+  return hash32(addr, (ip_ver == P0F_ADDR_IPV4) ? 4 : 16, hash_seed) %
+         API_WAIT_BUCKETS;
+
+}
+
+
+/* Park a client whose wait query can't be answered yet. */
+
+void api_park(struct api_client* c) {
+
+  struct p0f_wait_query* q = &c->in_data.wait;
+  u32 bucket = wait_bucket(q->addr, q->addr_type);
+
+  c->parked     = 1;
+  c->woken      = 0;
+  c->wait_until = wall_ms() + (q->timeout_ms > API_WAIT_MAX ?
+                               API_WAIT_MAX : q->timeout_ms);
+
+  c->wait_next = wait_b[bucket];
+  wait_b[bucket] = c;
+  wait_cnt++;
+
+  DEBUG("[#] Parked API wait query on fd %d (%u parked).\n", c->fd, wait_cnt);
+
+}
+
+
+/* Take a client off the parked list (answered or disconnected). */
+
+void api_unpark(struct api_client* c) {
+
+  struct p0f_wait_query* q = &c->in_data.wait;
+  struct api_client** p = wait_b + wait_bucket(q->addr, q->addr_type);
+
+  while (*p && *p != c) p = &(*p)->wait_next;
+
+  if (!*p) FATAL("Parked API client not found.");
+
+  *p = c->wait_next;
+  c->wait_next = NULL;
+  c->parked = 0;
+  wait_cnt--;
+
+}
+
+
+/* Called when a host gets a new TCP verdict: mark the clients waiting on
+   it. They're answered from api_answer_parked(), once the packet is fully
+   processed. */
+
+void api_wake(struct host_data* h) {
+
+  struct api_client* c;
+
+  if (!wait_cnt) return;
+
+  c = wait_b[wait_bucket(h->addr, h->ip_ver)];
+
+  while (c) {
+
+    if (c->in_data.wait.addr_type == h->ip_ver &&
+        !memcmp(c->in_data.wait.addr, h->addr,
+                (h->ip_ver == P0F_ADDR_IPV4) ? 4 : 16)) c->woken = 1;
+
+    c = c->wait_next;
+
+  }
+
+}
+
+
+/* Answer woken and expired wait queries. Lowers *timeout (ms) to the nearest
+   remaining deadline. Returns 1 if any client got a response. */
+
+u8 api_answer_parked(s32* timeout) {
+
+  u64 now;
+  u32 i;
+  u8  ret = 0;
+
+  if (!wait_cnt) return 0;
+
+  now = wall_ms();
+
+  for (i = 0; i < API_WAIT_BUCKETS; i++) {
+
+    struct api_client* c = wait_b[i];
+
+    while (c) {
+
+      struct api_client* next = c->wait_next;
+      u8 expired = (now >= c->wait_until);
+
+      if (c->woken || expired) {
+
+        c->woken = 0;
+
+        c->out_len = handle_wait_query(&c->in_data.wait, &c->out_data.host2,
+                                       expired);
+
+        if (c->out_len) {
+          api_unpark(c);
+          ret = 1;
+          c = next;
+          continue;
+        }
+
+      }
+
+      if ((s64)(c->wait_until - now) < *timeout) *timeout = c->wait_until - now;
+
+      c = next;
+
+    }
+
+  }
+
+  return ret;
+
+}
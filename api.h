@@ -16,9 +16,36 @@
 #define P0F_QUERY_MAGIC      0x50304601
 #define P0F_RESP_MAGIC       0x50304602
 
+#define P0F_HIST_QUERY_MAGIC 0x50304603
+#define P0F_HIST_RESP_MAGIC  0x50304604
+
+#define P0F_STATS_QUERY_MAGIC 0x50304605
+#define P0F_STATS_RESP_MAGIC  0x50304606
+
+#define P0F_QUERY2_MAGIC     0x50304607
+#define P0F_RESP2_MAGIC      0x50304608
+
+#define P0F_DICT_QUERY_MAGIC 0x50304609
+#define P0F_DICT_RESP_MAGIC  0x5030460A
+
+#define P0F_WAIT_QUERY_MAGIC 0x5030460B
+
+#define P0F_TUPLE_QUERY_MAGIC 0x5030460C
+#define P0F_TUPLE_RESP_MAGIC  0x5030460D
+
+#define P0F_AGG_QUERY_MAGIC  0x5030460E
+#define P0F_AGG_RESP_MAGIC   0x5030460F
+
+#define P0F_CARD_QUERY_MAGIC 0x50304610
+#define P0F_CARD_RESP_MAGIC  0x50304611
+
+#define P0F_SVC_QUERY_MAGIC  0x50304612
+#define P0F_SVC_RESP_MAGIC   0x50304613
+
 #define P0F_STATUS_BADQUERY  0x00
 #define P0F_STATUS_OK        0x10
 #define P0F_STATUS_NOMATCH   0x20
+#define P0F_STATUS_TIMEOUT   0x30
 
 #define P0F_ADDR_IPV4        0x04
 #define P0F_ADDR_IPV6        0x06
@@ -28,8 +55,41 @@
 #define P0F_MATCH_FUZZY      0x01
 #define P0F_MATCH_GENERIC    0x02
 
+#define P0F_HIST_MAX         16
+
+#define P0F_DICT_NAME        0x01       /* OS and application names           */
+#define P0F_DICT_FLAVOR      0x02       /* Flavors (by signature label)       */
+#define P0F_DICT_LINK        0x03       /* Link types                         */
+#define P0F_DICT_LANG        0x04       /* Languages                          */
+
+#define P0F_DICT_DATA        4096
+
+#define P0F_LAT_BUCKETS      24
+
+#define P0F_AGG_OS           0x01       /* Hosts by OS (P0F_DICT_NAME)        */
+#define P0F_AGG_APP          0x02       /* By HTTP app (P0F_DICT_NAME)        */
+#define P0F_AGG_LINK         0x03       /* By link type (P0F_DICT_LINK)       */
+
+#define P0F_AGG_MAX          256
+
+#define P0F_CARD_SERVER      0x01       /* Clients per server:port            */
+#define P0F_CARD_OS          0x02       /* Hosts per OS name ID               */
+
+#define P0F_SVC_MAX          16
+
+#define P0F_SVC_SYNACK       0x01       /* Answered a SYN on this port        */
+#define P0F_SVC_HTTP         0x02       /* Sent an HTTP response              */
+
+#define P0F_HIST_SYN         0x01       /* Seen on SYN (host is client)       */
+#define P0F_HIST_SYNACK      0x02       /* Seen on SYN+ACK (host is server)   */
+#define P0F_HIST_FUZZY       0x04       /* Fuzzy signature match              */
+#define P0F_HIST_GENERIC     0x08       /* Generic signature match            */
+#define P0F_HIST_BAD_TTL     0x10       /* Distance is an upper bound         */
+
 /* Keep these structures aligned to avoid architecture-specific padding. */
 
+/* Used for P0F_QUERY_MAGIC, P0F_HIST_QUERY_MAGIC and P0F_QUERY2_MAGIC: */
+
 struct p0f_api_query {
 
   u32 magic;                            /* Must be P0F_QUERY_MAGIC            */
@@ -70,10 +130,357 @@ struct p0f_api_response {
 
 } __attribute__((packed));
 
+/* Response to P0F_HIST_QUERY_MAGIC: the host's most recent connections,
+   newest first. Only the first 'count' entries are valid. */
+
+struct p0f_hist_entry {
+
+  u32 time;                             /* Observation time (unix time)       */
+  s32 sig_id;                           /* p0f.fp line of matched sig, or -1  */
+  s16 name_id;                          /* Matched OS / app name ID, or -1    */
+  u16 port;                             /* Server port of the connection      */
+  u8  distance;                         /* Measured distance                  */
+  u8  flags;                            /* P0F_HIST_*                         */
+  u8  reserved[2];
+
+} __attribute__((packed));
+
+struct p0f_hist_response {
+
+  u32 magic;                            /* Must be P0F_HIST_RESP_MAGIC        */
+  u32 status;                           /* P0F_STATUS_*                       */
+  u32 count;                            /* Valid entries                      */
+
+  struct p0f_hist_entry entry[P0F_HIST_MAX];
+
+} __attribute__((packed));
+
+/* Response to P0F_STATS_QUERY_MAGIC. The query itself is just the magic
+   dword. Counters are cumulative since startup. */
+
+struct p0f_stats_response {
+
+  u32 magic;                            /* Must be P0F_STATS_RESP_MAGIC       */
+  u32 status;                           /* Always P0F_STATUS_OK               */
+
+  u32 start_time;                       /* Startup time (unix time)           */
+  u32 cur_time;                         /* Current time (unix time)           */
+
+  u64 packets;                          /* Packets processed                  */
+  u64 records;                          /* Observations reported              */
+
+  u32 pcap_recv;                        /* Received by the capture library    */
+  u32 pcap_drop;                        /* Dropped for lack of buffer space   */
+  u32 pcap_ifdrop;                      /* Dropped by the interface / driver  */
+
+  u32 hosts;                            /* Hosts currently cached             */
+  u32 flows;                            /* Flows currently tracked            */
+
+  u32 cpu_user_ms;                      /* User CPU time used (ms)            */
+  u32 cpu_sys_ms;                       /* System CPU time used (ms)          */
+
+  u32 fp_revision;                      /* Signature database revision        */
+  u32 fp_digest;                        /* Hash of p0f.fp and applied deltas  */
+
+  /* Latency histograms, live captures only. Bucket n counts events that
+     happened 2^n to 2^(n+1) - 1 us after the packet was captured; bucket 0
+     also takes 0 us, the last one takes everything above. */
+
+  u32 lat_process[P0F_LAT_BUCKETS];     /* Capture -> start of processing     */
+  u32 lat_update[P0F_LAT_BUCKETS];      /* Capture -> host record updated     */
+  u32 lat_visible[P0F_LAT_BUCKETS];     /* Capture -> visible to API queries  */
+
+  u32 ts_flows;                         /* Compact uptime-only flow records   */
+
+  u32 rematch_hosts;                    /* Hosts re-matched after last delta  */
+  u32 rematch_left;                     /* Hosts still to go (0 = done)       */
+  u32 rematch_changed;                  /* Re-matched hosts with new verdicts */
+
+  u32 conns;                            /* Per-connection verdict records     */
+
+  u64 http_cache_hits;                  /* HTTP matches answered from cache   */
+  u64 http_cache_misses;                /* HTTP matches done the long way     */
+  u64 ua_cache_hits;                    /* U-A -> OS lookups from cache       */
+  u64 ua_cache_misses;                  /* U-A -> OS lookups done in full     */
+
+} __attribute__((packed));
+
+/* Response to P0F_QUERY2_MAGIC: same data as p0f_api_response, plus a bit
+   more, with strings replaced by IDs (-1 = unknown) that can be looked up
+   with dictionary queries. */
+
+struct p0f_api_response2 {
+
+  u32 magic;                            /* Must be P0F_RESP2_MAGIC            */
+  u32 status;                           /* P0F_STATUS_*                       */
+
+  u32 fp_revision;                      /* Revision IDs are valid for         */
+  u32 fp_digest;                        /* Digest IDs are valid for           */
+
+  u32 first_seen;                       /* First seen (unix time)             */
+  u32 last_seen;                        /* Last seen (unix time)              */
+  u32 total_conn;                       /* Total connections seen             */
+
+  u32 uptime_min;                       /* Last uptime (minutes)              */
+  u32 up_mod_days;                      /* Uptime modulo (days)               */
+  u32 up_freq;                          /* Timestamp clock frequency (Hz)     */
+
+  u32 last_nat;                         /* NAT / LB last detected (unix time) */
+  u32 last_chg;                         /* OS chg last detected (unix time)   */
+
+  u16 nat_reasons;                      /* Reasons for last NAT detection     */
+  s16 distance;                         /* System distance                    */
+
+  u8  bad_sw;                           /* Host is lying about U-A / Server   */
+  u8  os_match_q;                       /* OS match quality                   */
+  u8  http_match_q;                     /* HTTP app match quality             */
+  u8  reserved;
+
+  s32 os_name_id;                       /* P0F_DICT_NAME                      */
+  s32 os_flavor_id;                     /* P0F_DICT_FLAVOR                    */
+  s32 http_name_id;                     /* P0F_DICT_NAME                      */
+  s32 http_flavor_id;                   /* P0F_DICT_FLAVOR                    */
+  s32 link_id;                          /* P0F_DICT_LINK                      */
+  s32 language_id;                      /* P0F_DICT_LANG                      */
+
+} __attribute__((packed));
+
+/* Dictionary query: returns as many strings as fit, starting at first_id. */
+
+struct p0f_dict_query {
+
+  u32 magic;                            /* Must be P0F_DICT_QUERY_MAGIC       */
+  u8  dict;                             /* P0F_DICT_*                         */
+  u8  reserved[3];
+  u32 first_id;                         /* First ID to return                 */
+
+} __attribute__((packed));
+
+struct p0f_dict_response {
+
+  u32 magic;                            /* Must be P0F_DICT_RESP_MAGIC        */
+  u32 status;                           /* P0F_STATUS_*                       */
+
+  u32 fp_revision;                      /* Cache entries only while these     */
+  u32 fp_digest;                        /* two stay the same                  */
+
+  u32 total;                            /* Number of IDs in the dictionary    */
+  u32 first_id;                         /* ID of the first string in data     */
+  u32 count;                            /* Number of strings in data          */
+
+  u8  data[P0F_DICT_DATA];              /* NUL-terminated strings, "" = none  */
+
+} __attribute__((packed));
+
+/* Wait query: same as P0F_QUERY2_MAGIC, except that the answer is held back
+   until the host gets a SYN or SYN+ACK verdict at or after 'since', or until
+   timeout_ms (capped at API_WAIT_MAX) runs out. Both go by the wall clock of
+   the p0f process, not by packet time. The response is p0f_api_response2;
+   on timeout, its status is P0F_STATUS_TIMEOUT and the rest has whatever is
+   known about the host, if anything. The first three fields match
+   p0f_api_query. */
+
+struct p0f_wait_query {
+
+  u32 magic;                            /* Must be P0F_WAIT_QUERY_MAGIC       */
+  u8  addr_type;                        /* P0F_ADDR_*                         */
+  u8  addr[16];                         /* IP address (big endian left align) */
+  u32 since;                            /* Oldest acceptable verdict (unix)   */
+  u32 timeout_ms;                       /* How long to wait                   */
+
+} __attribute__((packed));
+
+/* Tuple query: verdicts on the client side of one connection, seen while
+   p0f tracked it or at most CONN_LINGER seconds ago. Ports are in native
+   endian. IDs work as in p0f_api_response2. */
+
+struct p0f_tuple_query {
+
+  u32 magic;                            /* Must be P0F_TUPLE_QUERY_MAGIC      */
+  u8  addr_type;                        /* P0F_ADDR_*                         */
+  u8  cli_addr[16];                     /* Client address                     */
+  u8  srv_addr[16];                     /* Server address                     */
+  u16 cli_port;                         /* Client port                        */
+  u16 srv_port;                         /* Server port                        */
+
+} __attribute__((packed));
+
+struct p0f_tuple_response {
+
+  u32 magic;                            /* Must be P0F_TUPLE_RESP_MAGIC       */
+  u32 status;                           /* P0F_STATUS_*                       */
+
+  u32 fp_revision;                      /* Revision IDs are valid for         */
+  u32 fp_digest;                        /* Digest IDs are valid for           */
+
+  u32 first_seen;                       /* SYN seen (unix time)               */
+  u32 closed;                           /* Flow gone (unix time, 0 = not yet) */
+
+  s16 distance;                         /* Client distance (-1 = unknown)     */
+
+  u8  bad_sw;                           /* Client is lying about U-A          */
+  u8  os_match_q;                       /* OS match quality                   */
+  u8  http_match_q;                     /* HTTP app match quality             */
+  u8  reserved[3];
+
+  s32 os_name_id;                       /* P0F_DICT_NAME                      */
+  s32 os_flavor_id;                     /* P0F_DICT_FLAVOR                    */
+  s32 http_name_id;                     /* P0F_DICT_NAME                      */
+  s32 http_flavor_id;                   /* P0F_DICT_FLAVOR                    */
+  s32 link_id;                          /* P0F_DICT_LINK                      */
+  s32 language_id;                      /* P0F_DICT_LANG                      */
+
+} __attribute__((packed));
+
+/* Aggregate query: number of cached hosts per OS, HTTP application or link
+   type ID, among all hosts (prefix = 0) or those in the n-th -G prefix given
+   to p0f (prefix = n). IDs with no hosts are skipped. If there are more
+   than P0F_AGG_MAX to report, ask again with first_id = next_id. */
+
+struct p0f_agg_query {
+
+  u32 magic;                            /* Must be P0F_AGG_QUERY_MAGIC        */
+  u8  kind;                             /* P0F_AGG_*                          */
+  u8  prefix;                           /* -G prefix number, 0 = all hosts    */
+  u8  reserved[2];
+  u32 first_id;                         /* First ID to look at                */
+
+} __attribute__((packed));
+
+struct p0f_agg_entry {
+
+  u32 id;                               /* Dictionary ID                      */
+  u32 hosts;                            /* Hosts with that ID                 */
+
+} __attribute__((packed));
+
+struct p0f_agg_response {
+
+  u32 magic;                            /* Must be P0F_AGG_RESP_MAGIC         */
+  u32 status;                           /* P0F_STATUS_*                       */
+
+  u32 fp_revision;                      /* Revision IDs are valid for         */
+  u32 fp_digest;                        /* Digest IDs are valid for           */
+
+  u8  addr_type;                        /* Prefix type (P0F_ADDR_*, 0 = all)  */
+  u8  addr[16];                         /* Prefix address                     */
+  u8  prefix_len;                       /* Prefix length                      */
+  u8  reserved[2];
+
+  u32 hosts;                            /* Hosts in scope, known or not       */
+
+  u32 next_id;                          /* Where to continue, or total        */
+  u32 total;                            /* Number of IDs in the dictionary    */
+  u32 count;                            /* Valid entries                      */
+
+  struct p0f_agg_entry entry[P0F_AGG_MAX];
+
+} __attribute__((packed));
+
+/* Distinct count query: estimated number of distinct client addresses that
+   got a SYN+ACK from a server:port (P0F_CARD_SERVER), or of distinct host
+   addresses matched to an OS name ID (P0F_CARD_OS), in the current and in
+   the previous counting window. */
+
+struct p0f_card_query {
+
+  u32 magic;                            /* Must be P0F_CARD_QUERY_MAGIC       */
+  u8  kind;                             /* P0F_CARD_*                         */
+  u8  addr_type;                        /* P0F_ADDR_* (P0F_CARD_SERVER)       */
+  u8  addr[16];                         /* Server address (P0F_CARD_SERVER)   */
+  u16 port;                             /* Server port (P0F_CARD_SERVER)      */
+  s32 name_id;                          /* OS name ID (P0F_CARD_OS)           */
+
+} __attribute__((packed));
+
+struct p0f_card_response {
+
+  u32 magic;                            /* Must be P0F_CARD_RESP_MAGIC        */
+  u32 status;                           /* P0F_STATUS_*                       */
+
+  u32 fp_revision;                      /* Revision name_id is valid for      */
+  u32 fp_digest;                        /* Digest name_id is valid for        */
+
+  u32 window;                           /* Window length (seconds)            */
+  u32 cur_start;                        /* Start of the current window        */
+
+  u32 cur_est;                          /* Estimate for the current window    */
+  u32 prev_est;                         /* Estimate for the previous one      */
+
+} __attribute__((packed));
+
+/* Response to P0F_SVC_QUERY_MAGIC (sent as a struct p0f_api_query): ports
+   the host was seen serving, lowest first. Only the first 'count' entries
+   are valid. */
+
+struct p0f_svc_entry {
+
+  u16 port;                             /* Server port                        */
+  u8  flags;                            /* P0F_SVC_*                          */
+  u8  reserved;
+
+  s32 name_id;                          /* HTTP server name ID, or -1         */
+  s32 flavor_id;                        /* HTTP server flavor ID, or -1       */
+
+  u32 first_seen;                       /* First seen on this port            */
+  u32 last_seen;                        /* Last seen on this port             */
+
+} __attribute__((packed));
+
+struct p0f_svc_response {
+
+  u32 magic;                            /* Must be P0F_SVC_RESP_MAGIC         */
+  u32 status;                           /* P0F_STATUS_*                       */
+
+  u32 fp_revision;                      /* Revision IDs are valid for         */
+  u32 fp_digest;                        /* Digest IDs are valid for           */
+
+  u32 count;                            /* Valid entries                      */
+
+  struct p0f_svc_entry entry[P0F_SVC_MAX];
+
+} __attribute__((packed));
+
+/* Buffers large enough for any query or response: */
+
+union p0f_api_any_query {
+  struct p0f_api_query      host;
+  struct p0f_dict_query     dict;
+  struct p0f_wait_query     wait;
+  struct p0f_tuple_query    tuple;
+  struct p0f_agg_query      agg;
+  struct p0f_card_query     card;
+};
+
+union p0f_api_any_response {
+  struct p0f_api_response   host;
+  struct p0f_hist_response  hist;
+  struct p0f_stats_response stats;
+  struct p0f_api_response2  host2;
+  struct p0f_dict_response  dict;
+  struct p0f_tuple_response tuple;
+  struct p0f_agg_response   agg;
+  struct p0f_card_response  card;
+  struct p0f_svc_response   svc;
+};
+
 #ifdef _FROM_P0F
 
-void handle_query(struct p0f_api_query* q, struct p0f_api_response* r);
+struct api_client;
+struct host_data;
+
+u32 api_query_len(u32 magic);
+
+u32 handle_query(u8* q, u8* r);
+
+void api_park(struct api_client* c);
+
+void api_unpark(struct api_client* c);
+
+u8 api_answer_parked(s32* timeout);
+
+void api_wake(struct host_data* h);
 
-#endif /* _FROM_API */
+#endif /* _FROM_P0F */
 
 #endif /* !_HAVE_API_H */
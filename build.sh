@@ -24,14 +24,14 @@ USE_CFLAGS="-fstack-protector-all -fPIE -D_FORTIFY_SOURCE=2 -g -ggdb \
 USE_LDFLAGS="-Wl,-z,relro -pie $BASIC_LDFLAGS"
 
 if [ "$OSTYPE" = "cygwin" ]; then
-  USE_LIBS="-lwpcap $LIBS"
+  USE_LIBS="-lwpcap -lm $LIBS"
 elif [ "$OSTYPE" = "solaris" ]; then
-  USE_LIBS="-lsocket -lnsl $LIBS"
+  USE_LIBS="-lsocket -lnsl -lm $LIBS"
 else
-  USE_LIBS="-lpcap $LIBS"
+  USE_LIBS="-lpcap -lm $LIBS"
 fi
 
-OBJFILES="api.c process.c fp_tcp.c fp_mtu.c fp_http.c readfp.c"
+OBJFILES="api.c process.c flow_buf.c json.c logrot.c dgram.c plugin.c journal.c follow.c index.c agg.c hll.c fp_tcp.c fp_mtu.c fp_http.c readfp.c"
 
 echo "Welcome to the build script for $PROGNAME $VERSION!"
 echo "Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>"
@@ -310,6 +310,93 @@ fi
 
 echo "OK"
 
+echo -n "[*] Checking for working pthreads... "
+
+rm -f "$TMP" "$TMP.c" "$TMP.log" || exit 1
+
+echo -e "#include <pthread.h>\nint main() { pthread_t t; return pthread_create(&t, 0, 0, 0); }" >"$TMP.c" || exit 1
+$CC $USE_CFLAGS $USE_LDFLAGS "$TMP.c" -o "$TMP" $USE_LIBS -lpthread &>"$TMP.log"
+
+if [ ! -x "$TMP" ]; then
+  echo "FAIL"
+  echo
+  echo "Could not find a working pthreads library on your system. If it's available"
+  echo "in a non-standard location, set CFLAGS and LDFLAGS accordingly."
+  echo
+
+  rm -f "$TMP" "$TMP.log" "$TMP.c"
+  exit 1
+
+fi
+
+USE_LIBS="$USE_LIBS -lpthread"
+
+echo "OK"
+
+echo -n "[*] Checking for dlopen()... "
+
+rm -f "$TMP" "$TMP.c" "$TMP.log" || exit 1
+
+echo -e "#include <dlfcn.h>\nint main() { return !dlopen(0, RTLD_NOW); }" >"$TMP.c" || exit 1
+$CC $USE_CFLAGS $USE_LDFLAGS "$TMP.c" -o "$TMP" $USE_LIBS &>"$TMP.log"
+
+if [ ! -x "$TMP" ]; then
+
+  $CC $USE_CFLAGS $USE_LDFLAGS "$TMP.c" -o "$TMP" $USE_LIBS -ldl &>"$TMP.log"
+
+  if [ ! -x "$TMP" ]; then
+    echo "FAIL"
+    echo
+    echo "Could not find a working dlopen() on your system; it is needed for output"
+    echo "plugins. If it's available in a non-standard location, set CFLAGS and LDFLAGS"
+    echo "accordingly."
+    echo
+
+    rm -f "$TMP" "$TMP.log" "$TMP.c"
+    exit 1
+
+  fi
+
+  USE_LIBS="$USE_LIBS -ldl"
+
+fi
+
+echo "OK"
+
+echo -n "[*] Checking for log compression library... "
+
+rm -f "$TMP" "$TMP.c" "$TMP.log" || exit 1
+
+echo -e "#include <zstd.h>\nint main() { return !ZSTD_createCCtx(); }" >"$TMP.c" || exit 1
+$CC $USE_CFLAGS $USE_LDFLAGS "$TMP.c" -o "$TMP" $USE_LIBS -lzstd &>"$TMP.log"
+
+if [ -x "$TMP" ]; then
+
+  echo "zstd"
+  USE_CFLAGS="$USE_CFLAGS -DUSE_ZSTD=1"
+  USE_LIBS="$USE_LIBS -lzstd"
+
+else
+
+  rm -f "$TMP" "$TMP.c" "$TMP.log" || exit 1
+
+  echo -e "#include <zlib.h>\nint main() { return !gzdopen(1, \"wb\"); }" >"$TMP.c" || exit 1
+  $CC $USE_CFLAGS $USE_LDFLAGS "$TMP.c" -o "$TMP" $USE_LIBS -lz &>"$TMP.log"
+
+  if [ -x "$TMP" ]; then
+
+    echo "zlib"
+    USE_CFLAGS="$USE_CFLAGS -DUSE_ZLIB=1"
+    USE_LIBS="$USE_LIBS -lz"
+
+  else
+
+    echo "none (rotated logs will not be compressed)"
+
+  fi
+
+fi
+
 rm -f "$TMP" "$TMP.log" "$TMP.c" || exit 1
 
 echo "[+] Okay, you seem to be good to go. Fingers crossed!"
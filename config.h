@@ -29,6 +29,12 @@
 #  define LOG_MODE          0600
 #endif /* !LOG_MODE */
 
+/* Compression settings for rotated log segments (-R): */
+
+#define LOG_GZ_LEVEL        6
+#define LOG_ZSTD_LEVEL      3
+#define LOG_COMP_BUF        (64 * 1024)
+
 /* Initial permissions on API sockets: */
 
 #ifndef API_MODE
@@ -47,14 +53,42 @@
 #ifndef HOST_IDLE_LIMIT
 #  define CONN_MAX_AGE      30  /* seconds */
 #  define HOST_IDLE_LIMIT   120 /* minutes */
+#  define UPTIME_MAX_AGE    30  /* seconds */
 #endif /* !HOST_IDLE_LIMIT */
 
+/* Timeout for unanswered SYNs, in seconds (never more than CONN_MAX_AGE): */
+
+#define SYN_MAX_AGE         10
+
+/* How long per-connection verdicts stay around for API queries after the
+   flow itself is gone, in seconds: */
+
+#define CONN_LINGER         5
+
 /* Default number of API connections permitted (adjustable via -c): */
 
 #ifndef API_MAX_CONN
 #  define API_MAX_CONN      20
 #endif /* !API_MAX_CONN */
 
+/* Wait queries: hash buckets for parked clients, and the longest permitted
+   wait, in milliseconds: */
+
+#define API_WAIT_BUCKETS    64
+#define API_WAIT_MAX        30000
+
+/* Maximum number of prefixes with their own host counters (-G, < 32): */
+
+#define AGG_MAX_PREFIX      16
+
+/* Distinct client / host sketches: HyperLogLog registers per sketch (2^n,
+   about 1.04 / sqrt(2^n) standard error), server:port pairs tracked at
+   once, and the length of a counting window in seconds: */
+
+#define HLL_BITS            10
+#define HLL_SERVERS         512
+#define HLL_WINDOW          3600
+
 /* Maximum TTL distance for non-fuzzy signature matching: */
 
 #ifndef MAX_DIST
@@ -77,6 +111,12 @@
 
 #define KILL_PERCENT        10
 
+/* Maximum share of host entries (percent of -m) in the protected segment.
+   Hosts seen in more than one connection live there, and are evicted only
+   after all one-off hosts on probation: */
+
+#define PROTECT_PERCENT     80
+
 /* PCAP snapshot length: */
 
 #define SNAPLEN             65535
@@ -85,6 +125,65 @@
 
 #define MAX_FLOW_DATA       8192
 
+/* Size of a single chunk of flow payload storage: */
+
+#define FLOW_CHUNK_SIZE     1024
+
+/* Average number of payload chunks budgeted per tracked connection; the
+   global chunk pool is capped at this times the connection limit (-m): */
+
+#define FLOW_CHUNKS_PER_CONN 4
+
+/* Datagram output (-U): number of queued records, maximum record size, and
+   maximum number of records per sendmmsg() call: */
+
+#define DGRAM_QUEUE         1024
+#define DGRAM_MAX_LEN       2048
+#define DGRAM_BATCH         32
+
+/* Output plugins (-P): maximum number loaded, and queue length per plugin: */
+
+#define MAX_PLUGINS         8
+#define PLUGIN_QUEUE        256
+
+/* Host state journal (-c): queue length, group commit interval (ms), and the
+   compaction trigger - journal over JOURNAL_COMPACT times the snapshot size,
+   but no smaller than JOURNAL_MIN_SIZE bytes: */
+
+#define JOURNAL_QUEUE       4096
+#define JOURNAL_COMMIT_MS   200
+#define JOURNAL_COMPACT     2
+#define JOURNAL_MIN_SIZE    (1024 * 1024)
+
+/* Follow mode (-F): checkpoint file name, checkpoint interval (seconds), and
+   packets to process per pass over a capture file: */
+
+#define FOLLOW_CKPT         ".p0f-follow"
+#define FOLLOW_CKPT_SEC     5
+#define FOLLOW_BATCH        1000
+
+/* Initial size of the JSON record buffer (grows as needed, never shrinks): */
+
+#define JSON_BUF_INIT       1024
+
+/* Number of recent connections remembered per host (<= P0F_HIST_MAX), and
+   number of history rings allocated at once: */
+
+#define HOST_HISTORY        16
+#define HIST_SLAB           256
+
+/* Number of server ports remembered per host (<= P0F_SVC_MAX; the least
+   recently seen one makes room for a new one), and number of service sets
+   allocated at once: */
+
+#define HOST_SERVICES       16
+#define SVC_SLAB            256
+
+/* Maximum number of host updates per pcap_dispatch() batch that are timed
+   until they become visible to API queries (live captures only): */
+
+#define LAT_PENDING         1024
+
 /* Maximum number of TCP options we will process (< 256): */
 
 #define MAX_TCP_OPT         24
@@ -140,6 +239,12 @@
 
 #define SIG_BUCKETS         64
 
+/* Number of hash buckets for duplicate detection while loading p0f.fp, and
+   for looking up OS / application names and classes: */
+
+#define DUPE_BUCKETS        4096
+#define NAME_BUCKETS        1024
+
 /* Number of hash buckets for active connections: */
 
 #define FLOW_BUCKETS        256
@@ -148,9 +253,14 @@
 
 #define HOST_BUCKETS        1024
 
-/* Cache expiration interval (every n packets received): */
+/* Number of server:port sketches per hash bucket (HLL_SERVERS / this many
+   buckets); the least recently updated one is reused when a bucket fills: */
+
+#define HLL_WAYS            4
+
+/* Hosts to re-match per event loop iteration after signature deltas: */
 
-#define EXPIRE_INTERVAL     50
+#define REMATCH_SLICE       256
 
 /* Non-alphanumeric chars to permit in OS names. This is to allow 'sys' syntax
    to be used unambiguously, yet allow some freedom: */
@@ -167,7 +277,11 @@
 
 #define HTTP_MAX_URL        1024
 
-/* Maximum number of HTTP headers: */
+/* Maximum number of HTTP headers. Together with the two limits below, this
+   also bounds the copies of the last request and response kept with every
+   cached host for re-matching after deltas: up to about 34 kB of headers
+   each, on top of the ~1.2 kB the bare signature takes. Keep this in mind
+   when raising these limits or the host count given with -m: */
 
 #define HTTP_MAX_HDRS       32
 
@@ -187,6 +301,12 @@
 
 #define HTTP_MAX_DATE_DIFF  10
 
+/* Slots in the per-direction cache of HTTP signature matches, and in the
+   cache of User-Agent -> OS lookups: */
+
+#define HTTP_CACHE_SIZE     4096
+#define UA_CACHE_SIZE       4096
+
 #ifdef _FROM_FP_HTTP
 
 #include "fp_http.h"
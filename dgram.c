@@ -0,0 +1,296 @@
+/*
+   p0f - datagram output
+   ---------------------
+
+   Sends observation records to a local UNIX datagram socket, either as-is or
+   wrapped in RFC 5424 syslog headers. Records are copied into a fixed ring
+   of slots and sent in batches with sendmmsg(), always without blocking; if
+   the receiver can't keep up, the ring fills up and new records are dropped
+   and counted.
+
+   Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>
+
+   Distributed under the terms and conditions of GNU LGPL.
+
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "types.h"
+#include "config.h"
+#include "debug.h"
+#include "alloc-inl.h"
+#include "process.h"
+#include "dgram.h"
+
+static s32 dg_fd = -1;                  /* Datagram socket                    */
+
+static struct sockaddr_un dg_addr;      /* Receiver address                   */
+static u8 dg_connected;                 /* Socket connected to dg_addr?       */
+
+static u8 dg_syslog;                    /* Add RFC 5424 headers?              */
+
+static u8* slots;                       /* DGRAM_QUEUE * DGRAM_MAX_LEN bytes  */
+static u32 slot_len[DGRAM_QUEUE];       /* Used length of every slot          */
+
+static u32 q_head,                      /* Oldest queued slot                 */
+           q_cnt;                       /* Number of queued slots             */
+
+static u64 sent_cnt,                    /* Datagrams delivered                */
+           drop_cnt,                    /* Records dropped, queue full        */
+           big_cnt,                     /* Records dropped, too long          */
+           err_cnt;                     /* Failed connect / send attempts     */
+
+static u32 retry_after;                 /* Hold off sending until this time   */
+
+static u8 hostname[256];                /* For syslog headers                 */
+
+static u8  sl_hdr[384];                 /* Cached syslog header               */
+static u32 sl_hdr_len;                  /* Its length                         */
+static u32 sl_hdr_time;                 /* Second it was made for             */
+
+
+/* Connect the socket to the receiver. Returns 0 on success. */
+
+static s32 dg_connect(void) {
+
+  if (connect(dg_fd, (struct sockaddr*)&dg_addr, sizeof(dg_addr))) return -1;
+
+  dg_connected = 1;
+  return 0;
+
+}
+
+
+/* Set up the socket. The spec is either a path, or "syslog:" followed by
+   a path. This is called before dropping privileges, so that the path is
+   looked up outside of any chroot() jail. */
+
+void dgram_init(u8* spec) {
+
+  if (!strncmp((char*)spec, "syslog:", 7)) {
+    dg_syslog = 1;
+    spec += 7;
+  }
+
+  if (strlen((char*)spec) >= sizeof(dg_addr.sun_path))
+    FATAL("Datagram socket path is too long.");
+
+  dg_addr.sun_family = AF_UNIX;
+  strcpy(dg_addr.sun_path, (char*)spec);
+
+  dg_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (dg_fd < 0) PFATAL("socket() for datagram output failed.");
+
+  if (fcntl(dg_fd, F_SETFL, O_NONBLOCK))
+    PFATAL("fcntl() to set O_NONBLOCK on datagram socket fails.");
+
+  if (dg_connect() && !err_cnt++)
+    WARN("Unable to connect to '%s' (%s), will keep trying.", spec,
+         strerror(errno));
+
+  if (gethostname((char*)hostname, sizeof(hostname) - 1) || !hostname[0])
+    strcpy((char*)hostname, "-");
+
+  slots = DFL_ck_alloc(DGRAM_QUEUE * DGRAM_MAX_LEN);
+
+  SAYF("[+] Sending %s records to '%s'.\n", dg_syslog ? "syslog" : "raw",
+       spec);
+
+}
+
+
+/* Called after chroot(). If the receiver wasn't there at startup, the path
+   has to be looked up again from within the new root, so make sure that it
+   can be. */
+
+void dgram_chroot(void) {
+
+  if (dg_connected || !access(dg_addr.sun_path, F_OK)) return;
+
+  FATAL("Datagram socket '%s' not available, and not reachable after chroot.",
+        dg_addr.sun_path);
+
+}
+
+
+/* Return the syslog header for the current second: facility daemon, level
+   info, UTC timestamp, no structured data. */
+
+static void make_syslog_hdr(void) {
+
+  time_t ut = get_unix_time();
+  u8 tmp[32];
+
+  if (sl_hdr_len && sl_hdr_time == ut) return;
+
+  strftime((char*)tmp, sizeof(tmp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&ut));
+
+  sl_hdr_len = snprintf((char*)sl_hdr, sizeof(sl_hdr), "<30>1 %s %s p0f %u - - ",
+                        tmp, hostname, getpid());
+
+  sl_hdr_time = ut;
+
+}
+
+
+/* Copy a record into the ring. Trailing newline is stripped, since every
+   datagram holds exactly one record anyway. */
+
+void dgram_queue(u8* rec, u32 len) {
+
+  u32 slot, hlen = 0;
+  u8* dst;
+
+  if (len && rec[len - 1] == '\n') len--;
+
+  if (dg_syslog) {
+    make_syslog_hdr();
+    hlen = sl_hdr_len;
+  }
+
+  if (hlen + len > DGRAM_MAX_LEN) {
+    big_cnt++;
+    return;
+  }
+
+  if (q_cnt == DGRAM_QUEUE) {
+
+    /* Try to make room before giving up. */
+
+    dgram_flush();
+
+    if (q_cnt == DGRAM_QUEUE) {
+      drop_cnt++;
+      return;
+    }
+
+  }
+
+  slot = (q_head + q_cnt) % DGRAM_QUEUE;
+  dst  = slots + slot * DGRAM_MAX_LEN;
+
+  memcpy(dst, sl_hdr, hlen);
+  memcpy(dst + hlen, rec, len);
+  slot_len[slot] = hlen + len;
+
+  q_cnt++;
+
+  if (q_cnt >= DGRAM_BATCH) dgram_flush();
+
+}
+
+
+/* Send whatever is queued, up to the point where the socket would block. */
+
+void dgram_flush(void) {
+
+  struct mmsghdr msgs[DGRAM_BATCH];
+  struct iovec   iov[DGRAM_BATCH];
+
+  if (!q_cnt || dg_fd < 0) return;
+
+  if (retry_after && (u32)time(NULL) < retry_after) return;
+  retry_after = 0;
+
+  /* Receiver not there at startup, or restarted since. */
+
+  if (!dg_connected && dg_connect()) {
+
+    if (!err_cnt++) WARN("Unable to connect to '%s' (%s), will keep trying.",
+                         dg_addr.sun_path, strerror(errno));
+
+    retry_after = time(NULL) + 1;
+    return;
+
+  }
+
+  while (q_cnt) {
+
+    u32 n = MIN(q_cnt, DGRAM_BATCH), i;
+    s32 ret;
+
+    /* Don't wrap around the end of the ring within one batch. */
+
+    n = MIN(n, DGRAM_QUEUE - q_head);
+
+    memset(msgs, 0, n * sizeof(struct mmsghdr));
+
+    for (i = 0; i < n; i++) {
+
+      u32 slot = q_head + i;
+
+      iov[i].iov_base = slots + slot * DGRAM_MAX_LEN;
+      iov[i].iov_len  = slot_len[slot];
+
+      msgs[i].msg_hdr.msg_iov     = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen  = 1;
+
+    }
+
+#ifdef __linux__
+
+    ret = sendmmsg(dg_fd, msgs, n, MSG_DONTWAIT);
+
+#else
+
+    /* No sendmmsg(); fall back to one call per record. */
+
+    for (ret = 0; ret < n; ret++)
+      if (sendmsg(dg_fd, &msgs[ret].msg_hdr, MSG_DONTWAIT) < 0) break;
+
+    if (!ret) ret = -1;
+
+#endif /* ^__linux__ */
+
+    if (ret <= 0) {
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) return;
+
+      /* Receiver gone. Keep the data, and try to connect again in a second;
+         if this takes long, the ring fills up and we start dropping. */
+
+      dg_connected = 0;
+
+      if (!err_cnt++) WARN("Unable to send to '%s' (%s), will keep trying.",
+                           dg_addr.sun_path, strerror(errno));
+
+      retry_after = time(NULL) + 1;
+      return;
+
+    }
+
+    sent_cnt += ret;
+    q_head    = (q_head + ret) % DGRAM_QUEUE;
+    q_cnt    -= ret;
+
+    if (ret < n) return;
+
+  }
+
+}
+
+
+/* Say how things went. */
+
+void dgram_report(void) {
+
+  if (dg_fd < 0) return;
+
+  SAYF("[+] Datagram output: %llu sent, %llu dropped (queue full), "
+       "%llu dropped (too long), %u still queued.\n", sent_cnt, drop_cnt,
+       big_cnt, q_cnt);
+
+}
@@ -0,0 +1,26 @@
+/*
+   p0f - datagram output
+   ---------------------
+
+   Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>
+
+   Distributed under the terms and conditions of GNU LGPL.
+
+ */
+
+#ifndef _HAVE_DGRAM_H
+#define _HAVE_DGRAM_H
+
+#include "types.h"
+
+void dgram_init(u8* spec);
+
+void dgram_chroot(void);
+
+void dgram_queue(u8* rec, u32 len);
+
+void dgram_flush(void);
+
+void dgram_report(void);
+
+#endif /* !_HAVE_DGRAM_H */
@@ -0,0 +1,181 @@
+/*
+   p0f - chunked flow payload storage
+   ----------------------------------
+
+   Payload collected for application-level fingerprinting is kept in a list
+   of fixed-size chunks per flow. The chunks come from a global pool with a
+   hard cap, so appending data never moves what's already buffered, and the
+   heap doesn't get chewed up by a steady stream of growing reallocs.
+
+   Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>
+
+   Distributed under the terms and conditions of GNU LGPL.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "types.h"
+#include "config.h"
+#include "debug.h"
+#include "alloc-inl.h"
+#include "flow_buf.h"
+
+static struct flow_chunk* free_chunks;  /* Pool of released chunks            */
+
+static u32 chunk_cnt,                   /* Chunks allocated so far            */
+           chunk_max;                   /* Upper limit for chunk_cnt          */
+
+static u8  pool_warned;                 /* Complained about exhaustion?       */
+
+
+/* Set the global limit on the number of chunks. */
+
+void flow_pool_init(u32 max_chunks) {
+
+  chunk_max = max_chunks;
+
+  DEBUG("[#] Flow payload pool capped at %u chunks (%u kB).\n", chunk_max,
+        chunk_max * FLOW_CHUNK_SIZE / 1024);
+
+}
+
+
+/* Grab a chunk, either from the free list or by allocating a new one. Returns
+   NULL if the pool is exhausted. Chunks stay in the pool for the lifetime of
+   the process. */
+
+static struct flow_chunk* get_chunk(void) {
+
+  struct flow_chunk* ret = free_chunks;
+
+  if (ret) {
+
+    free_chunks = ret->next;
+
+  } else {
+
+    if (chunk_cnt >= chunk_max) {
+
+      if (!pool_warned) {
+        WARN("Flow payload pool exhausted (%u chunks). Use -m to adjust.",
+             chunk_max);
+        pool_warned = 1;
+      }
+
+      return NULL;
+
+    }
+
+    ret = DFL_ck_alloc(sizeof(struct flow_chunk));
+    chunk_cnt++;
+
+  }
+
+  ret->next = NULL;
+  return ret;
+
+}
+
+
+/* Append data to a buffer, returning the number of bytes actually stored.
+   If the pool runs dry, the buffer is marked as capped. */
+
+u32 flow_buf_append(struct flow_buf* b, u8* data, u32 len) {
+
+  u32 done = 0;
+
+  if (b->capped) return 0;
+
+  while (done < len) {
+
+    u32 off = b->len % FLOW_CHUNK_SIZE, amt;
+
+    if (!off) {
+
+      /* Tail chunk full (or no chunks at all) - add another one. */
+
+      struct flow_chunk* c = get_chunk();
+
+      if (!c) {
+        b->capped = 1;
+        break;
+      }
+
+      if (b->tail) b->tail->next = c; else b->head = c;
+      b->tail = c;
+
+    }
+
+    amt = MIN(len - done, FLOW_CHUNK_SIZE - off);
+
+    memcpy(b->tail->data + off, data + done, amt);
+
+    done   += amt;
+    b->len += amt;
+
+  }
+
+  return done;
+
+}
+
+
+/* Copy len bytes starting at off into a flat buffer. */
+
+void flow_buf_copy(struct flow_buf* b, u32 off, u32 len, u8* dst) {
+
+  struct flow_chunk* c = b->head;
+
+  if (off + len > b->len) FATAL("Read past the end of flow buffer.");
+
+  while (off >= FLOW_CHUNK_SIZE) {
+    c    = c->next;
+    off -= FLOW_CHUNK_SIZE;
+  }
+
+  while (len) {
+
+    u32 amt = MIN(len, FLOW_CHUNK_SIZE - off);
+
+    memcpy(dst, c->data + off, amt);
+
+    dst += amt;
+    len -= amt;
+    off  = 0;
+    c    = c->next;
+
+  }
+
+}
+
+
+/* Return a NUL-terminated copy of the specified region. */
+
+u8* flow_buf_dup_str(struct flow_buf* b, u32 off, u32 len) {
+
+  u8* ret = ck_alloc(len + 1);
+
+  flow_buf_copy(b, off, len, ret);
+
+  return ret;
+
+}
+
+
+/* Return all chunks to the pool. */
+
+void flow_buf_free(struct flow_buf* b) {
+
+  if (b->tail) {
+    b->tail->next = free_chunks;
+    free_chunks   = b->head;
+  }
+
+  b->head = b->tail = NULL;
+  b->len  = 0;
+
+}
@@ -0,0 +1,93 @@
+/*
+   p0f - chunked flow payload storage
+   ----------------------------------
+
+   Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>
+
+   Distributed under the terms and conditions of GNU LGPL.
+
+ */
+
+#ifndef _HAVE_FLOW_BUF_H
+#define _HAVE_FLOW_BUF_H
+
+#include "types.h"
+#include "config.h"
+
+/* Fixed-size chunk of payload data, handed out from a global pool: */
+
+struct flow_chunk {
+
+  struct flow_chunk* next;              /* Next chunk in flow or free list    */
+  u8 data[FLOW_CHUNK_SIZE];             /* Payload bytes                      */
+
+};
+
+/* Per-direction payload buffer, a singly linked list of chunks: */
+
+struct flow_buf {
+
+  struct flow_chunk *head, *tail;       /* Chunk list                         */
+  u32 len;                              /* Captured data length               */
+  u8  capped;                           /* No more appends (pool out, or gap) */
+
+};
+
+/* Cursor for reading a flow_buf; keeps track of the last visited chunk, so
+   that forward scans cost O(1) per byte: */
+
+struct flow_rd {
+
+  struct flow_buf* b;                   /* Buffer being read                  */
+  struct flow_chunk* c;                 /* Chunk containing offset 'base'     */
+  u32 base;                             /* Buffer offset of c->data[0]        */
+
+};
+
+void flow_pool_init(u32 max_chunks);
+
+u32 flow_buf_append(struct flow_buf* b, u8* data, u32 len);
+
+void flow_buf_copy(struct flow_buf* b, u32 off, u32 len, u8* dst);
+
+u8* flow_buf_dup_str(struct flow_buf* b, u32 off, u32 len);
+
+void flow_buf_free(struct flow_buf* b);
+
+
+/* Can any more data be collected in this buffer? */
+
+static inline u8 flow_buf_room(struct flow_buf* b) {
+  return b->len < MAX_FLOW_DATA && !b->capped;
+}
+
+
+/* Set up a cursor at the beginning of a buffer. */
+
+static inline void flow_rd_init(struct flow_rd* r, struct flow_buf* b) {
+  r->b    = b;
+  r->c    = b->head;
+  r->base = 0;
+}
+
+
+/* Read byte at the specified offset. The caller must make sure that
+   off < r->b->len. */
+
+static inline u8 flow_rd_at(struct flow_rd* r, u32 off) {
+
+  if (off < r->base) {
+    r->c    = r->b->head;
+    r->base = 0;
+  }
+
+  while (off - r->base >= FLOW_CHUNK_SIZE) {
+    r->c     = r->c->next;
+    r->base += FLOW_CHUNK_SIZE;
+  }
+
+  return r->c->data[off - r->base];
+
+}
+
+#endif /* !_HAVE_FLOW_BUF_H */
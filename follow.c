@@ -0,0 +1,381 @@
+/*
+   p0f - capture directory follow mode
+   -----------------------------------
+
+   With -F, p0f watches a directory that another tool keeps writing rotated
+   pcap files to, and processes the files one by one, in version sort order
+   (so that both 'dump.pcap9' < 'dump.pcap10' and timestamped names work).
+   A file is picked up once inotify reports it closed after writing or moved
+   into place, or once a later file shows up. Host and flow state simply
+   carries over from one file to the next.
+
+   Progress is saved to a small checkpoint file (the name of the current file
+   and the offset of the next packet, or -1 once done), written atomically
+   every FOLLOW_CKPT_SEC seconds, at the end of each file, and on shutdown.
+   On restart, p0f resumes from there instead of starting over.
+
+   Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>
+
+   Distributed under the terms and conditions of GNU LGPL.
+
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#  include <sys/inotify.h>
+#endif /* __linux__ */
+
+#include "types.h"
+#include "config.h"
+#include "debug.h"
+#include "alloc-inl.h"
+#include "follow.h"
+
+#define CKPT_TMP     FOLLOW_CKPT ".new"
+
+#ifndef __linux__
+#  define strverscmp(_a, _b) strcmp(_a, _b)
+#endif /* !__linux__ */
+
+static s32 dir_fd = -1,                 /* Followed directory                 */
+           ino_fd = -1,                 /* inotify descriptor                 */
+           ckpt_fd = -1;                /* Checkpoint directory               */
+
+static u8* cur_name;                    /* Current (or last finished) file    */
+static u8  cur_done;                    /* cur_name fully processed?          */
+static s64 cur_off;                     /* Offset of the next packet          */
+
+static u8** closed;                     /* Files reported closed by inotify   */
+static u32  closed_cnt;
+
+static time_t last_ckpt;                /* Last checkpoint (wall time)        */
+
+
+/* Save progress: current file name, and offset (-1 = done). */
+
+static void write_checkpoint(s64 off) {
+
+  u8  buf[64 + NAME_MAX];
+  s32 fd, len;
+
+  len = snprintf((char*)buf, sizeof(buf), "%lld %s\n", (long long)off,
+                 cur_name);
+
+  fd = openat(ckpt_fd, CKPT_TMP, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+  if (fd < 0 || write(fd, buf, len) != len || fsync(fd)) {
+    WARN("Unable to write follow checkpoint (%s).", strerror(errno));
+    if (fd >= 0) close(fd);
+    return;
+  }
+
+  close(fd);
+
+  if (renameat(ckpt_fd, CKPT_TMP, ckpt_fd, FOLLOW_CKPT)) {
+    WARN("Unable to rename follow checkpoint (%s).", strerror(errno));
+    return;
+  }
+
+  last_ckpt = time(NULL);
+
+}
+
+
+/* Load the checkpoint left by a previous run, if any. */
+
+static void load_checkpoint(void) {
+
+  u8  buf[64 + NAME_MAX], *nl, *name;
+  s32 fd, len;
+  long long off;
+
+  fd = openat(ckpt_fd, FOLLOW_CKPT, O_RDONLY);
+
+  if (fd < 0) {
+    if (errno != ENOENT) PFATAL("Unable to open follow checkpoint.");
+    return;
+  }
+
+  len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+
+  if (len <= 0) return;
+  buf[len] = 0;
+
+  nl   = (u8*)strchr((char*)buf, '\n');
+  name = (u8*)strchr((char*)buf, ' ');
+
+  if (!nl || !name || name > nl || sscanf((char*)buf, "%lld", &off) != 1 ||
+      off < -1) {
+    WARN("Malformed follow checkpoint, starting from scratch.");
+    return;
+  }
+
+  *nl = 0;
+  name++;
+
+  cur_name = ck_strdup(name);
+  cur_done = (off < 0);
+  cur_off  = cur_done ? 0 : off;
+
+  if (cur_done)
+    SAYF("[+] Resuming after '%s'.\n", cur_name);
+  else
+    SAYF("[+] Resuming '%s' at offset %lld.\n", cur_name, off);
+
+}
+
+
+/* Start following a directory. The checkpoint goes to ckpt_dir, or to the
+   followed directory itself if NULL. */
+
+void follow_open(u8* dir, u8* ckpt_dir) {
+
+#ifndef __linux__
+
+  FATAL("Follow mode (-F) needs inotify, which is Linux-only.");
+
+#else
+
+  dir_fd = open((char*)dir, O_RDONLY | O_DIRECTORY);
+  if (dir_fd < 0) PFATAL("Cannot open directory '%s'.", dir);
+
+  ino_fd = inotify_init1(IN_NONBLOCK);
+  if (ino_fd < 0) PFATAL("inotify_init1() failed.");
+
+  if (inotify_add_watch(ino_fd, (char*)dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    PFATAL("Cannot watch directory '%s'.", dir);
+
+  if (ckpt_dir) {
+
+    ckpt_fd = open((char*)ckpt_dir, O_RDONLY | O_DIRECTORY);
+    if (ckpt_fd < 0) PFATAL("Cannot open directory '%s'.", ckpt_dir);
+
+  } else ckpt_fd = dir_fd;
+
+  SAYF("[+] Following capture files in '%s'.\n", dir);
+
+  load_checkpoint();
+
+#endif /* ^!__linux__ */
+
+}
+
+
+/* Descriptor to poll() for new files. */
+
+s32 follow_fd(void) {
+
+  return ino_fd;
+
+}
+
+
+/* Was this file reported closed? */
+
+static u8 is_closed(u8* name) {
+
+  u32 i;
+
+  for (i = 0; i < closed_cnt; i++)
+    if (!strcmp((char*)closed[i], (char*)name)) return 1;
+
+  return 0;
+
+}
+
+
+/* Read pending inotify events, note closed files. */
+
+void follow_events(void) {
+
+#ifdef __linux__
+
+  u8  buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  s32 len;
+
+  while ((len = read(ino_fd, buf, sizeof(buf))) > 0) {
+
+    u8* p = buf;
+
+    while (p < buf + len) {
+
+      struct inotify_event* ev = (struct inotify_event*)p;
+
+      p += sizeof(struct inotify_event) + ev->len;
+
+      if (ev->mask & IN_Q_OVERFLOW)
+        DEBUG("[#] inotify queue overflow, relying on later files.\n");
+
+      if (!ev->len || ev->name[0] == '.' || is_closed((u8*)ev->name))
+        continue;
+
+      DEBUG("[#] Capture file closed: %s\n", ev->name);
+
+      closed = ck_realloc(closed, (closed_cnt + 1) * sizeof(u8*));
+      closed[closed_cnt++] = ck_strdup((u8*)ev->name);
+
+    }
+
+  }
+
+  if (len < 0 && errno != EAGAIN && errno != EINTR)
+    PFATAL("read() from inotify descriptor failed.");
+
+#endif /* __linux__ */
+
+}
+
+
+/* Is this directory entry a regular file? */
+
+static u8 is_file(struct dirent* de) {
+
+  struct stat st;
+
+  if (de->d_type == DT_REG) return 1;
+  if (de->d_type != DT_UNKNOWN) return 0;
+
+  return !fstatat(dir_fd, de->d_name, &st, 0) && S_ISREG(st.st_mode);
+
+}
+
+
+/* Find and open the next complete file. Returns a descriptor and the offset
+   to start reading at, or -1 if nothing is ready yet. */
+
+s32 follow_next(u8** name, s64* off) {
+
+  while (1) {
+
+    DIR* d;
+    struct dirent* de;
+
+    u8* best  = NULL;
+    u8  later = 0;
+    s32 fd;
+
+    fd = dup(dir_fd);
+    if (fd < 0 || !(d = fdopendir(fd))) PFATAL("Unable to read directory.");
+
+    rewinddir(d);
+
+    while ((de = readdir(d))) {
+
+      if (de->d_name[0] == '.' || !is_file(de)) continue;
+
+      /* Skip what's been done, but not a file we stopped halfway through. */
+
+      if (cur_name) {
+        s32 c = strverscmp(de->d_name, (char*)cur_name);
+        if (c < 0 || (!c && cur_done)) continue;
+      }
+
+      if (!best) { best = ck_strdup((u8*)de->d_name); continue; }
+
+      later = 1;
+
+      if (strverscmp(de->d_name, (char*)best) < 0) {
+        ck_free(best);
+        best = ck_strdup((u8*)de->d_name);
+      }
+
+    }
+
+    closedir(d);
+
+    if (!best) return -1;
+
+    /* The newest file may still be in the works. */
+
+    if (!later && !is_closed(best)) {
+      ck_free(best);
+      return -1;
+    }
+
+    if (cur_name && !cur_done && !strcmp((char*)best, (char*)cur_name)) {
+      *off = cur_off;
+    } else {
+      *off = cur_off = 0;
+    }
+
+    ck_free(cur_name);
+    cur_name = best;
+    cur_done = 0;
+
+    fd = openat(dir_fd, (char*)cur_name, O_RDONLY);
+
+    if (fd >= 0) {
+      *name = cur_name;
+      return fd;
+    }
+
+    WARN("Unable to open '%s' (%s), skipping.", cur_name, strerror(errno));
+    follow_done();
+
+  }
+
+}
+
+
+/* Note the offset of the next packet in the current file; checkpoint it
+   every now and then. */
+
+void follow_progress(s64 off) {
+
+  cur_off = off;
+
+  if (time(NULL) - last_ckpt >= FOLLOW_CKPT_SEC) write_checkpoint(off);
+
+}
+
+
+/* Current file done. Checkpoint it, forget inotify notes up to it. */
+
+void follow_done(void) {
+
+  u32 i, j = 0;
+
+  cur_done = 1;
+  write_checkpoint(-1);
+
+  for (i = 0; i < closed_cnt; i++) {
+
+    if (strverscmp((char*)closed[i], (char*)cur_name) <= 0) ck_free(closed[i]);
+    else closed[j++] = closed[i];
+
+  }
+
+  closed_cnt = j;
+
+}
+
+
+/* Save final position on shutdown, clean up. */
+
+void follow_shutdown(void) {
+
+  u32 i;
+
+  if (cur_name && !cur_done) write_checkpoint(cur_off);
+
+  for (i = 0; i < closed_cnt; i++) ck_free(closed[i]);
+
+  ck_free(closed);
+  ck_free(cur_name);
+
+}
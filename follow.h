@@ -0,0 +1,30 @@
+/*
+   p0f - capture directory follow mode
+   -----------------------------------
+
+   Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>
+
+   Distributed under the terms and conditions of GNU LGPL.
+
+ */
+
+#ifndef _HAVE_FOLLOW_H
+#define _HAVE_FOLLOW_H
+
+#include "types.h"
+
+void follow_open(u8* dir, u8* ckpt_dir);
+
+s32 follow_fd(void);
+
+void follow_events(void);
+
+s32 follow_next(u8** name, s64* off);
+
+void follow_progress(s64 off);
+
+void follow_done(void);
+
+void follow_shutdown(void);
+
+#endif /* !_HAVE_FOLLOW_H */
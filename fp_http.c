@@ -27,6 +27,8 @@
 #include "process.h"
 #include "readfp.h"
 #include "p0f.h"
+#include "journal.h"
+#include "agg.h"
 #include "tcp.h"
 #include "hash.h"
 
@@ -34,20 +36,59 @@
 #include "languages.h"
 
 static u8** hdr_names;                 /* List of header names by ID         */
+static u8*  hdr_valued;                /* Value checked by sigs (1 << to_srv) */
 static u32  hdr_cnt;                   /* Number of headers registered       */
 
 static u32* hdr_by_hash[SIG_BUCKETS];  /* Hashed header names                */
 static u32  hbh_cnt[SIG_BUCKETS];      /* Number of headers in bucket        */
 
 /* Signatures aren't bucketed due to the complex matching used; but we use
-   Bloom filters to go through them quickly. */
+   Bloom filters to go through them quickly. As in fp_tcp.c, records are
+   never freed, so that retiring them doesn't leave dangling pointers. */
 
-static struct http_sig_record* sigs[2];
+static struct http_sig_record** sigs[2];
 static u32 sig_cnt[2];
 
+/* For duplicate detection at load time, non-generic signatures are also
+   filed under one of the headers they require - whichever bucket is least
+   crowded at the time - and a new signature only needs to be checked against
+   the buckets of headers it has. The extra bucket is for signatures that
+   require none. */
+
+static struct http_sig_record** dupes[2][DUPE_BUCKETS + 1];
+static u32 dupe_cnt[2][DUPE_BUCKETS + 1];
+
 static struct ua_map_record* ua_map;   /* Mappings between U-A and OS        */
 static u32 ua_map_cnt;
 
+/* Match verdicts depend only on the header ID sequence, the values of the
+   headers that signatures look at, and the software string, so they are
+   cached under a serialized copy of these. U-A -> OS mappings are cached
+   by U-A. Both caches are direct-mapped; entries stored before the last
+   signature or ua_os change are stale. */
+
+struct http_cache_entry {
+  u8* key;                              /* Serialized signature (NULL = none) */
+  u32 key_len;                          /* Length of key                      */
+  u32 gen;                              /* cache_gen at the time              */
+  struct http_sig_record* matched;      /* Match, if any                      */
+  u8  dishonest;                        /* "sw" looked forged?                */
+};
+
+struct ua_cache_entry {
+  u8* sw;                               /* U-A string (NULL = none)           */
+  u32 gen;                              /* cache_gen at the time              */
+  s32 id;                               /* OS name ID, or -1                  */
+};
+
+static struct http_cache_entry http_cache[2][HTTP_CACHE_SIZE];
+static struct ua_cache_entry ua_cache[UA_CACHE_SIZE];
+
+static u32 cache_gen = 1;               /* Bumped on database changes         */
+
+u64 http_cache_hits, http_cache_misses, /* Cache statistics for the API       */
+    ua_cache_hits, ua_cache_misses;
+
 #define SLOF(_str) (u8*)_str, strlen((char*)_str)
 
 
@@ -84,11 +125,13 @@ static s32 lookup_hdr(u8* name, u32 len, u8 create) {
 
   if (!create) return -1;
 
-  hdr_names = DFL_ck_realloc(hdr_names, (hdr_cnt + 1) * sizeof(u8*));
+  FP_GROW(hdr_names, hdr_cnt);
   hdr_names[hdr_cnt] = DFL_ck_memdup_str(name, len);
 
-  hdr_by_hash[bucket] = DFL_ck_realloc(hdr_by_hash[bucket],
-    (hbh_cnt[bucket] + 1) * 4);
+  FP_GROW(hdr_valued, hdr_cnt);
+  hdr_valued[hdr_cnt] = 0;
+
+  FP_GROW(hdr_by_hash[bucket], hbh_cnt[bucket]);
 
   hdr_by_hash[bucket][hbh_cnt[bucket]++] = hdr_cnt++;
 
@@ -157,99 +200,113 @@ void http_init(void) {
 }
 
 
-/* Find match for a signature. */
+/* Check if a reference signature matches the collected data (or, when
+   doing dupe detection, covers another signature). */
 
-static void http_find_match(u8 to_srv, struct http_sig* ts, u8 dupe_det) {
+static inline u8 http_sig_match(struct http_sig* rs, struct http_sig* ts,
+                                u8 dupe_det) {
 
-  struct http_sig_record* gmatch = NULL;
-  struct http_sig_record* ref = sigs[to_srv];
-  u32 cnt = sig_cnt[to_srv];
+  u32 ts_hdr = 0, rs_hdr = 0;
 
-  while (cnt--) {
+  if (rs->http_ver != -1 && rs->http_ver != ts->http_ver) return 0;
 
-    struct http_sig* rs = ref->sig;
-    u32 ts_hdr = 0, rs_hdr = 0;
+  /* Check that all the headers listed for the p0f.fp signature (probably)
+     appear in the examined traffic. */
 
-    if (rs->http_ver != -1 && rs->http_ver != ts->http_ver) goto next_sig;
+  if ((ts->hdr_bloom4 & rs->hdr_bloom4) != rs->hdr_bloom4) return 0;
 
-    /* Check that all the headers listed for the p0f.fp signature (probably)
-       appear in the examined traffic. */
+  /* Confirm the ordering and values of headers (this is relatively
+     slow, hence the Bloom filter first). */
 
-    if ((ts->hdr_bloom4 & rs->hdr_bloom4) != rs->hdr_bloom4) goto next_sig;
+  while (rs_hdr < rs->hdr_cnt) {
 
-    /* Confirm the ordering and values of headers (this is relatively
-       slow, hence the Bloom filter first). */
+    u32 orig_ts = ts_hdr;
 
-    while (rs_hdr < rs->hdr_cnt) {
+    while (rs->hdr[rs_hdr].id != ts->hdr[ts_hdr].id &&
+           ts_hdr < ts->hdr_cnt) ts_hdr++;
 
-      u32 orig_ts = ts_hdr;
+    if (ts_hdr == ts->hdr_cnt) {
 
-      while (rs->hdr[rs_hdr].id != ts->hdr[ts_hdr].id &&
-             ts_hdr < ts->hdr_cnt) ts_hdr++;
+      if (!rs->hdr[rs_hdr].optional) return 0;
 
-      if (ts_hdr == ts->hdr_cnt) {
+      /* If this is an optional header, check that it doesn't appear
+         anywhere else. */
 
-        if (!rs->hdr[rs_hdr].optional) goto next_sig;
+      for (ts_hdr = 0; ts_hdr < ts->hdr_cnt; ts_hdr++)
+        if (rs->hdr[rs_hdr].id == ts->hdr[ts_hdr].id) return 0;
 
-        /* If this is an optional header, check that it doesn't appear
-           anywhere else. */
+      ts_hdr = orig_ts;
+      rs_hdr++;
+      continue;
 
-        for (ts_hdr = 0; ts_hdr < ts->hdr_cnt; ts_hdr++)
-          if (rs->hdr[rs_hdr].id == ts->hdr[ts_hdr].id) goto next_sig;
+    }
 
-        ts_hdr = orig_ts;
-        rs_hdr++;
-        continue;
+    if (rs->hdr[rs_hdr].value &&
+        (!ts->hdr[ts_hdr].value ||
+        !strstr((char*)ts->hdr[ts_hdr].value,
+        (char*)rs->hdr[rs_hdr].value))) return 0;
 
-      }
+    ts_hdr++;
+    rs_hdr++;
 
-      if (rs->hdr[rs_hdr].value &&
-          (!ts->hdr[ts_hdr].value ||
-          !strstr((char*)ts->hdr[ts_hdr].value,
-          (char*)rs->hdr[rs_hdr].value))) goto next_sig;
+  }
 
-      ts_hdr++;
-      rs_hdr++;
+  /* Check that the headers forbidden in p0f.fp don't appear in the traffic.
+     We first check if they seem to appear in ts->hdr_bloom4, and only if so,
+     we do a full check. */
 
-    }
+  for (rs_hdr = 0; rs_hdr < rs->miss_cnt; rs_hdr++) {
 
-    /* Check that the headers forbidden in p0f.fp don't appear in the traffic.
-       We first check if they seem to appear in ts->hdr_bloom4, and only if so,
-       we do a full check. */
+    u64 miss_bloom4 = bloom4_64(rs->miss[rs_hdr]);
 
-    for (rs_hdr = 0; rs_hdr < rs->miss_cnt; rs_hdr++) {
+    if ((ts->hdr_bloom4 & miss_bloom4) != miss_bloom4) continue;
 
-      u64 miss_bloom4 = bloom4_64(rs->miss[rs_hdr]);
+    /* Okay, possible instance of a banned header - scan list... */
 
-      if ((ts->hdr_bloom4 & miss_bloom4) != miss_bloom4) continue;
+    for (ts_hdr = 0; ts_hdr < ts->hdr_cnt; ts_hdr++)
+      if (rs->miss[rs_hdr] == ts->hdr[ts_hdr].id) return 0;
 
-      /* Okay, possible instance of a banned header - scan list... */
+  }
 
-      for (ts_hdr = 0; ts_hdr < ts->hdr_cnt; ts_hdr++)
-        if (rs->miss[rs_hdr] == ts->hdr[ts_hdr].id) goto next_sig;
+  /* When doing dupe detection, we want to allow a signature with additional
+     banned headers to precede one with fewer, or with a different set. */
+
+  if (dupe_det) {
+
+    if (rs->miss_cnt > ts->miss_cnt) return 0;
+
+    for (rs_hdr = 0; rs_hdr < rs->miss_cnt; rs_hdr++) {
+
+      for (ts_hdr = 0; ts_hdr < ts->miss_cnt; ts_hdr++) 
+        if (rs->miss[rs_hdr] == ts->miss[ts_hdr]) break;
+
+      /* One of the reference headers doesn't appear in current sig! */
+
+      if (ts_hdr == ts->miss_cnt) return 0;
 
     }
 
-    /* When doing dupe detection, we want to allow a signature with additional
-       banned headers to precede one with fewer, or with a different set. */
+  }
 
-    if (dupe_det) {
+  return 1;
 
-      if (rs->miss_cnt > ts->miss_cnt) goto next_sig;
+}
 
-      for (rs_hdr = 0; rs_hdr < rs->miss_cnt; rs_hdr++) {
 
-        for (ts_hdr = 0; ts_hdr < ts->miss_cnt; ts_hdr++) 
-          if (rs->miss[rs_hdr] == ts->miss[ts_hdr]) break;
+/* Find match for a signature. */
 
-        /* One of the reference headers doesn't appear in current sig! */
+static void http_find_match(u8 to_srv, struct http_sig* ts) {
 
-        if (ts_hdr == ts->miss_cnt) goto next_sig;
+  struct http_sig_record* gmatch = NULL;
+  struct http_sig_record** refp = sigs[to_srv];
+  u32 cnt = sig_cnt[to_srv];
 
-      }
+  while (cnt--) {
 
+    struct http_sig_record* ref = *refp++;
+    struct http_sig* rs = ref->sig;
 
-    }
+    if (!http_sig_match(rs, ts, 0)) continue;
 
     /* Whoa, a match. */
 
@@ -264,15 +321,11 @@ static void http_find_match(u8 to_srv, struct http_sig* ts, u8 dupe_det) {
 
     } else if (!gmatch) gmatch = ref;
 
-next_sig:
-
-    ref = ref + 1;
-
   }
 
   /* A generic signature is the best we could find. */
 
-  if (!dupe_det && gmatch) {
+  if (gmatch) {
 
     ts->matched = gmatch;
 
@@ -284,6 +337,151 @@ next_sig:
 }
 
 
+/* Same as http_find_match(), but consult the cache first. */
+
+static void http_cached_match(u8 to_srv, struct http_sig* ts) {
+
+  static u8 key[1 + HTTP_MAX_HDRS * (6 + HTTP_MAX_HDR_VAL) +
+                HTTP_MAX_HDR_VAL + 2];
+
+  struct http_cache_entry* ce;
+  u32 i, len = 0;
+
+#define KEY_ADD(_ptr, _len) do { \
+    if (len + (_len) > sizeof(key)) goto no_cache; \
+    memcpy(key + len, _ptr, _len); \
+    len += (_len); \
+  } while (0)
+
+#define KEY_STR(_str) do { \
+    u8* _s = (_str) ? (_str) : (u8*)""; \
+    KEY_ADD(_s, strlen((char*)_s) + 1); \
+  } while (0)
+
+  KEY_ADD(&ts->http_ver, 1);
+
+  for (i = 0; i < ts->hdr_cnt; i++) {
+
+    s32 id = ts->hdr[i].id;
+
+    KEY_ADD(&id, 4);
+
+    if (id >= 0 && (hdr_valued[id] & (1 << to_srv)))
+      KEY_STR(ts->hdr[i].value);
+
+  }
+
+  /* Sigs with a 'sw' part check it against this. */
+
+  KEY_ADD((u8*)(ts->sw ? "\1" : "\0"), 1);
+  KEY_STR(ts->sw);
+
+#undef KEY_ADD
+#undef KEY_STR
+
+  ce = &http_cache[to_srv][hash32(key, len, hash_seed) % HTTP_CACHE_SIZE];
+
+  if (ce->key && ce->gen == cache_gen && ce->key_len == len &&
+      !memcmp(ce->key, key, len)) {
+
+    http_cache_hits++;
+
+    ts->matched   = ce->matched;
+    ts->dishonest = ce->dishonest;
+    return;
+
+  }
+
+  http_cache_misses++;
+
+  http_find_match(to_srv, ts);
+
+  ck_free(ce->key);
+
+  ce->key       = ck_memdup(key, len);
+  ce->key_len   = len;
+  ce->gen       = cache_gen;
+  ce->matched   = ts->matched;
+  ce->dishonest = ts->dishonest;
+
+  return;
+
+no_cache:
+
+  http_find_match(to_srv, ts);
+
+}
+
+
+/* Look for an earlier signature that covers a new one, going through the
+   buckets of every header it has (once each), plus the catch-all one. */
+
+static void http_find_dupe(u8 to_srv, struct http_sig* ts) {
+
+  u8  seen[DUPE_BUCKETS / 8 + 1];
+  u32 i, b = DUPE_BUCKETS;
+
+  memset(seen, 0, sizeof(seen));
+
+  for (i = 0; i <= ts->hdr_cnt; i++) {
+
+    struct http_sig_record** refp;
+    u32 cnt;
+
+    if (i) {
+
+      b = ts->hdr[i - 1].id % DUPE_BUCKETS;
+      if (seen[b / 8] & (1 << (b % 8))) continue;
+
+    }
+
+    seen[b / 8] |= 1 << (b % 8);
+
+    refp = dupes[to_srv][b];
+    cnt  = dupe_cnt[to_srv][b];
+
+    while (cnt--) {
+
+      struct http_sig_record* ref = *refp++;
+
+      if (http_sig_match(ref->sig, ts, 1)) {
+        ts->matched = ref;
+        return;
+      }
+
+    }
+
+  }
+
+}
+
+
+/* File a new non-generic signature for dupe detection. */
+
+static void add_dupe(u8 to_srv, struct http_sig_record* hrec) {
+
+  struct http_sig* hs = hrec->sig;
+  u32 i, b = DUPE_BUCKETS;
+
+  for (i = 0; i < hs->hdr_cnt; i++) {
+
+    u32 cand;
+
+    if (hs->hdr[i].optional) continue;
+
+    cand = hs->hdr[i].id % DUPE_BUCKETS;
+
+    if (b == DUPE_BUCKETS || dupe_cnt[to_srv][cand] < dupe_cnt[to_srv][b])
+      b = cand;
+
+  }
+
+  FP_GROW(dupes[to_srv][b], dupe_cnt[to_srv][b]);
+  dupes[to_srv][b][dupe_cnt[to_srv][b]++] = hrec;
+
+}
+
+
 /* Register new HTTP signature. */
 
 void http_register_sig(u8 to_srv, u8 generic, s32 sig_class, u32 sig_name,
@@ -297,10 +495,7 @@ void http_register_sig(u8 to_srv, u8 generic, s32 sig_class, u32 sig_name,
 
   hsig = DFL_ck_alloc(sizeof(struct http_sig));
 
-  sigs[to_srv] = DFL_ck_realloc(sigs[to_srv], sizeof(struct http_sig_record) *
-    (sig_cnt[to_srv] + 1));
-
-  hrec = &sigs[to_srv][sig_cnt[to_srv]];
+  hrec = DFL_ck_alloc(sizeof(struct http_sig_record));
 
   if (val[1] != ':') FATAL("Malformed signature in line %u.", line_no);
 
@@ -357,6 +552,7 @@ void http_register_sig(u8 to_srv, u8 generic, s32 sig_class, u32 sig_name,
         FATAL("Malformed signature in line %u.", line_no);
 
       hsig->hdr[hsig->hdr_cnt].value = DFL_ck_memdup_str(val, nxt - val);
+      hdr_valued[id] |= 1 << to_srv;
 
       val = nxt + 1;
 
@@ -412,7 +608,7 @@ void http_register_sig(u8 to_srv, u8 generic, s32 sig_class, u32 sig_name,
 
   }
 
-  http_find_match(to_srv, hsig, 1);
+  http_find_dupe(to_srv, hsig);
 
   if (hsig->matched)
     FATAL("Signature in line %u is already covered by line %u.",
@@ -429,7 +625,82 @@ void http_register_sig(u8 to_srv, u8 generic, s32 sig_class, u32 sig_name,
 
   hrec->sig      = hsig;
 
-  sig_cnt[to_srv]++;
+  FP_GROW(sigs[to_srv], sig_cnt[to_srv]);
+
+  sigs[to_srv][sig_cnt[to_srv]++] = hrec;
+
+  cache_gen++;
+
+  if (!generic) add_dupe(to_srv, hrec);
+
+}
+
+
+/* Unlink signatures with a given label from a list, return their number. */
+
+static u32 unlink_sigs(struct http_sig_record** refp, u32* cnt, u8 generic,
+                       s32 sig_class, u32 sig_name, u8* sig_flavor) {
+
+  u32 i, ret = 0;
+
+  for (i = 0; i < *cnt; i++) {
+
+    struct http_sig_record* ref = refp[i];
+
+    if (ref->generic != generic || ref->class_id != sig_class ||
+        ref->name_id != sig_name) continue;
+
+    if (ref->flavor ? (!sig_flavor || strcmp((char*)ref->flavor,
+        (char*)sig_flavor)) : !!sig_flavor) continue;
+
+    memmove(refp + i, refp + i + 1,
+            (*cnt - i - 1) * sizeof(struct http_sig_record*));
+
+    (*cnt)--;
+    i--;
+    ret++;
+
+  }
+
+  return ret;
+
+}
+
+
+/* Unlink all signatures with a given label, return their number. */
+
+u32 http_retire_sigs(u8 to_srv, u8 generic, s32 sig_class, u32 sig_name,
+                     u8* sig_flavor) {
+
+  u32 b, ret;
+
+  ret = unlink_sigs(sigs[to_srv], &sig_cnt[to_srv], generic, sig_class,
+                    sig_name, sig_flavor);
+
+  cache_gen++;
+
+  if (!generic)
+    for (b = 0; b <= DUPE_BUCKETS; b++)
+      unlink_sigs(dupes[to_srv][b], &dupe_cnt[to_srv][b], generic, sig_class,
+                  sig_name, sig_flavor);
+
+  return ret;
+
+}
+
+
+/* Map a language ID back to its name, or NULL if there is no such ID. */
+
+u8* http_lang_name(u32 id) {
+
+  u32 row = id / MAX_LANG, pos;
+
+  if (row > 255) return NULL;
+
+  for (pos = 0; pos <= id % MAX_LANG; pos++)
+    if (!languages[row][pos * 2]) return NULL;
+
+  return (u8*)languages[row][pos * 2 - 1];
 
 }
 
@@ -474,8 +745,8 @@ void http_parse_ua(u8* val, u32 line_no) {
 
     }
 
-    ua_map = DFL_ck_realloc(ua_map, (ua_map_cnt + 1) *
-                        sizeof(struct ua_map_record));
+    FP_GROW(ua_map, ua_map_cnt);
+    cache_gen++;
 
     ua_map[ua_map_cnt].id = id;
    
@@ -654,6 +925,38 @@ static u8* dump_flags(struct http_sig* hsig, struct http_sig_record* m) {
 }
 
 
+/* OS a User-Agent string points to, or -1 if it doesn't say. */
+
+static s32 ua_os_id(u8* sw) {
+
+  u32 i, len = strlen((char*)sw);
+  struct ua_cache_entry* ce = &ua_cache[hash32(sw, len, hash_seed) %
+                                        UA_CACHE_SIZE];
+
+  if (ce->sw && ce->gen == cache_gen && !strcmp((char*)ce->sw, (char*)sw)) {
+    ua_cache_hits++;
+    return ce->id;
+  }
+
+  ua_cache_misses++;
+
+  ck_free(ce->sw);
+
+  ce->sw  = ck_memdup_str(sw, len);
+  ce->gen = cache_gen;
+  ce->id  = -1;
+
+  for (i = 0; i < ua_map_cnt; i++)
+    if (strstr((char*)sw, (char*)ua_map[i].name)) {
+      ce->id = ua_map[i].id;
+      break;
+    }
+
+  return ce->id;
+
+}
+
+
 /* Score signature differences. For unknown signatures, the presumption is that
    they identify apps, so the logic is quite different from TCP. */
 
@@ -775,27 +1078,17 @@ static void score_nat(u8 to_srv, struct packet_flow* f) {
 
   if (to_srv && m->class_id == -1 && f->http_tmp.sw && !f->http_tmp.dishonest) {
 
-    u32 i;
-
-    for (i = 0; i < ua_map_cnt; i++)
-      if (strstr((char*)f->http_tmp.sw, (char*)ua_map[i].name)) break;
+    s32 ua_id = ua_os_id(f->http_tmp.sw);
 
-    if (i != ua_map_cnt) {
+    if (ua_id != -1) {
 
-      if (ua_map[i].id != hd->last_name_id) {
+      if (ua_id != hd->last_name_id) {
 
         DEBUG("[#] Otherwise plausible User-Agent points to another OS.\n");
         score  += 4;
         reason |= NAT_APP_UA;
 
-        if (!hd->bad_sw) hd->bad_sw = 1;
-
-      } else {
-
-        DEBUG("[#] User-Agent OS value checks out.\n");
-        hd->bad_sw = 0;
-
-      }
+      } else DEBUG("[#] User-Agent OS value checks out.\n");
 
     }
 
@@ -841,14 +1134,136 @@ header_check:
 }
 
 
+/* Make a standalone copy of a signature, headers included, so that it can
+   be matched again later on. */
+
+static struct http_sig* keep_sig(struct http_sig* hs) {
+
+  struct http_sig* ret = ck_memdup(hs, sizeof(struct http_sig));
+  u32 i;
+
+  ret->sw = ret->lang = ret->via = NULL;
+
+  for (i = 0; i < hs->hdr_cnt; i++) {
+
+    if (hs->hdr[i].name) ret->hdr[i].name = ck_strdup(hs->hdr[i].name);
+    if (hs->hdr[i].value) ret->hdr[i].value = ck_strdup(hs->hdr[i].value);
+
+    if (hs->sw && hs->hdr[i].value == hs->sw) ret->sw = ret->hdr[i].value;
+
+  }
+
+  return ret;
+
+}
+
+
+/* Free a signature made with keep_sig(), or a stripped-down copy. */
+
+void http_free_sig(struct http_sig* hs) {
+
+  if (!hs) return;
+
+  free_sig_hdrs(hs);
+  ck_free(hs);
+
+}
+
+
+/* Update the verdicts of a host from a matched request or response. Used on
+   live traffic and when re-matching stored signatures after a delta, so that
+   both follow the same rules. */
+
+static void update_host(u8 to_srv, struct host_data* hd, struct http_sig* sig) {
+
+  struct http_sig_record* m = sig->matched;
+
+  if (!m) return;
+
+  if (m->class_id != -1) {
+
+    /* If this is an OS signature, update host record. For requests, also
+       keep a stripped-down copy to score future ones against. */
+
+    if (to_srv) {
+
+      ck_free(hd->http_req_os);
+      hd->http_req_os = ck_memdup(sig, sizeof(struct http_sig));
+
+      hd->http_req_os->hdr_cnt = 0;
+      hd->http_req_os->sw   = NULL;
+      hd->http_req_os->lang = NULL;
+      hd->http_req_os->via  = NULL;
+
+    }
+
+    hd->last_class_id = m->class_id;
+    hd->last_name_id  = m->name_id;
+    hd->last_flavor   = m->flavor;
+    hd->last_label_id = m->label_id;
+    hd->last_quality  = (m->generic * P0F_MATCH_GENERIC);
+
+  } else {
+
+    /* Otherwise, record app data for the API. */
+
+    hd->http_name_id  = m->name_id;
+    hd->http_flavor   = m->flavor;
+    hd->http_label_id = m->label_id;
+    hd->http_quality  = m->generic * P0F_MATCH_GENERIC;
+
+    if (sig->dishonest) {
+
+      hd->bad_sw = 2;
+
+    } else if (to_srv && sig->sw) {
+
+      /* Otherwise plausible U-A; see if it agrees with the OS on file. */
+
+      s32 ua_id = ua_os_id(sig->sw);
+
+      if (ua_id != -1) {
+
+        if (ua_id != hd->last_name_id) {
+          if (!hd->bad_sw) hd->bad_sw = 1;
+        } else hd->bad_sw = 0;
+
+      }
+
+    }
+
+  }
+
+}
+
+
+/* Match the stored request or response signature of a host against the
+   current database again (say, after a delta), and update its verdicts the
+   same way fingerprint_http() would. */
+
+void http_rematch(u8 to_srv, struct host_data* hd) {
+
+  struct http_sig* sig = to_srv ? hd->http_req : hd->http_resp;
+
+  sig->matched   = NULL;
+  sig->dishonest = 0;
+
+  http_find_match(to_srv, sig);
+
+  update_host(to_srv, hd, sig);
+
+}
+
+
 /* Look up HTTP signature, create an observation. */
 
 static void fingerprint_http(u8 to_srv, struct packet_flow* f) {
 
   struct http_sig_record* m;
   u8* lang = NULL;
+  s32 lang_id = -1;
 
-  http_find_match(to_srv, &f->http_tmp, 0);
+  http_cached_match(to_srv, &f->http_tmp);
 
   start_observation(to_srv ? "http request" : "http response", 4, to_srv, f);
 
@@ -858,6 +1273,10 @@ static void fingerprint_http(u8 to_srv, struct packet_flow* f) {
             fp_os_names[m->name_id], m->flavor ? " " : "",
             m->flavor ? m->flavor : (u8*)"");
 
+    add_observation_num("name_id", m->name_id);
+    add_observation_num("label_id", m->label_id);
+    add_observation_num("sig_line", m->line_no);
+
   } else add_observation_field("app", NULL);
 
   if (f->http_tmp.lang && isalpha(f->http_tmp.lang[0]) &&
@@ -876,6 +1295,8 @@ static void fingerprint_http(u8 to_srv, struct packet_flow* f) {
       else add_observation_field("lang", 
            (lang = (u8*)languages[lh][pos + 1]));
 
+    if (lang) lang_id = lh * MAX_LANG + pos / 2;
+
   } else add_observation_field("lang", (u8*)"none");
 
   add_observation_field("params", dump_flags(&f->http_tmp, m));
@@ -890,45 +1311,35 @@ static void fingerprint_http(u8 to_srv, struct packet_flow* f) {
 
     /* For server response, always store the signature. */
 
-    ck_free(f->server->http_resp);
-    f->server->http_resp = ck_memdup(&f->http_tmp, sizeof(struct http_sig));
-
-    f->server->http_resp->hdr_cnt = 0;
-    f->server->http_resp->sw   = NULL;
-    f->server->http_resp->lang = NULL;
-    f->server->http_resp->via  = NULL;
+    http_free_sig(f->server->http_resp);
+    f->server->http_resp = keep_sig(&f->http_tmp);
 
     f->server->http_resp_port = f->srv_port;
 
-    if (lang) f->server->language = lang;
-
-    if (m) {
-
-      if (m->class_id != -1) {
+    add_host_service(f->server, f->srv_port,
+                     (m && m->class_id == -1) ? m->name_id : -1,
+                     (m && m->class_id == -1) ? m->label_id : -1,
+                     P0F_SVC_HTTP);
 
-        /* If this is an OS signature, update host record. */
-
-        f->server->last_class_id = m->class_id;
-        f->server->last_name_id  = m->name_id;
-        f->server->last_flavor   = m->flavor;
-        f->server->last_quality  = (m->generic * P0F_MATCH_GENERIC);
-
-      } else {
-
-        /* Otherwise, record app data. */
+    if (lang) {
+      f->server->language = lang;
+      f->server->lang_id  = lang_id;
+    }
 
-        f->server->http_name_id = m->name_id;
-        f->server->http_flavor  = m->flavor;
+    update_host(0, f->server, &f->http_tmp);
 
-        if (f->http_tmp.dishonest) f->server->bad_sw = 2;
+  } else {
 
-      }
+    http_free_sig(f->client->http_req);
+    f->client->http_req = keep_sig(&f->http_tmp);
 
+    if (lang) {
+      f->client->language = lang;
+      f->client->lang_id  = lang_id;
+      f->cv->lang_id      = lang_id;
     }
 
-  } else {
-
-    if (lang) f->client->language = lang;
+    update_host(1, f->client, &f->http_tmp);
 
     if (m) {
 
@@ -936,29 +1347,33 @@ static void fingerprint_http(u8 to_srv, struct packet_flow* f) {
 
         /* Client request - only OS sig is of any note. */
 
-        ck_free(f->client->http_req_os);
-        f->client->http_req_os = ck_memdup(&f->http_tmp,
-          sizeof(struct http_sig));
+        if (f->cv->os_name_id == -1) {
+          f->cv->os_name_id  = m->name_id;
+          f->cv->os_label_id = m->label_id;
+          f->cv->os_quality  = m->generic * P0F_MATCH_GENERIC;
+        }
+
+      } else {
 
-        f->client->http_req_os->hdr_cnt = 0;
-        f->client->http_req_os->sw   = NULL;
-        f->client->http_req_os->lang = NULL;
-        f->client->http_req_os->via  = NULL;
+        /* Record app data for this connection. */
 
-        f->client->last_class_id = m->class_id;
-        f->client->last_name_id  = m->name_id;
-        f->client->last_flavor   = m->flavor;
+        f->cv->http_name_id  = m->name_id;
+        f->cv->http_label_id = m->label_id;
+        f->cv->http_quality  = m->generic * P0F_MATCH_GENERIC;
 
-        f->client->last_quality  = (m->generic * P0F_MATCH_GENERIC);
+        /* Same U-A checks as for the host, against this connection's SYN. */
 
-      } else {
+        if (f->http_tmp.dishonest) {
 
-        /* Record app data for the API. */
+          f->cv->bad_sw = 2;
 
-        f->client->http_name_id = m->name_id;
-        f->client->http_flavor  = m->flavor;
+        } else if (f->http_tmp.sw && f->cv->os_name_id != -1) {
 
-        if (f->http_tmp.dishonest) f->client->bad_sw = 2;
+          s32 ua_id = ua_os_id(f->http_tmp.sw);
+
+          if (ua_id != -1 && ua_id != f->cv->os_name_id) f->cv->bad_sw = 1;
+
+        }
 
       }
  
@@ -966,6 +1381,10 @@ static void fingerprint_http(u8 to_srv, struct packet_flow* f) {
 
   }
 
+  note_host_update();
+  journal_host(to_srv ? f->client : f->server);
+  agg_update_host(to_srv ? f->client : f->server);
+
 }
 
 
@@ -1003,23 +1422,28 @@ static u32 parse_date(u8* str) {
 
 static u8 parse_pairs(u8 to_srv, struct packet_flow* f, u8 can_get_more) {
 
-  u32 plen = to_srv ? f->req_len : f->resp_len;
+  struct flow_buf* pay = to_srv ? &f->request : &f->response;
+  struct flow_rd rd;
+
+  u32 plen = pay->len;
 
   u32 off;
 
+  flow_rd_init(&rd, pay);
+
   /* Try to parse name: value pairs. */
 
   while ((off = f->http_pos) < plen) {
 
-    u8* pay = to_srv ? f->request : f->response;
-
+    u8  name[HTTP_MAX_HDR_NAME + 2];
     u32 nlen, vlen, vstart;
     s32 hid;
     u32 hcount;
+    u8  chr = flow_rd_at(&rd, off);
 
     /* Empty line? Dispatch for fingerprinting! */
 
-    if (pay[off] == '\r' || pay[off] == '\n') {
+    if (chr == '\r' || chr == '\n') {
 
       f->http_tmp.recv_date = get_unix_time();
 
@@ -1064,8 +1488,8 @@ static u8 parse_pairs(u8 to_srv, struct packet_flow* f, u8 can_get_more) {
       
     nlen = 0;
 
-    while ((isalnum(pay[off]) || pay[off] == '-' || pay[off] == '_') &&
-           off < plen && nlen <= HTTP_MAX_HDR_NAME) {
+    while (off < plen && nlen <= HTTP_MAX_HDR_NAME &&
+           (isalnum(chr = flow_rd_at(&rd, off)) || chr == '-' || chr == '_')) {
 
       off++;
       nlen++;
@@ -1088,10 +1512,12 @@ static u8 parse_pairs(u8 to_srv, struct packet_flow* f, u8 can_get_more) {
 
     /* Empty, excessively long, or non-':'-followed header name? */
 
-    if (!nlen || pay[off] != ':' || nlen > HTTP_MAX_HDR_NAME) {
+    chr = flow_rd_at(&rd, off);
+
+    if (!nlen || chr != ':' || nlen > HTTP_MAX_HDR_NAME) {
 
       DEBUG("[#] Invalid HTTP header encountered (len = %u, char = 0x%02x).\n",
-            nlen, pay[off]);
+            nlen, chr);
 
       f->in_http = -1;
       return 0;
@@ -1103,14 +1529,15 @@ static u8 parse_pairs(u8 to_srv, struct packet_flow* f, u8 can_get_more) {
 
     off++;
 
-    if (off < plen && isblank(pay[off])) off++;
+    if (off < plen && isblank(flow_rd_at(&rd, off))) off++;
 
     vstart = off;
     vlen = 0;
 
     /* Find the next \n. */
 
-    while (off < plen && vlen <= HTTP_MAX_HDR_VAL && pay[off] != '\n') {
+    while (off < plen && vlen <= HTTP_MAX_HDR_VAL &&
+           flow_rd_at(&rd, off) != '\n') {
 
       off++;
       vlen++;
@@ -1138,12 +1565,16 @@ static u8 parse_pairs(u8 to_srv, struct packet_flow* f, u8 can_get_more) {
 
     /* If party is using \r\n terminators, go back one char. */
 
-    if (pay[off - 1] == '\r') vlen--;
+    if (flow_rd_at(&rd, off - 1) == '\r') vlen--;
  
     /* Header value starts at vstart, and has vlen bytes (may be zero). Record
-       this in the signature. */
+       this in the signature. The name may straddle a chunk boundary, so get
+       a flat copy first. */
+
+    flow_buf_copy(pay, f->http_pos, nlen, name);
+    name[nlen] = 0;
 
-    hid = lookup_hdr(pay + f->http_pos, nlen, 0);
+    hid = lookup_hdr(name, nlen, 0);
 
     f->http_tmp.hdr[hcount].id = hid;
 
@@ -1151,7 +1582,7 @@ static u8 parse_pairs(u8 to_srv, struct packet_flow* f, u8 can_get_more) {
 
       /* Header ID not found, store literal value. */
 
-      f->http_tmp.hdr[hcount].name = ck_memdup_str(pay + f->http_pos, nlen);
+      f->http_tmp.hdr[hcount].name = ck_memdup_str(name, nlen);
 
     } else {
 
@@ -1166,7 +1597,7 @@ static u8 parse_pairs(u8 to_srv, struct packet_flow* f, u8 can_get_more) {
 
     if (vlen) {
 
-      u8* val = ck_memdup_str(pay + vstart, vlen);
+      u8* val = flow_buf_dup_str(pay, vstart, vlen);
 
       f->http_tmp.hdr[hcount].value = val;
 
@@ -1213,7 +1644,8 @@ static u8 parse_pairs(u8 to_srv, struct packet_flow* f, u8 can_get_more) {
 
 
 /* Examine request or response; returns 1 if more data needed and plausibly can
-   be read. Note that the buffer is always NUL-terminated. */
+   be read. Payload is kept in chunks, so all reads go through flow_rd_at() or
+   flow_buf_copy(). */
 
 u8 process_http(u8 to_srv, struct packet_flow* f) {
 
@@ -1223,8 +1655,10 @@ u8 process_http(u8 to_srv, struct packet_flow* f) {
 
   if (to_srv) {
 
-    u8* pay = f->request;
-    u8 can_get_more = (f->req_len < MAX_FLOW_DATA);
+    struct flow_buf* pay = &f->request;
+    struct flow_rd rd;
+    u8 can_get_more = flow_buf_room(pay);
+    u8 tmp[8];
     u32 off;
 
     /* Request done, but pending response? */
@@ -1234,11 +1668,11 @@ u8 process_http(u8 to_srv, struct packet_flow* f) {
     if (!f->in_http) {
 
       u8 chr;
-      u8* sig_at;
+      u32 sig_at;
 
       /* Ooh, new flow! */
 
-      if (f->req_len < 15) return can_get_more;
+      if (pay->len < 15) return can_get_more;
 
       /* Scan until \n, or until binary data spotted. */
 
@@ -1246,15 +1680,23 @@ u8 process_http(u8 to_srv, struct packet_flow* f) {
 
       /* We only care about GET and HEAD requests at this point. */
 
-      if (!off && strncmp((char*)pay, "GET /", 5) &&
-          strncmp((char*)pay, "HEAD /", 6)) {
-        DEBUG("[#] Does not seem like a GET / HEAD request.\n");
-        f->in_http = -1;
-        return 0;
+      if (!off) {
+
+        flow_buf_copy(pay, 0, 6, tmp);
+
+        if (strncmp((char*)tmp, "GET /", 5) &&
+            strncmp((char*)tmp, "HEAD /", 6)) {
+          DEBUG("[#] Does not seem like a GET / HEAD request.\n");
+          f->in_http = -1;
+          return 0;
+        }
+
       }
 
-      while (off < f->req_len && off < HTTP_MAX_URL &&
-             (chr = pay[off]) != '\n') {
+      flow_rd_init(&rd, pay);
+
+      while (off < pay->len && off < HTTP_MAX_URL &&
+             (chr = flow_rd_at(&rd, off)) != '\n') {
 
         if (chr != '\r' && (chr < 0x20 || chr > 0x7f)) {
 
@@ -1281,7 +1723,7 @@ u8 process_http(u8 to_srv, struct packet_flow* f) {
 
       /* Not enough data yet? */
 
-      if (off == f->req_len) {
+      if (off == pay->len) {
 
         f->http_pos = off;
 
@@ -1296,12 +1738,14 @@ u8 process_http(u8 to_srv, struct packet_flow* f) {
 
       }
 
-      sig_at = pay + off - 8;
-      if (pay[off - 1] == '\r') sig_at--;
+      sig_at = off - 8;
+      if (flow_rd_at(&rd, off - 1) == '\r') sig_at--;
+
+      flow_buf_copy(pay, sig_at, 8, tmp);
 
       /* Bad HTTP/1.x signature? */
 
-      if (strncmp((char*)sig_at, "HTTP/1.", 7)) {
+      if (strncmp((char*)tmp, "HTTP/1.", 7)) {
 
         DEBUG("[#] Not HTTP - bad signature.\n");
 
@@ -1310,7 +1754,7 @@ u8 process_http(u8 to_srv, struct packet_flow* f) {
 
       }
 
-      f->http_tmp.http_ver = (sig_at[7] == '1');
+      f->http_tmp.http_ver = (tmp[7] == '1');
 
       f->in_http  = 1;
       f->http_pos = off + 1;
@@ -1323,8 +1767,10 @@ u8 process_http(u8 to_srv, struct packet_flow* f) {
 
   } else {
 
-    u8* pay = f->response;
-    u8 can_get_more = (f->resp_len < MAX_FLOW_DATA);
+    struct flow_buf* pay = &f->response;
+    struct flow_rd rd;
+    u8 can_get_more = flow_buf_room(pay);
+    u8 tmp[8];
     u32 off;
 
     /* Response before request? Bail out. */
@@ -1338,14 +1784,16 @@ u8 process_http(u8 to_srv, struct packet_flow* f) {
 
       u8 chr;
 
-      if (f->resp_len < 13) return can_get_more;
+      if (pay->len < 13) return can_get_more;
 
       /* Scan until \n, or until binary data spotted. */
 
       off = f->http_pos;
 
-      while (off < f->resp_len && off < HTTP_MAX_URL &&
-             (chr = pay[off]) != '\n') {
+      flow_rd_init(&rd, pay);
+
+      while (off < pay->len && off < HTTP_MAX_URL &&
+             (chr = flow_rd_at(&rd, off)) != '\n') {
 
         if (chr != '\r' && (chr < 0x20 || chr > 0x7f)) {
 
@@ -1373,7 +1821,7 @@ u8 process_http(u8 to_srv, struct packet_flow* f) {
 
       /* Not enough data yet? */
 
-      if (off == f->resp_len) {
+      if (off == pay->len) {
 
         f->http_pos = off;
 
@@ -1388,9 +1836,11 @@ u8 process_http(u8 to_srv, struct packet_flow* f) {
 
       }
 
+      flow_buf_copy(pay, 0, 8, tmp);
+
       /* Bad HTTP/1.x signature? */
 
-      if (strncmp((char*)pay, "HTTP/1.", 7)) {
+      if (strncmp((char*)tmp, "HTTP/1.", 7)) {
 
         DEBUG("[#] Invalid HTTP response - bad signature.\n");
 
@@ -1399,7 +1849,7 @@ u8 process_http(u8 to_srv, struct packet_flow* f) {
 
       }
 
-      f->http_tmp.http_ver = (pay[7] == '1');
+      f->http_tmp.http_ver = (tmp[7] == '1');
 
       f->http_pos = off + 1;
 
@@ -88,6 +88,7 @@ struct http_sig_record {
 /* Register new HTTP signature. */
 
 struct packet_flow;
+struct host_data;
 
 void http_parse_ua(u8* val, u32 line_no);
 
@@ -95,10 +96,23 @@ void http_register_sig(u8 to_srv, u8 generic, s32 sig_class, u32 sig_name,
                        u8* sig_flavor, u32 label_id, u32* sys, u32 sys_cnt,
                        u8* val, u32 line_no);
 
+u32 http_retire_sigs(u8 to_srv, u8 generic, s32 sig_class, u32 sig_name,
+                     u8* sig_flavor);
+
 u8 process_http(u8 to_srv, struct packet_flow* f);
 
 void free_sig_hdrs(struct http_sig* h);
 
+void http_free_sig(struct http_sig* hs);
+
+void http_rematch(u8 to_srv, struct host_data* hd);
+
 void http_init(void);
 
+#define HTTP_LANG_IDS        (256 * 3)  /* 256 hash rows * MAX_LANG           */
+
+u8* http_lang_name(u32 id);
+
+extern u64 http_cache_hits, http_cache_misses, ua_cache_hits, ua_cache_misses;
+
 #endif /* _HAVE_FP_HTTP_H */
@@ -24,12 +24,16 @@
 #include "readfp.h"
 #include "p0f.h"
 #include "tcp.h"
+#include "agg.h"
 
 #include "fp_mtu.h"
 
 static struct mtu_sig_record* sigs[SIG_BUCKETS];
 static u32 sig_cnt[SIG_BUCKETS];
 
+u8** fp_links;                          /* Link types, by ID                  */
+u32  fp_link_cnt;                       /* Number of link types               */
+
 
 /* Register a new MTU signature. */
 
@@ -49,11 +53,20 @@ void mtu_register_sig(u8* name, u8* val, u32 line_no) {
 
   bucket = mtu % SIG_BUCKETS;
 
+  /* All sigs under one label share the name pointer, so this is enough to
+     give every label one ID. */
+
+  if (!fp_link_cnt || fp_links[fp_link_cnt - 1] != name) {
+    fp_links = DFL_ck_realloc(fp_links, (fp_link_cnt + 1) * sizeof(u8*));
+    fp_links[fp_link_cnt++] = name;
+  }
+
   sigs[bucket] = DFL_ck_realloc(sigs[bucket], (sig_cnt[bucket] + 1) *
                                 sizeof(struct mtu_sig_record));
 
   sigs[bucket][sig_cnt[bucket]].mtu = mtu;
   sigs[bucket][sig_cnt[bucket]].name = name;
+  sigs[bucket][sig_cnt[bucket]].link_id = fp_link_cnt - 1;
 
   sig_cnt[bucket]++;
 
@@ -82,11 +95,21 @@ void fingerprint_mtu(u8 to_srv, struct packet_data* pk, struct packet_flow* f) {
 
     add_observation_field("link", sigs[bucket][i].name);
 
-    if (to_srv) f->client->link_type = sigs[bucket][i].name;
-    else f->server->link_type = sigs[bucket][i].name;
+    if (to_srv) {
+      f->client->link_type = sigs[bucket][i].name;
+      f->client->link_id   = sigs[bucket][i].link_id;
+      f->cv->link_id       = sigs[bucket][i].link_id;
+      agg_update_host(f->client);
+    } else {
+      f->server->link_type = sigs[bucket][i].name;
+      f->server->link_id   = sigs[bucket][i].link_id;
+      agg_update_host(f->server);
+    }
 
   }
 
+  add_observation_num("mtu", mtu);
+
   OBSERVF("raw_mtu", "%u", mtu);
 
 }
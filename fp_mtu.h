@@ -19,6 +19,7 @@ struct mtu_sig_record {
 
   u8* name;
   u16 mtu;
+  u16 link_id;                          /* Index in fp_links                  */
 
 };
 
@@ -27,6 +28,9 @@ struct mtu_sig_record {
 struct packet_data;
 struct packet_flow;
 
+extern u8** fp_links;
+extern u32  fp_link_cnt;
+
 void mtu_register_sig(u8* name, u8* val, u32 line_no);
 
 void fingerprint_mtu(u8 to_srv, struct packet_data* pk, struct packet_flow* f);
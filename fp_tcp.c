@@ -8,6 +8,8 @@
 
  */
 
+#define _FROM_P0F
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -15,6 +17,7 @@
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <ctype.h>
+#include <time.h>
 
 #include "types.h"
 #include "config.h"
@@ -25,14 +28,27 @@
 #include "tcp.h"
 #include "readfp.h"
 #include "p0f.h"
+#include "journal.h"
+#include "agg.h"
+#include "hll.h"
 
 #include "fp_tcp.h"
 
 /* TCP signature buckets: */
 
-static struct tcp_sig_record* sigs[2][SIG_BUCKETS];
+/* Records are allocated one by one and never freed, since cached hosts may
+   still point to retired ones; buckets only hold pointers. */
+
+static struct tcp_sig_record** sigs[2][SIG_BUCKETS];
 static u32 sig_cnt[2][SIG_BUCKETS];
 
+/* Non-generic signatures again, hashed by all the fields that a signature
+   covering another needs to have in common with it (save for wildcards), so
+   that duplicate detection at load time doesn't scan every earlier one. */
+
+static struct tcp_sig_record** dupes[2][DUPE_BUCKETS];
+static u32 dupe_cnt[2][DUPE_BUCKETS];
+
 
 /* Figure out what the TTL distance might have been for an unknown sig. */
 
@@ -106,25 +122,25 @@ static s16 detect_win_multi(struct tcp_sig* ts, u8* use_mtu, u16 syn_mss) {
 
 
 
-/* See if any of the p0f.fp signatures matches the collected data. */
+/* See if any of the p0f.fp signatures in a bucket matches the collected
+   data. */
 
-static void tcp_find_match(u8 to_srv, struct tcp_sig* ts, u8 dupe_det,
-                           u16 syn_mss) {
+static void match_bucket(struct tcp_sig_record** refp, u32 cnt,
+                         struct tcp_sig* ts, u8 dupe_det, u16 syn_mss) {
 
   struct tcp_sig_record* fmatch = NULL;
   struct tcp_sig_record* gmatch = NULL;
 
-  u32 bucket = ts->opt_hash % SIG_BUCKETS;
   u32 i;
 
   u8  use_mtu = 0;
   s16 win_multi = detect_win_multi(ts, &use_mtu, syn_mss);
 
-  CP(sigs[to_srv][bucket]);
+  CP(refp);
 
-  for (i = 0; i < sig_cnt[to_srv][bucket]; i++) {
+  for (i = 0; i < cnt; i++) {
 
-    struct tcp_sig_record* ref = sigs[to_srv][bucket] + i;
+    struct tcp_sig_record* ref = refp[i];
     struct tcp_sig* refs = CP(ref->sig);
 
     u8 fuzzy = 0;
@@ -273,6 +289,62 @@ static void tcp_find_match(u8 to_srv, struct tcp_sig* ts, u8 dupe_det,
 }
 
 
+/* Match real-world traffic against the database. */
+
+static void tcp_find_match(u8 to_srv, struct tcp_sig* ts, u16 syn_mss) {
+
+  u32 b = ts->opt_hash % SIG_BUCKETS;
+
+  match_bucket(sigs[to_srv][b], sig_cnt[to_srv][b], ts, 0, syn_mss);
+
+}
+
+
+/* Duplicate detection bucket for a signature, given its MSS and window
+   scale (wildcards are hashed as-is). IP-specific quirks are left out, as
+   signatures for either IP version may cover each other. */
+
+static u32 dupe_bucket(struct tcp_sig* ts, s32 mss, s16 wscale) {
+
+  u32 key[6];
+
+  key[0] = ts->opt_hash;
+  key[1] = ts->quirks & ~(QUIRK_FLOW | QUIRK_DF | QUIRK_NZ_ID | QUIRK_ZERO_ID);
+  key[2] = ts->opt_eol_pad;
+  key[3] = ts->ip_opt_len;
+  key[4] = mss;
+  key[5] = wscale;
+
+  return hash32(key, sizeof(key), hash_seed) % DUPE_BUCKETS;
+
+}
+
+
+/* Look for an earlier signature that covers a new one. Only the buckets for
+   the same MSS and window scale, or wildcards in their place, can hold it. */
+
+static void tcp_find_dupe(u8 to_srv, struct tcp_sig* ts) {
+
+  u32 i;
+
+  for (i = 0; i < 4 && !ts->matched; i++) {
+
+    u32 b;
+
+    /* A wildcard can only be covered by another wildcard. */
+
+    if (((i & 1) && ts->mss == -1) || ((i & 2) && ts->wscale == -1))
+      continue;
+
+    b = dupe_bucket(ts, (i & 1) ? -1 : ts->mss, (i & 2) ? -1 : ts->wscale);
+
+    match_bucket(dupes[to_srv][b], dupe_cnt[to_srv][b], ts, 1, 0);
+
+  }
+
+}
+
+
 /* Parse TCP-specific bits and register a signature read from p0f.fp. This
    function is too long. */
 
@@ -696,7 +768,7 @@ void tcp_register_sig(u8 to_srv, u8 generic, s32 sig_class, u32 sig_name,
 
   /* No need to set ts1, recv_ms, match, fuzzy, dist */
 
-  tcp_find_match(to_srv, tsig, 1, 0);
+  tcp_find_dupe(to_srv, tsig);
 
   if (tsig->matched)
     FATAL("Signature in line %u is already covered by line %u.",
@@ -706,12 +778,20 @@ void tcp_register_sig(u8 to_srv, u8 generic, s32 sig_class, u32 sig_name,
 
   bucket = opt_hash % SIG_BUCKETS;
 
-  sigs[to_srv][bucket] = DFL_ck_realloc(sigs[to_srv][bucket],
-    (sig_cnt[to_srv][bucket] + 1) * sizeof(struct tcp_sig_record));
+  FP_GROW(sigs[to_srv][bucket], sig_cnt[to_srv][bucket]);
+
+  trec = DFL_ck_alloc(sizeof(struct tcp_sig_record));
+
+  sigs[to_srv][bucket][sig_cnt[to_srv][bucket]++] = trec;
+
+  if (!generic) {
 
-  trec = sigs[to_srv][bucket] + sig_cnt[to_srv][bucket];
+    bucket = dupe_bucket(tsig, tsig->mss, tsig->wscale);
 
-  sig_cnt[to_srv][bucket]++;
+    FP_GROW(dupes[to_srv][bucket], dupe_cnt[to_srv][bucket]);
+    dupes[to_srv][bucket][dupe_cnt[to_srv][bucket]++] = trec;
+
+  }
 
   trec->generic  = generic;
   trec->class_id = sig_class;
@@ -729,6 +809,60 @@ void tcp_register_sig(u8 to_srv, u8 generic, s32 sig_class, u32 sig_name,
 }
 
 
+/* Unlink signatures with a given label from a bucket, return their
+   number. */
+
+static u32 unlink_sigs(struct tcp_sig_record** refp, u32* cnt, u8 generic,
+                       s32 sig_class, u32 sig_name, u8* sig_flavor) {
+
+  u32 i, ret = 0;
+
+  for (i = 0; i < *cnt; i++) {
+
+    struct tcp_sig_record* ref = refp[i];
+
+    if (ref->generic != generic || ref->class_id != sig_class ||
+        ref->name_id != sig_name) continue;
+
+    if (ref->flavor ? (!sig_flavor || strcmp((char*)ref->flavor,
+        (char*)sig_flavor)) : !!sig_flavor) continue;
+
+    memmove(refp + i, refp + i + 1,
+            (*cnt - i - 1) * sizeof(struct tcp_sig_record*));
+
+    (*cnt)--;
+    i--;
+    ret++;
+
+  }
+
+  return ret;
+
+}
+
+
+/* Unlink all signatures with a given label. Returns the number of
+   signatures retired. */
+
+u32 tcp_retire_sigs(u8 to_srv, u8 generic, s32 sig_class, u32 sig_name,
+                    u8* sig_flavor) {
+
+  u32 b, ret = 0;
+
+  for (b = 0; b < SIG_BUCKETS; b++)
+    ret += unlink_sigs(sigs[to_srv][b], &sig_cnt[to_srv][b], generic,
+                       sig_class, sig_name, sig_flavor);
+
+  if (!generic)
+    for (b = 0; b < DUPE_BUCKETS; b++)
+      unlink_sigs(dupes[to_srv][b], &dupe_cnt[to_srv][b], generic,
+                  sig_class, sig_name, sig_flavor);
+
+  return ret;
+
+}
+
+
 /* Convert struct packet_data to a simplified struct tcp_sig representation
    suitable for signature matching. Compute hashes. */
 
@@ -900,6 +1034,29 @@ static u8* dump_flags(struct packet_data* pk, struct tcp_sig* ts) {
 }
 
 
+/* Update the OS verdict of a host from a matched signature. Used on live
+   traffic and when re-matching stored signatures after a delta, so that
+   both follow the same rules. */
+
+static void update_host(struct host_data* hd, struct tcp_sig* sig) {
+
+  struct tcp_sig_record* m = sig->matched;
+
+  /* Application sigs only feed NAT scores, never the host verdict. */
+
+  if (!m || m->class_id == -1) return;
+
+  hd->last_class_id = m->class_id;
+  hd->last_name_id  = m->name_id;
+  hd->last_flavor   = m->flavor;
+  hd->last_label_id = m->label_id;
+
+  hd->last_quality  = (sig->fuzzy * P0F_MATCH_FUZZY) |
+    (m->generic * P0F_MATCH_GENERIC);
+
+}
+
+
 /* Compare current signature with historical data, draw conclusions. This
    is called only for OS sigs. */
 
@@ -1139,16 +1296,7 @@ log_and_update:
 
   /* Update some of the essential records. */
 
-  if (sig->matched) {
-
-    hd->last_class_id = sig->matched->class_id;
-    hd->last_name_id  = sig->matched->name_id;
-    hd->last_flavor   = sig->matched->flavor;
-
-    hd->last_quality  = (sig->fuzzy * P0F_MATCH_FUZZY) |
-      (sig->matched->generic * P0F_MATCH_GENERIC);
-
-  }
+  update_host(hd, sig);
 
   hd->last_port = f->cli_port;
 
@@ -1178,7 +1326,8 @@ struct tcp_sig* fingerprint_tcp(u8 to_srv, struct packet_data* pk,
   else
     start_observation(f->sendsyn ? "sendsyn response" : "syn+ack", 4, 0, f);
 
-  tcp_find_match(to_srv, sig, 0, f->syn_mss);
+  sig->syn_mss = f->syn_mss;
+  tcp_find_match(to_srv, sig, f->syn_mss);
 
   if ((m = sig->matched)) {
 
@@ -1186,6 +1335,10 @@ struct tcp_sig* fingerprint_tcp(u8 to_srv, struct packet_data* pk,
             fp_os_names[m->name_id], m->flavor ? " " : "",
             m->flavor ? m->flavor : (u8*)"");
 
+    add_observation_num("name_id", m->name_id);
+    add_observation_num("label_id", m->label_id);
+    add_observation_num("sig_line", m->line_no);
+
   } else {
 
     add_observation_field("os", NULL);
@@ -1205,12 +1358,53 @@ struct tcp_sig* fingerprint_tcp(u8 to_srv, struct packet_data* pk,
 
   }
 
+  add_observation_num("distance", sig->dist);
+
   add_observation_field("params", dump_flags(pk, sig));
 
   add_observation_field("raw_sig", dump_sig(pk, sig, f->syn_mss));
 
   if (pk->tcp_type == TCP_SYN) f->syn_mss = pk->mss;
 
+  if (!f->sendsyn) {
+
+    struct host_data* hd = to_srv ? f->client : f->server;
+    u8 hflags = to_srv ? P0F_HIST_SYN : P0F_HIST_SYNACK;
+
+    if (sig->fuzzy) hflags |= P0F_HIST_FUZZY;
+    if (m && m->generic) hflags |= P0F_HIST_GENERIC;
+    if (m && m->bad_ttl) hflags |= P0F_HIST_BAD_TTL;
+
+    add_host_history(hd, m ? m->line_no : -1, m ? m->name_id : -1, sig->dist,
+                     f->srv_port, hflags);
+
+    note_host_update();
+    journal_host(hd);
+
+    /* Per-connection verdicts only describe the client. */
+
+    if (to_srv) {
+
+      if (!m || !m->bad_ttl) f->cv->distance = sig->dist;
+
+      if (m && m->class_id != -1) {
+        f->cv->os_name_id  = m->name_id;
+        f->cv->os_label_id = m->label_id;
+        f->cv->os_quality  = (sig->fuzzy * P0F_MATCH_FUZZY) |
+                             (m->generic * P0F_MATCH_GENERIC);
+      }
+
+    }
+
+    /* Parked API wait queries get answered once we're done here. They
+       give 'since' in client time, so go by the wall clock, not by packet
+       time (which is unrelated to it with -r or -F). */
+
+    hd->last_tcp = time(NULL);
+    api_wake(hd);
+
+  }
+
   /* That's about as far as we go with non-OS signatures. */
 
   if (m && m->class_id == -1) {
@@ -1226,79 +1420,80 @@ struct tcp_sig* fingerprint_tcp(u8 to_srv, struct packet_data* pk,
 
   score_nat(to_srv, sig, f);
 
+  agg_update_host(to_srv ? f->client : f->server);
+
+  /* Only count confident OS matches; application sigs returned above. */
+
+  if (m && !sig->fuzzy) hll_os_add(m->name_id, to_srv ? f->client : f->server);
+
   return sig;
 
 }
 
 
-/* Perform uptime detection. This is the only FP function that gets called not
-   only on SYN or SYN+ACK, but also on ACK traffic. */
+/* Match the stored SYN or SYN+ACK signature of a host against the current
+   database again (say, after a delta), and update the OS verdict the same
+   way fingerprint_tcp() would. */
 
-void check_ts_tcp(u8 to_srv, struct packet_data* pk, struct packet_flow* f) {
+void tcp_rematch(u8 to_srv, struct host_data* hd) {
 
-  u32    ts_diff;
-  u64    ms_diff;
+  struct tcp_sig* sig = to_srv ? hd->last_syn : hd->last_synack;
 
-  u32    freq;
-  u32    up_min, up_mod_days;
+  sig->matched = NULL;
+  sig->fuzzy   = 0;
 
-  double ffreq;
+  tcp_find_match(to_srv, sig, sig->syn_mss);
 
-  if (!pk->ts1 || f->sendsyn) return;
+  update_host(hd, sig);
 
-  /* If we're getting SYNs very rapidly, last_syn may be changing too quickly
-     to be of any use. Perhaps lock into an older value? */
+}
 
-  if (to_srv) {
 
-     if (f->cli_tps || !f->client->last_syn || !f->client->last_syn->ts1)
-       return;
+/* Work out TS clock frequency from a reference TS1 value seen at ref_ms.
+   Returns 0 if there's no usable reading yet; *tps is set to the result, or
+   to -1 if the reading is bad for good. */
 
-     ms_diff = get_unix_time_ms() - f->client->last_syn->recv_ms;
-     ts_diff = pk->ts1 - f->client->last_syn->ts1;
+static u32 ts_freq(u8 to_srv, struct packet_data* pk, u32 ref_ts1, u64 ref_ms,
+                   s16* tps, double* ffreq) {
 
-  } else {
+  u32    ts_diff;
+  u64    ms_diff;
 
-     if (f->srv_tps || !f->server->last_synack || !f->server->last_synack->ts1)
-        return;
+  u32    freq;
 
-     ms_diff = get_unix_time_ms() - f->server->last_synack->recv_ms;
-     ts_diff = pk->ts1 - f->server->last_synack->ts1;
-  
-  }
+  if (*tps || !ref_ts1) return 0;
+
+  ms_diff = get_unix_time_ms() - ref_ms;
+  ts_diff = pk->ts1 - ref_ts1;
 
   /* Wait at least 25 ms, and not more than 10 minutes, for at least 5
      timestamp ticks. Allow the timestamp to go back slightly within
      a short window, too - we may be receiving packets a bit out of
      order. */
 
-  if (ms_diff < MIN_TWAIT || ms_diff > MAX_TWAIT) return;
+  if (ms_diff < MIN_TWAIT || ms_diff > MAX_TWAIT) return 0;
 
   if (ts_diff < 5 || (ms_diff < TSTAMP_GRACE && (~ts_diff) / 1000 < 
-      MAX_TSCALE / TSTAMP_GRACE)) return;
+      MAX_TSCALE / TSTAMP_GRACE)) return 0;
 
-  if (ts_diff > ~ts_diff) ffreq = ~ts_diff * -1000.0 / ms_diff;
-  else ffreq = ts_diff * 1000.0 / ms_diff;
+  if (ts_diff > ~ts_diff) *ffreq = ~ts_diff * -1000.0 / ms_diff;
+  else *ffreq = ts_diff * 1000.0 / ms_diff;
 
-  if (ffreq < MIN_TSCALE || ffreq > MAX_TSCALE) {
+  if (*ffreq < MIN_TSCALE || *ffreq > MAX_TSCALE) {
 
     /* Allow bad reading on SYN, as this may be just an artifact of IP
        sharing or OS change. */
 
-    if (pk->tcp_type != TCP_SYN) {
-
-      if (to_srv) f->cli_tps = -1; else f->srv_tps = -1;
-
-    }
+    if (pk->tcp_type != TCP_SYN) *tps = -1;
 
     DEBUG("[#] Bad %s TS frequency: %.02f Hz (%d ticks in %llu ms).\n",
-          to_srv ? "client" : "server", ffreq, ts_diff, ms_diff);
+          to_srv ? "client" : "server", *ffreq, ts_diff, ms_diff);
 
-    return;
+    return 0;
 
   }
 
-  freq = ffreq;
+  freq = *ffreq;
 
   /* Round the frequency neatly. */
 
@@ -1313,7 +1508,18 @@ void check_ts_tcp(u8 to_srv, struct packet_data* pk, struct packet_flow* f) {
 
   }
 
-  if (to_srv) f->cli_tps = freq; else f->srv_tps = freq;
+  *tps = freq;
+  return freq;
+
+}
+
+
+/* Record and report uptime once the frequency is known. */
+
+static void report_uptime(u8 to_srv, struct packet_data* pk,
+                          struct packet_flow* f, u32 freq, double ffreq) {
+
+  u32 up_min, up_mod_days;
 
   up_min = pk->ts1 / freq / 60;
   up_mod_days = 0xFFFFFFFF / (freq * 60 * 60 * 24);
@@ -1324,18 +1530,81 @@ void check_ts_tcp(u8 to_srv, struct packet_data* pk, struct packet_flow* f) {
 
     f->client->last_up_min = up_min;
     f->client->up_mod_days = up_mod_days;
+    f->client->up_freq     = freq;
 
   } else {
 
     f->server->last_up_min = up_min;
     f->server->up_mod_days = up_mod_days;
+    f->server->up_freq     = freq;
 
   }
 
+  journal_host(to_srv ? f->client : f->server);
+
   OBSERVF("uptime", "%u days %u hrs %u min (modulo %u days)",
           (up_min / 60 / 24), (up_min / 60) % 24, up_min % 60,
           up_mod_days);
 
+  add_observation_num("uptime_min", up_min);
+  add_observation_num("up_mod_days", up_mod_days);
+  add_observation_num("freq", freq);
+
   OBSERVF("raw_freq", "%.02f Hz", ffreq);
 
 }
+
+
+/* Perform uptime detection. This is the only FP function that gets called not
+   only on SYN or SYN+ACK, but also on ACK traffic. */
+
+void check_ts_tcp(u8 to_srv, struct packet_data* pk, struct packet_flow* f) {
+
+  struct tcp_sig* ref;
+  double ffreq;
+  u32    freq;
+
+  if (!pk->ts1 || f->sendsyn) return;
+
+  /* If we're getting SYNs very rapidly, last_syn may be changing too quickly
+     to be of any use. Perhaps lock into an older value? */
+
+  ref = to_srv ? f->client->last_syn : f->server->last_synack;
+  if (!ref) return;
+
+  freq = ts_freq(to_srv, pk, ref->ts1, ref->recv_ms,
+                 to_srv ? &f->cli_tps : &f->srv_tps, &ffreq);
+
+  if (freq) report_uptime(to_srv, pk, f, freq, ffreq);
+
+}
+
+
+/* Same as above, for a compact record that outlived its full flow. Reference
+   values were locked in when the record was made. */
+
+void check_ts_compact(u8 to_srv, struct packet_data* pk, struct ts_flow* tf) {
+
+  static struct packet_flow pf;
+  double ffreq;
+  u32    freq;
+
+  if (!pk->ts1) return;
+
+  if (to_srv)
+    freq = ts_freq(1, pk, tf->cli_ts1, tf->cli_recv_ms, &tf->cli_tps, &ffreq);
+  else
+    freq = ts_freq(0, pk, tf->srv_ts1, tf->srv_recv_ms, &tf->srv_tps, &ffreq);
+
+  if (!freq) return;
+
+  /* Reporting only needs the endpoints. */
+
+  pf.client   = tf->client;
+  pf.server   = tf->server;
+  pf.cli_port = tf->cli_port;
+  pf.srv_port = tf->srv_port;
+
+  report_uptime(to_srv, pk, &pf, freq, ffreq);
+
+}
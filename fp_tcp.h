@@ -38,6 +38,8 @@ struct tcp_sig {
   u32 ts1;                              /* Own timestamp                      */
   u64 recv_ms;                          /* Packet recv unix time (ms)         */
 
+  u16 syn_mss;                          /* MSS from SYN, if SYN+ACK           */
+
   /* Information used for matching with p0f.fp: */
 
   struct tcp_sig_record* matched;       /* NULL = no match                    */
@@ -80,11 +82,16 @@ struct tcp_sig_record {
 
 struct packet_data;
 struct packet_flow;
+struct ts_flow;
+struct host_data;
 
 void tcp_register_sig(u8 to_srv, u8 generic, s32 sig_class, u32 sig_name,
                       u8* sig_flavor, u32 label_id, u32* sys, u32 sys_cnt,
                       u8* val, u32 line_no);
 
+u32 tcp_retire_sigs(u8 to_srv, u8 generic, s32 sig_class, u32 sig_name,
+                    u8* sig_flavor);
+
 struct tcp_sig* fingerprint_tcp(u8 to_srv, struct packet_data* pk,
                                 struct packet_flow* f);
 
@@ -92,4 +99,8 @@ void fingerprint_sendsyn(struct packet_data* pk);
 
 void check_ts_tcp(u8 to_srv, struct packet_data* pk, struct packet_flow* f);
 
+void check_ts_compact(u8 to_srv, struct packet_data* pk, struct ts_flow* tf);
+
+void tcp_rematch(u8 to_srv, struct host_data* hd);
+
 #endif /* _HAVE_FP_TCP_H */
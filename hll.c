@@ -0,0 +1,225 @@
+/*
+   p0f - distinct client / host sketches
+   -------------------------------------
+
+   HyperLogLog sketches of distinct client addresses per server:port (on
+   SYN+ACK), and of distinct host addresses per OS name (on SYN or SYN+ACK
+   matches to OS signatures, fuzzy ones excepted). Each sketch has a fixed
+   number of registers for the current and for the previous HLL_WINDOW, so
+   the cost stays the same no matter how many addresses go by. Windows are
+   rotated lazily, when a sketch is touched.
+
+   Server:port sketches live in a fixed, set-associative table; when a bucket
+   is full, the sketch updated least recently is reused. OS sketches are
+   allocated per name ID on first use.
+
+   Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>
+
+   Distributed under the terms and conditions of GNU LGPL.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "types.h"
+#include "config.h"
+#include "debug.h"
+#include "alloc-inl.h"
+#include "process.h"
+#include "hash.h"
+#include "tcp.h"
+#include "p0f.h"
+#include "hll.h"
+
+struct hll_server {
+
+  u8  ip_ver;                           /* IP_VER4, IP_VER6, 0 = unused       */
+  u8  addr[16];                         /* Server address                     */
+  u16 port;                             /* Server port                        */
+  u32 last_seen;                        /* Time of the last update            */
+
+  struct hll_sketch sk;                 /* Distinct client addresses          */
+
+};
+
+static struct hll_server servers[HLL_SERVERS];
+
+static struct hll_sketch** os_sk;       /* Sketches by OS name ID             */
+static u32 os_sk_cnt;                   /* Entries allocated in os_sk[]       */
+
+static u32 last_time;                   /* Packet time of the last update     */
+
+
+/* Start of the current window. API queries come in between packets, so
+   this goes by the last packet that updated any sketch. */
+
+u32 hll_window_start(void) {
+
+  return last_time - last_time % HLL_WINDOW;
+
+}
+
+
+/* Bring a sketch up to the current window, shifting or clearing registers
+   as needed. */
+
+static void rotate(struct hll_sketch* sk) {
+
+  u32 w = last_time / HLL_WINDOW;
+
+  if (sk->window == w) return;
+
+  if (sk->window + 1 == w) memcpy(sk->prev, sk->cur, HLL_REGS);
+  else memset(sk->prev, 0, HLL_REGS);
+
+  memset(sk->cur, 0, HLL_REGS);
+  sk->window = w;
+
+}
+
+
+/* Add an address to a sketch. The top HLL_BITS of the hash pick the
+   register, the rest give the rank. */
+
+static void add_addr(struct hll_sketch* sk, u8* addr, u8 ip_ver) {
+
+  u32 h = hash32(addr, (ip_ver == IP_VER4) ? 4 : 16, hash_seed);
+  u32 rest = h << HLL_BITS;
+  u8  rank = rest ? __builtin_clz(rest) + 1 : 32 - HLL_BITS + 1;
+  u8* reg = sk->cur + (h >> (32 - HLL_BITS));
+
+  last_time = get_unix_time();
+  rotate(sk);
+
+  if (*reg < rank) *reg = rank;
+
+}
+
+
+/* Estimate the number of distinct addresses from a set of registers. */
+
+u32 hll_estimate(u8* reg) {
+
+  double sum = 0, est, m = HLL_REGS;
+  u32 i, zeros = 0;
+
+  for (i = 0; i < HLL_REGS; i++) {
+    sum += 1.0 / (1ULL << reg[i]);
+    if (!reg[i]) zeros++;
+  }
+
+  est = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+
+  /* Small and large range corrections from the original paper. */
+
+  if (est <= 2.5 * m) {
+    if (zeros) est = m * log(m / zeros);
+  } else if (est > 4294967296.0 / 30)
+    est = -4294967296.0 * log(1 - est / 4294967296.0);
+
+  return est + 0.5;
+
+}
+
+
+/* Find the slot for a server:port pair; if create is set, claim one if
+   needed. */
+
+static struct hll_server* find_server(u8 ip_ver, u8* addr, u16 port,
+                                      u8 create) {
+
+  struct hll_server *s, *lru = NULL;
+  u32 alen = (ip_ver == IP_VER4) ? 4 : 16;
+  u8  key[18];
+  u32 i;
+
+  memcpy(key, addr, alen);
+  memcpy(key + alen, &port, 2);
+
+  s = servers + (hash32(key, alen + 2, hash_seed) %
+                 (HLL_SERVERS / HLL_WAYS)) * HLL_WAYS;
+
+  for (i = 0; i < HLL_WAYS; i++, s++) {
+
+    if (s->ip_ver == ip_ver && s->port == port && !memcmp(s->addr, addr, alen))
+      return s;
+
+    if (!lru || s->last_seen < lru->last_seen) lru = s;
+
+  }
+
+  if (!create) return NULL;
+
+  memset(lru, 0, sizeof(struct hll_server));
+
+  lru->ip_ver = ip_ver;
+  lru->port   = port;
+  memcpy(lru->addr, addr, alen);
+
+  return lru;
+
+}
+
+
+/* Note a client that got a SYN+ACK from a server:port. */
+
+void hll_server_add(u8 ip_ver, u8* srv_addr, u16 srv_port, u8* cli_addr) {
+
+  struct hll_server* s = find_server(ip_ver, srv_addr, srv_port, 1);
+
+  add_addr(&s->sk, cli_addr, ip_ver);
+  s->last_seen = last_time;
+
+}
+
+
+/* Note a host matched to an OS. */
+
+void hll_os_add(s32 name_id, struct host_data* h) {
+
+  if (name_id < 0) return;
+
+  if ((u32)name_id >= os_sk_cnt) {
+
+    u32 ncnt = os_sk_cnt ? os_sk_cnt : 64;
+
+    while (ncnt <= (u32)name_id) ncnt *= 2;
+
+    os_sk = ck_realloc(os_sk, ncnt * sizeof(struct hll_sketch*));
+    os_sk_cnt = ncnt;
+
+  }
+
+  if (!os_sk[name_id]) os_sk[name_id] = ck_alloc(sizeof(struct hll_sketch));
+
+  add_addr(os_sk[name_id], h->addr, h->ip_ver);
+
+}
+
+
+/* Look up sketches for the API, rotated to the current window. */
+
+struct hll_sketch* hll_server_get(u8 ip_ver, u8* srv_addr, u16 srv_port) {
+
+  struct hll_server* s = find_server(ip_ver, srv_addr, srv_port, 0);
+
+  if (!s) return NULL;
+
+  rotate(&s->sk);
+  return &s->sk;
+
+}
+
+
+struct hll_sketch* hll_os_get(s32 name_id) {
+
+  if (name_id < 0 || (u32)name_id >= os_sk_cnt || !os_sk[name_id])
+    return NULL;
+
+  rotate(os_sk[name_id]);
+  return os_sk[name_id];
+
+}
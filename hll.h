@@ -0,0 +1,44 @@
+/*
+   p0f - distinct client / host sketches
+   -------------------------------------
+
+   Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>
+
+   Distributed under the terms and conditions of GNU LGPL.
+
+ */
+
+#ifndef _HAVE_HLL_H
+#define _HAVE_HLL_H
+
+#include "types.h"
+#include "config.h"
+
+#define HLL_REGS             (1 << HLL_BITS)
+
+/* A HyperLogLog sketch for the current and the previous window: */
+
+struct hll_sketch {
+
+  u32 window;                           /* Window number of cur[]             */
+
+  u8  cur[HLL_REGS];                    /* Registers, current window          */
+  u8  prev[HLL_REGS];                   /* Registers, previous window         */
+
+};
+
+struct host_data;
+
+void hll_server_add(u8 ip_ver, u8* srv_addr, u16 srv_port, u8* cli_addr);
+
+void hll_os_add(s32 name_id, struct host_data* h);
+
+struct hll_sketch* hll_server_get(u8 ip_ver, u8* srv_addr, u16 srv_port);
+
+struct hll_sketch* hll_os_get(s32 name_id);
+
+u32 hll_estimate(u8* reg);
+
+u32 hll_window_start(void);
+
+#endif /* !_HAVE_HLL_H */
@@ -0,0 +1,82 @@
+/*
+   p0f - pcap index loader
+   -----------------------
+
+   Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>
+
+   Distributed under the terms and conditions of GNU LGPL.
+
+ */
+
+#define _FROM_P0F
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "types.h"
+#include "config.h"
+#include "debug.h"
+#include "alloc-inl.h"
+#include "index.h"
+
+
+/* Load the index for a pcap file. Returns NULL if there's none, or if it
+   doesn't match the file (rotated, appended to, etc). Blocks follow the
+   header in the returned buffer. */
+
+struct p0f_idx_hdr* index_load(u8* pcap_file) {
+
+  struct p0f_idx_hdr* ih;
+  struct stat st, ist;
+  u8* fn;
+  s32 fd;
+
+  if (stat((char*)pcap_file, &st)) return NULL;
+
+  fn = ck_alloc(strlen((char*)pcap_file) + strlen(P0F_IDX_SUFFIX) + 1);
+  sprintf((char*)fn, "%s" P0F_IDX_SUFFIX, pcap_file);
+
+  fd = open((char*)fn, O_RDONLY);
+  ck_free(fn);
+
+  if (fd < 0) return NULL;
+
+  if (fstat(fd, &ist) || ist.st_size < sizeof(struct p0f_idx_hdr)) {
+    close(fd);
+    return NULL;
+  }
+
+  ih = ck_alloc(ist.st_size);
+
+  if (read(fd, ih, ist.st_size) != ist.st_size || ih->magic != P0F_IDX_MAGIC ||
+      ist.st_size != sizeof(struct p0f_idx_hdr) +
+                     (u64)ih->blocks * sizeof(struct p0f_idx_block)) {
+
+    WARN("Index for '%s' is malformed, ignoring.", pcap_file);
+    goto bad_index;
+
+  }
+
+  if (ih->pcap_size != st.st_size || ih->pcap_mtime != st.st_mtime) {
+
+    WARN("Index for '%s' is out of date, ignoring.", pcap_file);
+    goto bad_index;
+
+  }
+
+  close(fd);
+  return ih;
+
+bad_index:
+
+  close(fd);
+  ck_free(ih);
+  return NULL;
+
+}
@@ -0,0 +1,94 @@
+/*
+   p0f - pcap index format
+   -----------------------
+
+   An index (<file>.idx, built by tools/p0f-index) splits a classic pcap file
+   into blocks of roughly P0F_IDX_BLOCK bytes, each starting at a packet
+   boundary, and records the timestamp range and a Bloom filter of the IP
+   addresses seen in each block, plus the same for the whole file. With -T
+   or -a, offline mode uses it to skip files and blocks that can't contain
+   anything of interest.
+
+   Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>
+
+   Distributed under the terms and conditions of GNU LGPL.
+
+ */
+
+#ifndef _HAVE_INDEX_H
+#define _HAVE_INDEX_H
+
+#include "types.h"
+#include "hash.h"
+
+#define P0F_IDX_MAGIC        0x50304931
+#define P0F_IDX_SUFFIX       ".idx"
+
+#define P0F_IDX_BLOCK        (1024 * 1024) /* Approx pcap bytes per block     */
+#define P0F_IDX_BLOOM        256           /* Filter size per block (bytes)   */
+#define P0F_IDX_FBLOOM       8192          /* Filter size per file (bytes)    */
+#define P0F_IDX_HASHES       3             /* Bits set per address            */
+
+/* Index header, followed by 'blocks' p0f_idx_block entries. All values are
+   in host byte order. */
+
+struct p0f_idx_hdr {
+
+  u32 magic;                            /* Must be P0F_IDX_MAGIC              */
+  u32 blocks;                           /* Number of blocks                   */
+
+  u64 pcap_size;                        /* Size of the indexed file           */
+  u64 pcap_mtime;                       /* Its modification time              */
+
+  u32 first_ts;                         /* Earliest packet (unix time)        */
+  u32 last_ts;                          /* Latest packet (unix time)          */
+
+  u8  bloom[P0F_IDX_FBLOOM];            /* Addresses seen in the file         */
+
+} __attribute__((packed));
+
+struct p0f_idx_block {
+
+  u64 offset;                           /* Offset of the first packet         */
+
+  u32 first_ts;                         /* Earliest packet (unix time)        */
+  u32 last_ts;                          /* Latest packet (unix time)          */
+
+  u8  bloom[P0F_IDX_BLOOM];             /* Addresses seen in the block        */
+
+} __attribute__((packed));
+
+/* Add an address (4 or 16 bytes) to a Bloom filter of 'size' bytes, or test
+   for its presence. */
+
+static inline void idx_bloom_add(u8* bloom, u32 size, u8* addr, u32 alen) {
+
+  u32 i;
+
+  for (i = 0; i < P0F_IDX_HASHES; i++) {
+    u32 bit = hash32(addr, alen, i + 1) % (size * 8);
+    bloom[bit / 8] |= 1 << (bit % 8);
+  }
+
+}
+
+static inline u8 idx_bloom_has(u8* bloom, u32 size, u8* addr, u32 alen) {
+
+  u32 i;
+
+  for (i = 0; i < P0F_IDX_HASHES; i++) {
+    u32 bit = hash32(addr, alen, i + 1) % (size * 8);
+    if (!(bloom[bit / 8] & (1 << (bit % 8)))) return 0;
+  }
+
+  return 1;
+
+}
+
+#ifdef _FROM_P0F
+
+struct p0f_idx_hdr* index_load(u8* pcap_file);
+
+#endif /* _FROM_P0F */
+
+#endif /* !_HAVE_INDEX_H */
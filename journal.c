@@ -0,0 +1,561 @@
+/*
+   p0f - host state snapshot and journal
+   -------------------------------------
+
+   With -c, the persistent part of every host record is kept on disk in two
+   files: a snapshot (hosts.snap) and an append-only journal (hosts.jrn).
+   Whenever fingerprinting code changes a host, a copy of its state is queued
+   from the capture thread; a helper thread appends queued records to the
+   journal in groups, with a single fdatasync() per group. The capture thread
+   never waits for the disk.
+
+   Once the journal grows past JOURNAL_COMPACT times the size of the snapshot,
+   the helper thread merges both into a new snapshot, renames it into place,
+   and truncates the journal, so each journaled record gets rewritten at most
+   1 + 1 / JOURNAL_COMPACT times. A crash between the rename and the truncate
+   is harmless, since replaying records is idempotent; a torn record at the
+   end of the journal fails its checksum and is cut off on the next startup.
+
+   Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>
+
+   Distributed under the terms and conditions of GNU LGPL.
+
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "types.h"
+#include "config.h"
+#include "debug.h"
+#include "alloc-inl.h"
+#include "hash.h"
+#include "tcp.h"
+#include "process.h"
+#include "readfp.h"
+#include "fp_mtu.h"
+#include "fp_http.h"
+#include "p0f.h"
+#include "journal.h"
+#include "agg.h"
+
+#define SNAP_FILE    "hosts.snap"
+#define SNAP_TMP     "hosts.snap.new"
+#define JRN_FILE     "hosts.jrn"
+
+#define REC_SIZE     sizeof(struct host_rec)
+
+static s32 dir_fd = -1,                 /* State directory                    */
+           jrn_fd = -1;                 /* Journal                            */
+
+static u64 jrn_size,                    /* Valid journal length               */
+           snap_size;                   /* Current snapshot length            */
+
+static struct host_rec* ring;           /* JOURNAL_QUEUE records              */
+static u32 head,                        /* Oldest queued record               */
+           cnt;                         /* Queued records (incl. in flight)   */
+
+static u64 written,                     /* Records appended to the journal    */
+           dropped,                     /* Records dropped, queue full        */
+           compactions;                 /* Snapshots written                  */
+
+static pthread_t jrn_thread;            /* Journal thread                     */
+
+static pthread_mutex_t jrn_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  jrn_cond   = PTHREAD_COND_INITIALIZER,
+                       space_cond = PTHREAD_COND_INITIALIZER;
+
+static u8 jrn_stop,                     /* Journal thread asked to exit?      */
+          jrn_running,                  /* Journal thread started?            */
+          jrn_wait;                     /* Wait for room instead of dropping? */
+
+
+/* Checksum covering everything past the cksum field. */
+
+static u32 rec_cksum(struct host_rec* r) {
+
+  return hash32((u8*)r + 8, REC_SIZE - 8, JRN_REC_MAGIC);
+
+}
+
+
+/* Append valid records from a file to *recs. Returns the length of the valid
+   part of the file. */
+
+static u64 read_recs(s32 fd, struct host_rec** recs, u32* rcnt) {
+
+  struct stat st;
+  u8* buf;
+  u64 off = 0;
+
+  if (fstat(fd, &st)) PFATAL("fstat() on state file failed.");
+
+  if (st.st_size < REC_SIZE) return 0;
+
+  buf = DFL_ck_alloc(st.st_size);
+
+  if (pread(fd, buf, st.st_size, 0) != st.st_size)
+    PFATAL("Short read from state file.");
+
+  *recs = DFL_ck_realloc(*recs, (*rcnt + st.st_size / REC_SIZE) * REC_SIZE);
+
+  while (off + REC_SIZE <= st.st_size) {
+
+    struct host_rec* r = (struct host_rec*)(buf + off);
+
+    if (r->magic != JRN_REC_MAGIC || r->cksum != rec_cksum(r)) break;
+
+    memcpy(*recs + (*rcnt)++, r, REC_SIZE);
+    off += REC_SIZE;
+
+  }
+
+  DFL_ck_free(buf);
+
+  return off;
+
+}
+
+
+/* Merge the snapshot and the journal into one record per address, newest
+   record winning. Hosts idle for longer than the host idle limit, measured
+   against the most recent record, are dropped. Sets *jrn_good to the length
+   of the valid part of the journal. */
+
+static u32 merge_state(struct host_rec** out, u64* jrn_good) {
+
+  struct host_rec *recs = NULL, *res;
+  u32 rcnt = 0, tsize = 1, *tab, newest = 0, i, ocnt = 0;
+  s32 fd;
+
+  fd = openat(dir_fd, SNAP_FILE, O_RDONLY);
+
+  if (fd >= 0) {
+    read_recs(fd, &recs, &rcnt);
+    close(fd);
+  } else if (errno != ENOENT) PFATAL("Unable to open '%s'.", SNAP_FILE);
+
+  *jrn_good = read_recs(jrn_fd, &recs, &rcnt);
+
+  while (tsize < rcnt * 2) tsize <<= 1;
+
+  tab = DFL_ck_alloc(tsize * sizeof(u32));
+
+  /* Open addressing; slots hold record index + 1. */
+
+  for (i = 0; i < rcnt; i++) {
+
+    u32 b = hash32(&recs[i].ip_ver, 17, 0) & (tsize - 1);
+
+    while (tab[b] && (recs[tab[b] - 1].ip_ver != recs[i].ip_ver ||
+           memcmp(recs[tab[b] - 1].addr, recs[i].addr, 16)))
+      b = (b + 1) & (tsize - 1);
+
+    tab[b] = i + 1;
+
+    if (recs[i].last_seen > newest) newest = recs[i].last_seen;
+
+  }
+
+  res = DFL_ck_alloc(rcnt * REC_SIZE);
+
+  for (i = 0; i < tsize; i++) {
+
+    struct host_rec* r;
+
+    if (!tab[i]) continue;
+
+    r = recs + tab[i] - 1;
+
+    if (r->last_seen + host_idle_limit * 60 < newest) continue;
+
+    memcpy(res + ocnt++, r, REC_SIZE);
+
+  }
+
+  DFL_ck_free(tab);
+  DFL_ck_free(recs);
+
+  *out = res;
+  return ocnt;
+
+}
+
+
+/* Write a new snapshot from the current state, then empty the journal. */
+
+static void compact(void) {
+
+  struct host_rec* recs;
+  u32 rcnt;
+  u64 good;
+  s32 fd;
+
+  rcnt = merge_state(&recs, &good);
+
+  fd = openat(dir_fd, SNAP_TMP, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+  if (fd < 0) {
+    WARN("Unable to create '%s', journal not compacted.", SNAP_TMP);
+    DFL_ck_free(recs);
+    return;
+  }
+
+  if (write(fd, recs, rcnt * REC_SIZE) != rcnt * REC_SIZE || fsync(fd)) {
+    WARN("Unable to write '%s', journal not compacted.", SNAP_TMP);
+    close(fd);
+    unlinkat(dir_fd, SNAP_TMP, 0);
+    DFL_ck_free(recs);
+    return;
+  }
+
+  close(fd);
+  DFL_ck_free(recs);
+
+  if (renameat(dir_fd, SNAP_TMP, dir_fd, SNAP_FILE)) {
+    WARN("Unable to rename '%s', journal not compacted.", SNAP_TMP);
+    return;
+  }
+
+  fsync(dir_fd);
+
+  if (ftruncate(jrn_fd, 0)) WARN("Unable to truncate '%s'.", JRN_FILE);
+
+  jrn_size  = 0;
+  snap_size = rcnt * REC_SIZE;
+
+  compactions++;
+
+}
+
+
+/* Append 'n' queued records starting at 'first', then sync. The slots are
+   owned by the journal thread until 'head' moves past them. */
+
+static void append_recs(u32 first, u32 n) {
+
+  struct iovec iov[2];
+  u32 i, n1 = MIN(n, JOURNAL_QUEUE - first);
+  u64 len = n * REC_SIZE;
+
+  for (i = 0; i < n; i++) {
+    struct host_rec* r = ring + (first + i) % JOURNAL_QUEUE;
+    r->cksum = rec_cksum(r);
+  }
+
+  iov[0].iov_base = ring + first;
+  iov[0].iov_len  = n1 * REC_SIZE;
+  iov[1].iov_base = ring;
+  iov[1].iov_len  = (n - n1) * REC_SIZE;
+
+  if (writev(jrn_fd, iov, (n > n1) ? 2 : 1) != len) {
+
+    /* Don't leave a torn record for later ones to pile up behind. */
+
+    WARN("Write to '%s' failed, %u records lost.", JRN_FILE, n);
+    if (ftruncate(jrn_fd, jrn_size)) WARN("Unable to truncate '%s'.", JRN_FILE);
+    return;
+
+  }
+
+  if (fdatasync(jrn_fd)) WARN("fdatasync() on '%s' failed.", JRN_FILE);
+
+  jrn_size += len;
+
+}
+
+
+/* Journal thread. After the first record of a group shows up, waits up to
+   JOURNAL_COMMIT_MS for more, or until the queue is half full. */
+
+static void* journal_main(void* arg) {
+
+  pthread_mutex_lock(&jrn_mutex);
+
+  while (1) {
+
+    struct timespec until;
+    u32 first, n;
+
+    if (!cnt) {
+      if (jrn_stop) break;
+      pthread_cond_wait(&jrn_cond, &jrn_mutex);
+      continue;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &until);
+
+    until.tv_sec  += JOURNAL_COMMIT_MS / 1000;
+    until.tv_nsec += (JOURNAL_COMMIT_MS % 1000) * 1000000;
+
+    if (until.tv_nsec >= 1000000000) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000;
+    }
+
+    while (!jrn_stop && cnt < JOURNAL_QUEUE / 2)
+      if (pthread_cond_timedwait(&jrn_cond, &jrn_mutex, &until) == ETIMEDOUT)
+        break;
+
+    first = head;
+    n     = cnt;
+
+    pthread_mutex_unlock(&jrn_mutex);
+
+    append_recs(first, n);
+
+    if (jrn_size >= MAX(JOURNAL_MIN_SIZE, snap_size * JOURNAL_COMPACT))
+      compact();
+
+    pthread_mutex_lock(&jrn_mutex);
+
+    head     = (head + n) % JOURNAL_QUEUE;
+    cnt     -= n;
+    written += n;
+
+    if (jrn_wait) pthread_cond_signal(&space_cond);
+
+  }
+
+  pthread_mutex_unlock(&jrn_mutex);
+
+  /* Leave a compact snapshot behind on clean shutdown. */
+
+  compact();
+
+  return NULL;
+
+}
+
+
+/* Order records by last_seen, for loading. */
+
+static int rec_cmp(const void* a, const void* b) {
+
+  u32 sa = ((struct host_rec*)a)->last_seen,
+      sb = ((struct host_rec*)b)->last_seen;
+
+  return (sa > sb) - (sa < sb);
+
+}
+
+
+/* Load a record into the host cache. Signature-derived IDs are used only if
+   p0f.fp and the deltas applied on top of it are the same as when they were
+   written; deltas add names and labels after the base ones, so the same ID
+   may mean something else otherwise. */
+
+static void restore_rec(struct host_rec* r) {
+
+  struct host_data* h;
+  u8 ids_ok = (r->fp_digest == fp_digest);
+
+  if (r->ip_ver != IP_VER4 && r->ip_ver != IP_VER6) return;
+
+  h = restore_host(r->addr, r->ip_ver, r->last_seen);
+  if (!h) return;
+
+  h->first_seen = r->first_seen;
+  h->total_conn = r->total_conn;
+
+  if (ids_ok && r->last_class_id >= 0 && r->last_class_id < fp_class_cnt &&
+      r->last_name_id >= 0 && r->last_name_id < fp_name_cnt) {
+
+    h->last_class_id = r->last_class_id;
+    h->last_name_id  = r->last_name_id;
+    h->last_quality  = r->last_quality;
+
+    if (r->last_label_id >= 0 && r->last_label_id < fp_flavor_cnt) {
+      h->last_label_id = r->last_label_id;
+      h->last_flavor   = fp_flavors[r->last_label_id];
+    }
+
+  }
+
+  if (ids_ok && r->http_name_id >= 0 && r->http_name_id < fp_name_cnt) {
+
+    h->http_name_id = r->http_name_id;
+    h->http_quality = r->http_quality;
+
+    if (r->http_label_id >= 0 && r->http_label_id < fp_flavor_cnt) {
+      h->http_label_id = r->http_label_id;
+      h->http_flavor   = fp_flavors[r->http_label_id];
+    }
+
+  }
+
+  if (ids_ok && r->link_id >= 0 && r->link_id < fp_link_cnt) {
+    h->link_id   = r->link_id;
+    h->link_type = fp_links[r->link_id];
+  }
+
+  if (r->lang_id >= 0 && r->lang_id < HTTP_LANG_IDS &&
+      http_lang_name(r->lang_id)) {
+    h->lang_id  = r->lang_id;
+    h->language = http_lang_name(r->lang_id);
+  }
+
+  h->distance         = r->distance;
+  h->last_nat_reasons = r->last_nat_reasons;
+  h->last_nat         = r->last_nat;
+  h->last_chg         = r->last_chg;
+  h->last_up_min      = r->last_up_min;
+  h->up_mod_days      = r->up_mod_days;
+  h->up_freq          = r->up_freq;
+  h->bad_sw           = r->bad_sw;
+
+  agg_update_host(h);
+
+}
+
+
+/* Open the state directory and load saved hosts, most recently seen first
+   if they don't all fit. Must be called after the signature database is
+   loaded, and before chroot(). */
+
+void journal_open(u8* dir) {
+
+  struct host_rec* recs;
+  u32 rcnt, i, start = 0;
+  u64 good;
+
+  dir_fd = open((char*)dir, O_RDONLY | O_DIRECTORY);
+  if (dir_fd < 0) PFATAL("Cannot open state directory '%s'.", dir);
+
+  jrn_fd = openat(dir_fd, JRN_FILE, O_RDWR | O_CREAT | O_APPEND, 0600);
+  if (jrn_fd < 0) PFATAL("Unable to open '%s'.", JRN_FILE);
+
+  rcnt = merge_state(&recs, &good);
+
+  /* Cut off a torn tail, so that new records don't end up behind it. */
+
+  if (ftruncate(jrn_fd, good)) PFATAL("Unable to truncate '%s'.", JRN_FILE);
+
+  jrn_size  = good;
+  snap_size = rcnt * REC_SIZE;
+
+  if (rcnt) qsort(recs, rcnt, REC_SIZE, rec_cmp);
+
+  if (rcnt > max_hosts) start = rcnt - max_hosts;
+
+  for (i = start; i < rcnt; i++) restore_rec(recs + i);
+
+  DFL_ck_free(recs);
+
+  ring = DFL_ck_alloc(JOURNAL_QUEUE * REC_SIZE);
+
+  SAYF("[+] Restored %u hosts from '%s'.\n", rcnt - start, dir);
+
+}
+
+
+/* Start the journal thread. Must be called after fork_off(). With 'wait' set
+   (offline captures), a full queue stalls the capture thread instead of
+   losing updates. */
+
+void journal_start(u8 wait) {
+
+  if (dir_fd < 0) return;
+
+  jrn_wait = wait;
+
+  if (pthread_create(&jrn_thread, NULL, journal_main, NULL))
+    FATAL("Unable to start journal thread.");
+
+  jrn_running = 1;
+
+}
+
+
+/* Queue the current state of a host. Called by fingerprinting code whenever
+   something worth keeping changes. */
+
+void journal_host(struct host_data* h) {
+
+  struct host_rec* r;
+
+  if (!jrn_running) return;
+
+  pthread_mutex_lock(&jrn_mutex);
+
+  while (jrn_wait && cnt == JOURNAL_QUEUE)
+    pthread_cond_wait(&space_cond, &jrn_mutex);
+
+  if (cnt == JOURNAL_QUEUE) {
+    dropped++;
+    pthread_mutex_unlock(&jrn_mutex);
+    return;
+  }
+
+  r = ring + (head + cnt) % JOURNAL_QUEUE;
+
+  memset(r, 0, REC_SIZE);
+
+  r->magic      = JRN_REC_MAGIC;
+  r->fp_digest  = fp_digest;
+  r->ip_ver     = h->ip_ver;
+  r->first_seen = h->first_seen;
+  r->last_seen  = h->last_seen;
+  r->total_conn = h->total_conn;
+
+  memcpy(r->addr, h->addr, 16);
+
+  r->last_class_id    = h->last_class_id;
+  r->last_name_id     = h->last_name_id;
+  r->last_label_id    = h->last_label_id;
+  r->last_quality     = h->last_quality;
+  r->link_id          = h->link_id;
+  r->distance         = h->distance;
+  r->last_nat_reasons = h->last_nat_reasons;
+  r->last_nat         = h->last_nat;
+  r->last_chg         = h->last_chg;
+  r->last_up_min      = h->last_up_min;
+  r->up_mod_days      = h->up_mod_days;
+  r->up_freq          = h->up_freq;
+  r->http_name_id     = h->http_name_id;
+  r->http_label_id    = h->http_label_id;
+  r->http_quality     = h->http_quality;
+  r->lang_id          = h->lang_id;
+  r->bad_sw           = h->bad_sw;
+
+  /* Wake the journal thread for a new group, or when it's time to cut the
+     current one short. */
+
+  if (++cnt == 1 || cnt == JOURNAL_QUEUE / 2) pthread_cond_signal(&jrn_cond);
+
+  pthread_mutex_unlock(&jrn_mutex);
+
+}
+
+
+/* Flush the queue, write a final snapshot, and stop the journal thread. */
+
+void journal_shutdown(void) {
+
+  if (!jrn_running) return;
+
+  pthread_mutex_lock(&jrn_mutex);
+  jrn_stop = 1;
+  pthread_cond_signal(&jrn_cond);
+  pthread_mutex_unlock(&jrn_mutex);
+
+  pthread_join(jrn_thread, NULL);
+
+  if (daemon_mode) return;
+
+  SAYF("[+] Journal: %llu records written, %llu dropped, %llu compactions.\n",
+       written, dropped, compactions);
+
+}
@@ -0,0 +1,71 @@
+/*
+   p0f - host state snapshot and journal
+   -------------------------------------
+
+   Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>
+
+   Distributed under the terms and conditions of GNU LGPL.
+
+ */
+
+#ifndef _HAVE_JOURNAL_H
+#define _HAVE_JOURNAL_H
+
+#include "types.h"
+
+#define JRN_REC_MAGIC        0x50304a01
+
+/* On-disk host record, shared by the snapshot and the journal. Every record
+   carries the complete persistent state of one host, so replay is simply a
+   matter of letting the newest record for any address win. */
+
+struct host_rec {
+
+  u32 magic;                            /* JRN_REC_MAGIC                      */
+  u32 cksum;                            /* hash32() of everything below       */
+
+  u32 fp_digest;                        /* p0f.fp + deltas (for ID validity)  */
+
+  u8  ip_ver;                           /* Address type                       */
+  u8  addr[16];                         /* Host address                       */
+
+  u32 first_seen;                       /* Record created (unix time)         */
+  u32 last_seen;                        /* Host last seen (unix time)         */
+  u32 total_conn;                       /* Total number of connections        */
+
+  s32 last_class_id;                    /* OS class ID                        */
+  s32 last_name_id;                     /* OS name ID                         */
+  s32 last_label_id;                    /* Label of last OS match             */
+  u8  last_quality;                     /* Generic or fuzzy match?            */
+
+  s32 link_id;                          /* Link type ID                       */
+  u8  distance;                         /* Last measured distance             */
+
+  u16 last_nat_reasons;                 /* Reasons for the last NAT verdict   */
+  u32 last_nat;                         /* Last NAT detection time            */
+  u32 last_chg;                         /* Last OS change detection time      */
+
+  s32 last_up_min;                      /* Last computed uptime               */
+  u32 up_mod_days;                      /* Uptime modulo (days)               */
+  u32 up_freq;                          /* Timestamp clock frequency (Hz)     */
+
+  s32 http_name_id;                     /* Client name ID                     */
+  s32 http_label_id;                    /* Label of last app match            */
+  u8  http_quality;                     /* Generic app match?                 */
+
+  s32 lang_id;                          /* Language ID                        */
+  u8  bad_sw;                           /* Used dishonest U-A or Server?      */
+
+} __attribute__((packed));
+
+struct host_data;
+
+void journal_open(u8* dir);
+
+void journal_start(u8 wait);
+
+void journal_host(struct host_data* h);
+
+void journal_shutdown(void);
+
+#endif /* !_HAVE_JOURNAL_H */
@@ -0,0 +1,250 @@
+/*
+   p0f - JSON Lines formatting
+   ---------------------------
+
+   Builds one JSON object per observation in a buffer that is reused for the
+   lifetime of the process. Escaping and number conversion are done by hand,
+   so producing a record does not go through stdio at all.
+
+   Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>
+
+   Distributed under the terms and conditions of GNU LGPL.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "config.h"
+#include "debug.h"
+#include "alloc-inl.h"
+#include "tcp.h"
+#include "json.h"
+
+static u8* jbuf;                        /* Record buffer                      */
+static u32 jlen,                        /* Bytes used                         */
+           jsize;                       /* Bytes allocated                    */
+
+static u8 jfirst;                       /* No fields added yet?               */
+
+static const u8 hex[] = "0123456789abcdef";
+
+
+/* Make sure that at least 'len' more bytes fit in the buffer. The buffer only
+   ever grows, so after a couple of records this is a no-op. */
+
+static void json_reserve(u32 len) {
+
+  if (jlen + len <= jsize) return;
+
+  if (!jsize) jsize = JSON_BUF_INIT;
+  while (jlen + len > jsize) jsize *= 2;
+
+  jbuf = DFL_ck_realloc(jbuf, jsize);
+
+}
+
+
+/* Append a quoted and escaped string. Everything outside of printable ASCII
+   is written as \u00XX, which keeps the output valid JSON no matter what the
+   peer sent in its headers. */
+
+static void json_put_str(u8* str) {
+
+  u8* out;
+
+  json_reserve(strlen((char*)str) * 6 + 2);
+
+  out = jbuf + jlen;
+
+  *(out++) = '"';
+
+  while (*str) {
+
+    u8 c = *(str++);
+
+    if (c == '"' || c == '\\') {
+
+      *(out++) = '\\';
+      *(out++) = c;
+
+    } else if (c == '\n') {
+
+      *(out++) = '\\';
+      *(out++) = 'n';
+
+    } else if (c == '\t') {
+
+      *(out++) = '\\';
+      *(out++) = 't';
+
+    } else if (c < 0x20 || c >= 0x7f) {
+
+      memcpy(out, "\\u00", 4);
+      out[4] = hex[c >> 4];
+      out[5] = hex[c & 15];
+      out += 6;
+
+    } else *(out++) = c;
+
+  }
+
+  *(out++) = '"';
+
+  jlen = out - jbuf;
+
+}
+
+
+/* Append '"key":', preceded by a comma if needed. Keys are ours, so they are
+   not escaped. */
+
+static void json_put_key(char* key) {
+
+  u32 klen = strlen(key);
+
+  json_reserve(klen + 4);
+
+  if (!jfirst) jbuf[jlen++] = ',';
+  jfirst = 0;
+
+  jbuf[jlen++] = '"';
+  memcpy(jbuf + jlen, key, klen);
+  jlen += klen;
+  jbuf[jlen++] = '"';
+  jbuf[jlen++] = ':';
+
+}
+
+
+/* Start a new record. */
+
+void json_begin(void) {
+
+  jlen = 0;
+  json_reserve(1);
+  jbuf[jlen++] = '{';
+  jfirst = 1;
+
+}
+
+
+/* Add a string field; NULL is written as null. */
+
+void json_add_str(char* key, u8* val) {
+
+  json_put_key(key);
+
+  if (!val) {
+
+    json_reserve(4);
+    memcpy(jbuf + jlen, "null", 4);
+    jlen += 4;
+
+  } else json_put_str(val);
+
+}
+
+
+/* Add a numeric field. */
+
+void json_add_num(char* key, s64 val) {
+
+  u8  tmp[24];
+  u32 pos = sizeof(tmp);
+  u64 uv  = (val < 0) ? -(u64)val : (u64)val;
+
+  json_put_key(key);
+
+  do {
+    tmp[--pos] = '0' + (uv % 10);
+    uv /= 10;
+  } while (uv);
+
+  if (val < 0) tmp[--pos] = '-';
+
+  json_reserve(sizeof(tmp) - pos);
+  memcpy(jbuf + jlen, tmp + pos, sizeof(tmp) - pos);
+  jlen += sizeof(tmp) - pos;
+
+}
+
+
+/* Add an address as two fields: the usual human-readable form under 'key',
+   and the raw bytes in hex under 'key_raw'. */
+
+void json_add_addr(char* key, u8* addr, u8 ip_ver) {
+
+  u8  tmp[48], *out = tmp;
+  u32 i, alen = (ip_ver == IP_VER4) ? 4 : 16;
+  u8  rkey[32];
+
+  if (ip_ver == IP_VER4) {
+
+    for (i = 0; i < 4; i++) {
+
+      u8 v = addr[i];
+
+      if (i) *(out++) = '.';
+      if (v >= 100) *(out++) = '0' + v / 100;
+      if (v >= 10)  *(out++) = '0' + (v / 10) % 10;
+      *(out++) = '0' + v % 10;
+
+    }
+
+  } else {
+
+    /* Same uncompressed notation as addr_to_str(). */
+
+    for (i = 0; i < 16; i += 2) {
+
+      u16 v = (addr[i] << 8) | addr[i + 1];
+      u8  sh, started = 0;
+
+      if (i) *(out++) = ':';
+
+      for (sh = 12; sh <= 12; sh -= 4) {
+        u8 d = (v >> sh) & 15;
+        if (d || started || !sh) { *(out++) = hex[d]; started = 1; }
+      }
+
+    }
+
+  }
+
+  *out = 0;
+
+  json_add_str(key, tmp);
+
+  for (i = 0; i < alen; i++) {
+    tmp[i * 2]     = hex[addr[i] >> 4];
+    tmp[i * 2 + 1] = hex[addr[i] & 15];
+  }
+
+  tmp[alen * 2] = 0;
+
+  i = MIN(strlen(key), sizeof(rkey) - 5);
+  memcpy(rkey, key, i);
+  memcpy(rkey + i, "_raw", 5);
+
+  json_add_str((char*)rkey, tmp);
+
+}
+
+
+/* Close the record and return it, newline included. The buffer stays valid
+   until the next json_begin(). */
+
+u8* json_finish(u32* len) {
+
+  json_reserve(2);
+
+  jbuf[jlen++] = '}';
+  jbuf[jlen++] = '\n';
+
+  *len = jlen;
+  return jbuf;
+
+}
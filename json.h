@@ -0,0 +1,26 @@
+/*
+   p0f - JSON Lines formatting
+   ---------------------------
+
+   Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>
+
+   Distributed under the terms and conditions of GNU LGPL.
+
+ */
+
+#ifndef _HAVE_JSON_H
+#define _HAVE_JSON_H
+
+#include "types.h"
+
+void json_begin(void);
+
+void json_add_str(char* key, u8* val);
+
+void json_add_num(char* key, s64 val);
+
+void json_add_addr(char* key, u8* addr, u8 ip_ver);
+
+u8* json_finish(u32* len);
+
+#endif /* !_HAVE_JSON_H */
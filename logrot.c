@@ -0,0 +1,458 @@
+/*
+   p0f - log rotation
+   ------------------
+
+   The capture thread only renames the current log to a timestamped segment
+   and opens a fresh file; compressing segments and pruning old ones is left
+   to a helper thread. All file operations are done relative to a descriptor
+   of the log directory, so rotation keeps working after chroot().
+
+   Segments are named <log>.YYYYMMDD-HHMMSS.NNN, optionally followed by .gz
+   or .zst, so that sorting by name also sorts them by age.
+
+   Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>
+
+   Distributed under the terms and conditions of GNU LGPL.
+
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef USE_ZSTD
+#  include <zstd.h>
+#elif defined(USE_ZLIB)
+#  include <zlib.h>
+#endif /* ^USE_ZSTD, USE_ZLIB */
+
+#include "types.h"
+#include "config.h"
+#include "debug.h"
+#include "alloc-inl.h"
+#include "logrot.h"
+
+#ifdef USE_ZSTD
+#  define SEG_EXT ".zst"
+#elif defined(USE_ZLIB)
+#  define SEG_EXT ".gz"
+#endif /* ^USE_ZSTD, USE_ZLIB */
+
+#ifndef O_NOFOLLOW
+#  define O_NOFOLLOW 0
+#endif /* !O_NOFOLLOW */
+
+static s32 dir_fd = -1;                 /* Directory holding the log file     */
+
+static u8* log_base;                    /* Log file name, sans directory      */
+
+static u32 seg_keep;                    /* Number of segments to retain       */
+
+static pthread_t helper;                /* Compression / pruning thread       */
+
+static pthread_mutex_t rot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  rot_cond  = PTHREAD_COND_INITIALIZER;
+
+static u8 work_pending,                 /* New segment waiting for helper?    */
+          helper_stop;                  /* Helper asked to exit?              */
+
+
+/* Check if a directory entry looks like one of our segments. Returns the
+   offset of the extension (or the terminating NUL), or 0 if no match. */
+
+static u32 is_segment(u8* name) {
+
+  u32 blen = strlen((char*)log_base), i;
+
+  if (strncmp((char*)name, (char*)log_base, blen) || name[blen] != '.')
+    return 0;
+
+  name += blen + 1;
+
+  for (i = 0; i < 8; i++) if (!isdigit(name[i])) return 0;
+  if (name[8] != '-') return 0;
+  for (i = 9; i < 15; i++) if (!isdigit(name[i])) return 0;
+  if (name[15] != '.') return 0;
+  for (i = 16; i < 19; i++) if (!isdigit(name[i])) return 0;
+
+  return blen + 1 + 19;
+
+}
+
+
+#ifdef SEG_EXT
+
+/* Compress a single segment, then remove the original. Returns 0 on
+   success. */
+
+static u8 compress_segment(u8* name) {
+
+  u8  out_name[PATH_MAX];
+  s32 in_fd, out_fd;
+  u8* buf;
+  s32 len;
+  u8  fail = 0;
+
+  snprintf((char*)out_name, sizeof(out_name), "%s" SEG_EXT, name);
+
+  in_fd = openat(dir_fd, (char*)name, O_RDONLY | O_NOFOLLOW);
+
+  if (in_fd < 0) {
+    WARN("Unable to open log segment '%s' for compression.", name);
+    return 1;
+  }
+
+  out_fd = openat(dir_fd, (char*)out_name, O_WRONLY | O_CREAT | O_TRUNC |
+                  O_NOFOLLOW, LOG_MODE);
+
+  if (out_fd < 0) {
+    WARN("Unable to create '%s'.", out_name);
+    close(in_fd);
+    return 1;
+  }
+
+  buf = DFL_ck_alloc(LOG_COMP_BUF);
+
+#ifdef USE_ZSTD
+
+  {
+
+    ZSTD_CCtx* cc = ZSTD_createCCtx();
+    u32 out_max = ZSTD_compressBound(LOG_COMP_BUF);
+    u8* out = DFL_ck_alloc(out_max);
+
+    ZSTD_CCtx_setParameter(cc, ZSTD_c_compressionLevel, LOG_ZSTD_LEVEL);
+
+    do {
+
+      ZSTD_EndDirective mode;
+      ZSTD_inBuffer in;
+      size_t left;
+
+      len = read(in_fd, buf, LOG_COMP_BUF);
+
+      if (len < 0) { fail = 1; break; }
+
+      mode = len ? ZSTD_e_continue : ZSTD_e_end;
+
+      in.src  = buf;
+      in.size = len;
+      in.pos  = 0;
+
+      do {
+
+        ZSTD_outBuffer ob = { out, out_max, 0 };
+
+        left = ZSTD_compressStream2(cc, &ob, &in, mode);
+
+        if (ZSTD_isError(left) ||
+            write(out_fd, out, ob.pos) != (s32)ob.pos) { fail = 1; break; }
+
+      } while (mode == ZSTD_e_end ? left != 0 : in.pos < in.size);
+
+    } while (len && !fail);
+
+    ZSTD_freeCCtx(cc);
+    DFL_ck_free(out);
+
+    if (close(out_fd)) fail = 1;
+
+  }
+
+#else
+
+  {
+
+    u8 mode[8];
+    gzFile gz;
+
+    snprintf((char*)mode, sizeof(mode), "wb%u", LOG_GZ_LEVEL);
+
+    gz = gzdopen(out_fd, (char*)mode);
+
+    if (!gz) {
+
+      close(out_fd);
+      fail = 1;
+
+    } else {
+
+      while ((len = read(in_fd, buf, LOG_COMP_BUF)) > 0)
+        if (gzwrite(gz, buf, len) != len) { fail = 1; break; }
+
+      if (len < 0) fail = 1;
+
+      if (gzclose(gz) != Z_OK) fail = 1;
+
+    }
+
+  }
+
+#endif /* ^USE_ZSTD */
+
+  DFL_ck_free(buf);
+  close(in_fd);
+
+  if (fail) {
+
+    WARN("Compression of log segment '%s' failed.", name);
+    unlinkat(dir_fd, (char*)out_name, 0);
+    return 1;
+
+  }
+
+  unlinkat(dir_fd, (char*)name, 0);
+  return 0;
+
+}
+
+#endif /* SEG_EXT */
+
+
+static int seg_cmp(const void* a, const void* b) {
+  return strcmp(*(char**)a, *(char**)b);
+}
+
+
+/* Compress any segments that are still raw, then drop the oldest ones so
+   that no more than seg_keep remain. */
+
+static void tidy_segments(void) {
+
+  DIR* d;
+  struct dirent* de;
+
+  u8** names = NULL;
+  u32  cnt = 0, i, j;
+  s32  fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY);
+
+  if (fd < 0 || !(d = fdopendir(fd))) {
+    WARN("Unable to list the log directory.");
+    if (fd >= 0) close(fd);
+    return;
+  }
+
+  while ((de = readdir(d))) {
+
+    u8* name = (u8*)de->d_name;
+    u32 ext  = is_segment(name);
+
+    if (!ext) continue;
+
+#ifdef SEG_EXT
+    if (name[ext] && strcmp((char*)name + ext, SEG_EXT)) continue;
+#else
+    if (name[ext]) continue;
+#endif /* ^SEG_EXT */
+
+    names = DFL_ck_realloc(names, (cnt + 1) * sizeof(u8*));
+    names[cnt++] = DFL_ck_strdup(name);
+
+  }
+
+  closedir(d);
+
+#ifdef SEG_EXT
+
+  for (i = 0; i < cnt; i++) {
+
+    u32 ext = is_segment(names[i]);
+
+    if (names[i][ext] || compress_segment(names[i])) continue;
+
+    names[i] = DFL_ck_realloc(names[i], ext + sizeof(SEG_EXT));
+    strcpy((char*)names[i] + ext, SEG_EXT);
+
+  }
+
+#endif /* SEG_EXT */
+
+  if (!cnt) return;
+
+  qsort(names, cnt, sizeof(u8*), seg_cmp);
+
+  /* An interrupted run may leave both a raw and a compressed copy of the
+     same segment; after compression, these show up twice. */
+
+  for (i = j = 0; i < cnt; i++) {
+
+    if (j && !strcmp((char*)names[j - 1], (char*)names[i])) {
+      DFL_ck_free(names[i]);
+      continue;
+    }
+
+    names[j++] = names[i];
+
+  }
+
+  cnt = j;
+
+  for (i = 0; i + seg_keep < cnt; i++)
+    if (unlinkat(dir_fd, (char*)names[i], 0) && errno != ENOENT)
+      WARN("Unable to remove old log segment '%s'.", names[i]);
+
+  for (i = 0; i < cnt; i++) DFL_ck_free(names[i]);
+  DFL_ck_free(names);
+
+}
+
+
+/* Helper thread: wait for work, then tidy up. */
+
+static void* helper_main(void* arg) {
+
+  tidy_segments();
+
+  pthread_mutex_lock(&rot_mutex);
+
+  while (1) {
+
+    while (!work_pending && !helper_stop)
+      pthread_cond_wait(&rot_cond, &rot_mutex);
+
+    if (!work_pending) break;
+
+    work_pending = 0;
+
+    pthread_mutex_unlock(&rot_mutex);
+    tidy_segments();
+    pthread_mutex_lock(&rot_mutex);
+
+  }
+
+  pthread_mutex_unlock(&rot_mutex);
+
+  return NULL;
+
+}
+
+
+/* Set up rotation for the specified log file. Must be called before dropping
+   privileges. */
+
+void logrot_init(u8* log_file, u32 keep) {
+
+  u8* dir = DFL_ck_strdup(log_file);
+  u8* sl  = (u8*)strrchr((char*)dir, '/');
+
+  if (sl) {
+
+    log_base = DFL_ck_strdup(sl + 1);
+    if (sl == dir) sl++;
+    *sl = 0;
+
+  } else {
+
+    log_base = DFL_ck_strdup(log_file);
+    strcpy((char*)dir, ".");
+
+  }
+
+  if (!log_base[0]) FATAL("Log file name '%s' is not valid.", log_file);
+
+  dir_fd = open((char*)dir, O_RDONLY | O_DIRECTORY);
+  if (dir_fd < 0) PFATAL("Cannot open log directory '%s'.", dir);
+
+  DFL_ck_free(dir);
+
+  seg_keep = keep;
+
+#ifdef SEG_EXT
+  SAYF("[+] Log rotation enabled (keeping %u segments, " SEG_EXT ").\n", keep);
+#else
+  SAYF("[+] Log rotation enabled (keeping %u segments, uncompressed).\n", keep);
+#endif /* ^SEG_EXT */
+
+}
+
+
+/* Start the helper thread. Must be called after fork_off(). */
+
+void logrot_start(void) {
+
+  if (pthread_create(&helper, NULL, helper_main, NULL))
+    FATAL("Unable to start log rotation thread.");
+
+}
+
+
+/* Move the current log out of the way and create a new, empty one. Returns
+   the descriptor of the new file. The old one must be closed by now. */
+
+s32 logrot_cycle(void) {
+
+  u8  seg[PATH_MAX], stamp[32];
+  u32 seq = 0;
+  s32 fd;
+
+  time_t ut = time(NULL);
+
+  strftime((char*)stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&ut));
+
+  /* Find a free name; several rotations can happen in the same second. */
+
+  while (1) {
+
+    u8 tmp[PATH_MAX];
+
+    if (seq > 999) FATAL("Too many log rotations in one second.");
+
+    snprintf((char*)seg, sizeof(seg), "%s.%s.%03u", log_base, stamp, seq++);
+
+#ifdef SEG_EXT
+    snprintf((char*)tmp, sizeof(tmp), "%s" SEG_EXT, seg);
+#else
+    tmp[0] = 0;
+#endif /* ^SEG_EXT */
+
+    if (faccessat(dir_fd, (char*)seg, F_OK, AT_SYMLINK_NOFOLLOW) &&
+        (!tmp[0] || faccessat(dir_fd, (char*)tmp, F_OK, AT_SYMLINK_NOFOLLOW)))
+      break;
+
+  }
+
+  if (renameat(dir_fd, (char*)log_base, dir_fd, (char*)seg))
+    PFATAL("Unable to rename '%s' to '%s'.", log_base, seg);
+
+  fd = openat(dir_fd, (char*)log_base, O_WRONLY | O_CREAT | O_EXCL |
+              O_NOFOLLOW, LOG_MODE);
+
+  if (fd < 0) PFATAL("Cannot create '%s'.", log_base);
+
+  pthread_mutex_lock(&rot_mutex);
+  work_pending = 1;
+  pthread_cond_signal(&rot_cond);
+  pthread_mutex_unlock(&rot_mutex);
+
+  return fd;
+
+}
+
+
+/* Let the helper finish outstanding work, then stop it. */
+
+void logrot_shutdown(void) {
+
+  if (dir_fd < 0) return;
+
+  pthread_mutex_lock(&rot_mutex);
+  helper_stop = 1;
+  pthread_cond_signal(&rot_cond);
+  pthread_mutex_unlock(&rot_mutex);
+
+  pthread_join(helper, NULL);
+
+}
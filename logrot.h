@@ -0,0 +1,24 @@
+/*
+   p0f - log rotation
+   ------------------
+
+   Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>
+
+   Distributed under the terms and conditions of GNU LGPL.
+
+ */
+
+#ifndef _HAVE_LOGROT_H
+#define _HAVE_LOGROT_H
+
+#include "types.h"
+
+void logrot_init(u8* log_file, u32 keep);
+
+void logrot_start(void);
+
+s32 logrot_cycle(void);
+
+void logrot_shutdown(void);
+
+#endif /* !_HAVE_LOGROT_H */
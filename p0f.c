@@ -13,6 +13,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <signal.h>
 #include <getopt.h>
@@ -32,6 +33,7 @@
 #include <sys/stat.h>
 #include <sys/file.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
 
 #include <pcap.h>
@@ -46,6 +48,15 @@
 #include "debug.h"
 #include "alloc-inl.h"
 #include "process.h"
+#include "flow_buf.h"
+#include "json.h"
+#include "logrot.h"
+#include "dgram.h"
+#include "plugin.h"
+#include "journal.h"
+#include "follow.h"
+#include "index.h"
+#include "agg.h"
 #include "readfp.h"
 #include "api.h"
 #include "tcp.h"
@@ -68,8 +79,13 @@ static u8 *use_iface,                   /* Interface to listen on             */
           *orig_rule,                   /* Original filter rule               */
           *switch_user,                 /* Target username                    */
           *log_file,                    /* Binary log file name               */
+          *dgram_spec,                  /* Datagram output socket             */
           *api_sock,                    /* API socket file name               */
           *fp_file,                     /* Location of p0f.fp                 */
+          *delta_dir,                   /* Directory with signature deltas    */
+          *state_dir,                   /* Host snapshot and journal dir      */
+          *follow_dir,                  /* Directory of pcap files to follow  */
+          *slim_file,                   /* Slim capture output file (-w)      */
           *read_file;                   /* File to read pcap data from        */
 
 static u32
@@ -79,17 +95,25 @@ u32
   max_conn        = MAX_CONN,           /* Connection entry count limit       */
   max_hosts       = MAX_HOSTS,          /* Host cache entry count limit       */
   conn_max_age    = CONN_MAX_AGE,       /* Maximum age of a connection entry  */
-  host_idle_limit = HOST_IDLE_LIMIT;    /* Host cache idle timeout            */
+  host_idle_limit = HOST_IDLE_LIMIT,    /* Host cache idle timeout            */
+  uptime_max_age  = UPTIME_MAX_AGE;     /* Timeout for flows with no payload  */
 
 static struct api_client *api_cl;       /* Array with API client state        */
           
 static s32 null_fd = -1,                /* File descriptor of /dev/null       */
-           api_fd = -1;                 /* API socket descriptor              */
+           api_fd = -1,                 /* API socket descriptor              */
+           delta_fd = -1;               /* Delta directory descriptor         */
 
 static FILE* lf;                        /* Log file stream                    */
 
+static FILE* slim_f;                    /* Slim capture stream                */
+static pcap_dumper_t* slim_pd;          /* ...and its pcap writer             */
+static u32 slim_flushed;                /* Last flush (capture time)          */
+
 static u8 stop_soon;                    /* Ctrl-C or so pressed?              */
 
+static volatile u8 delta_pending;       /* SIGUSR1 received?                  */
+
 u8 daemon_mode;                         /* Running in daemon mode?            */
 
 static u8 set_promisc;                  /* Use promiscuous mode?              */
@@ -102,6 +126,41 @@ u32 hash_seed;                          /* Hash seed                          */
 
 static u8 obs_fields;                   /* No of pending observation fields   */
 
+static u64 obs_cnt;                     /* Number of observations reported    */
+
+static u32 start_time;                  /* Startup time, for stats            */
+
+static u8 json_log;                     /* Write log file as JSON Lines?      */
+
+static u8 want_records;                 /* Any record-based outputs?          */
+
+static u8* plugin_spec[MAX_PLUGINS];    /* Plugins to load (-P)               */
+static u32 plugin_spec_cnt;             /* Number of -P options               */
+
+static u8* tbuf;                        /* Text record buffer                 */
+static u32 tlen,                        /* Bytes used                         */
+           tsize,                       /* Bytes allocated                    */
+           tbody;                       /* Offset past the timestamp          */
+
+static u8** read_list;                  /* All -r files, in order             */
+static u32  read_cnt;                   /* Number of -r files                 */
+
+static u32 win_from,                    /* -T window start (unix time)        */
+           win_to;                      /* -T window end (0 = open)           */
+
+static u8* win_host;                    /* -a address, as given               */
+static u8  win_addr[16],                /* ...and parsed                      */
+           win_alen;                    /* 4 or 16                            */
+
+static struct bpf_program win_flt;      /* Filter kept for indexed reads      */
+static u8  win_flt_set;                 /* win_flt valid?                     */
+
+static u64 rot_size;                    /* Rotate log at this size (bytes)    */
+
+static u32 rot_age,                     /* Rotate log at this age (seconds)   */
+           rot_keep,                    /* Number of rotated logs to keep     */
+           log_start;                   /* Time of first write to current log */
+
 /* Memory allocator data: */
 
 #ifdef DEBUG_BUILD
@@ -109,7 +168,7 @@ struct TRK_obj* TRK[ALLOC_BUCKETS];
 u32 TRK_cnt[ALLOC_BUCKETS];
 #endif /* DEBUG_BUILD */
 
-#define LOGF(_x...) fprintf(lf, _x)
+#define LOGF(_x...) rec_printf(_x)
 
 /* Display usage information */
 
@@ -123,25 +182,36 @@ static void usage(void) {
 "\n"
 "  -i iface  - listen on the specified network interface\n"
 "  -r file   - read offline pcap data from a given file\n"
+"  -F dir    - keep reading new pcap files as they appear in 'dir'\n"
+"  -T t1,t2  - with -r, only look at packets from t1 to t2 (unix time)\n"
+"  -a addr   - with -r, only look at traffic to and from 'addr'\n"
 "  -p        - put the listening interface in promiscuous mode\n"
 "  -L        - list all available interfaces\n"
 "\n"
 "Operating mode and output settings:\n"
 "\n"
 "  -f file   - read fingerprint database from 'file' (%s)\n"
+"  -D dir    - apply signature deltas from 'dir' at startup and on SIGUSR1\n"
 "  -o file   - write information to the specified log file\n"
+"  -w file   - save just the packets p0f needs to a pcap file (see README)\n"
+"  -J        - use JSON Lines format for the log file\n"
+"  -R s,t,n  - rotate log at s MB or after t minutes, keep n old logs\n"
+"  -U sock   - send records to a unix datagram socket (syslog:sock for RFC 5424)\n"
+"  -P lib    - load an output plugin (lib.so[:arg], can be repeated)\n"
 #ifndef __CYGWIN__
 "  -s name   - answer to API queries at a named unix socket\n"
+"  -G net    - keep separate API host counts for a prefix (can be repeated)\n"
 #endif /* !__CYGWIN__ */
+"  -c dir    - keep a crash-safe copy of the host cache in 'dir'\n"
 "  -u user   - switch to the specified unprivileged account and chroot\n"
-"  -d        - fork into background (requires -o or -s)\n"
+"  -d        - fork into background (requires -o, -s, -U or -P)\n"
 "\n"
 "Performance-related options:\n"
 "\n"
 #ifndef __CYGWIN__
 "  -S limit  - limit number of parallel API connections (%u)\n"
 #endif /* !__CYGWIN__ */
-"  -t c,h    - set connection / host cache age limits (%us,%um)\n"
+"  -t c,h,u  - set connection / host / idle flow age limits (%us,%um,%us)\n"
 "  -m c,h    - cap the number of active connections / hosts (%u,%u)\n"
 "\n"
 "Optional filter expressions (man tcpdump) can be specified in the command\n"
@@ -153,7 +223,7 @@ static void usage(void) {
 #ifndef __CYGWIN__
     API_MAX_CONN,
 #endif /* !__CYGWIN__ */
-    CONN_MAX_AGE, HOST_IDLE_LIMIT, MAX_CONN,  MAX_HOSTS);
+    CONN_MAX_AGE, HOST_IDLE_LIMIT, UPTIME_MAX_AGE, MAX_CONN,  MAX_HOSTS);
 
   exit(1);
 
@@ -250,6 +320,35 @@ static void open_log(void) {
 }
 
 
+/* Rotate log file if it got too big or too old. The capture thread only
+   renames and reopens; compression and cleanup are handled by logrot.c. */
+
+static void check_log_rotation(void) {
+
+  u32 now = get_unix_time();
+  s32 log_fd;
+
+  if (!log_start) log_start = now;
+
+  if (!(rot_size && ftello(lf) >= (off_t)rot_size) &&
+      !(rot_age && now - log_start >= rot_age)) return;
+
+  if (fclose(lf)) PFATAL("Unable to close '%s'.", log_file);
+
+  log_fd = logrot_cycle();
+
+  if (flock(log_fd, LOCK_EX | LOCK_NB))
+    FATAL("'%s' is being used by another process.", log_file);
+
+  lf = fdopen(log_fd, "a");
+
+  if (!lf) FATAL("fdopen() on '%s' failed.", log_file);
+
+  log_start = now;
+
+}
+
+
 /* Create and start listening on API socket */
 
 static void open_api(void) {
@@ -304,6 +403,51 @@ static void open_api(void) {
 }
 
 
+/* Append to the text record buffer. */
+
+static void rec_printf(char* fmt, ...) {
+
+  va_list args;
+  s32 len;
+
+  while (1) {
+
+    va_start(args, fmt);
+    len = vsnprintf((char*)tbuf + tlen, tsize - tlen, fmt, args);
+    va_end(args);
+
+    if (len < 0) FATAL("Whoa, vsnprintf() fails?!");
+
+    if (tlen + len < tsize) break;
+
+    tsize = MAX(tsize * 2, tlen + len + 1);
+    tbuf  = DFL_ck_realloc(tbuf, tsize);
+
+  }
+
+  tlen += len;
+
+}
+
+
+/* Hand a finished record over to all outputs. 'body' is the offset past the
+   leading timestamp, for outputs that have timestamps of their own. */
+
+static void emit_record(u8* rec, u32 len, u32 body) {
+
+  if (log_file) {
+
+    fwrite(rec, len, 1, lf);
+
+    if (rot_keep) check_log_rotation();
+
+  }
+
+  if (dgram_spec) dgram_queue(rec + body, len - body);
+
+}
+
+
 /* Open log entry. */
 
 void start_observation(char* keyword, u8 field_cnt, u8 to_srv,
@@ -311,6 +455,8 @@ void start_observation(char* keyword, u8 field_cnt, u8 to_srv,
 
   if (obs_fields) FATAL("Premature end of observation.");
 
+  obs_cnt++;
+
   if (!daemon_mode) {
 
     SAYF(".-[ %s/%u -> ", addr_to_str(f->client->addr, f->client->ip_ver),
@@ -325,7 +471,34 @@ void start_observation(char* keyword, u8 field_cnt, u8 to_srv,
 
   }
 
-  if (log_file) {
+  if (want_records && json_log) {
+
+    static time_t last_ut;
+    static u8 tmp[64];
+
+    time_t ut = get_unix_time();
+
+    /* localtime() and strftime() are not cheap, so only redo them once
+       a second. */
+
+    if (ut != last_ut) {
+      strftime((char*)tmp, 64, "%Y/%m/%d %H:%M:%S", localtime(&ut));
+      last_ut = ut;
+    }
+
+    json_begin();
+
+    json_add_num("time", ut);
+    json_add_str("date", tmp);
+    json_add_str("mod", (u8*)keyword);
+    json_add_num("ip_ver", f->client->ip_ver);
+    json_add_addr("cli", f->client->addr, f->client->ip_ver);
+    json_add_num("cli_port", f->cli_port);
+    json_add_addr("srv", f->server->addr, f->server->ip_ver);
+    json_add_num("srv_port", f->srv_port);
+    json_add_str("subj", (u8*)(to_srv ? "cli" : "srv"));
+
+  } else if (want_records) {
 
     u8 tmp[64];
 
@@ -334,7 +507,13 @@ void start_observation(char* keyword, u8 field_cnt, u8 to_srv,
 
     strftime((char*)tmp, 64, "%Y/%m/%d %H:%M:%S", lt);
 
-    LOGF("[%s] mod=%s|cli=%s/%u|",tmp, keyword, addr_to_str(f->client->addr,
+    tlen = 0;
+
+    LOGF("[%s] ", tmp);
+
+    tbody = tlen;
+
+    LOGF("mod=%s|cli=%s/%u|", keyword, addr_to_str(f->client->addr,
          f->client->ip_ver), f->cli_port);
 
     LOGF("srv=%s/%u|subj=%s", addr_to_str(f->server->addr, f->server->ip_ver),
@@ -342,6 +521,8 @@ void start_observation(char* keyword, u8 field_cnt, u8 to_srv,
 
   }
 
+  if (plugin_cnt) plugin_begin(keyword, to_srv, f);
+
   obs_fields = field_cnt;
 
 }
@@ -356,7 +537,14 @@ void add_observation_field(char* key, u8* value) {
   if (!daemon_mode)
     SAYF("| %-8s = %s\n", key, value ? value : (u8*)"???");
 
-  if (log_file) LOGF("|%s=%s", key, value ? value : (u8*)"???");
+  if (want_records) {
+
+    if (json_log) json_add_str(key, value);
+    else LOGF("|%s=%s", key, value ? value : (u8*)"???");
+
+  }
+
+  if (plugin_cnt) plugin_add_str(key, value);
 
   obs_fields--;
 
@@ -364,13 +552,73 @@ void add_observation_field(char* key, u8* value) {
 
     if (!daemon_mode) SAYF("|\n`----\n\n");
 
-    if (log_file) LOGF("\n");
+    if (plugin_cnt) plugin_commit();
+
+    if (want_records) {
+
+      if (json_log) {
+
+        u32 len;
+        u8* rec = json_finish(&len);
+
+        emit_record(rec, len, 0);
+
+      } else {
+
+        LOGF("\n");
+        emit_record(tbuf, tlen, tbody);
+
+      }
+
+    }
 
   }
 
 }
 
 
+/* Add a numeric log item. These are only carried by structured outputs, and
+   do not count toward the field count given to start_observation(), so they
+   must be added before the last regular field. */
+
+void add_observation_num(char* key, s64 value) {
+
+  if (!obs_fields) FATAL("Unexpected observation field ('%s').", key);
+
+  if (want_records && json_log) json_add_num(key, value);
+
+  if (plugin_cnt) plugin_add_num(key, value);
+
+}
+
+
+/* Write a packet, cut down to caplen, to the slim capture file. The writer
+   is set up on first use, as the link type may not be known until then. */
+
+void slim_write(const struct pcap_pkthdr* hdr, const u8* data, u32 caplen) {
+
+  struct pcap_pkthdr h = *hdr;
+
+  if (!slim_pd) {
+
+    pcap_t* dead = pcap_open_dead(link_type, SNAPLEN);
+
+    if (!dead || !(slim_pd = pcap_dump_fopen(dead, slim_f)))
+      FATAL("Unable to set up pcap output for '%s'.", slim_file);
+
+  }
+
+  h.caplen = caplen;
+  pcap_dump((u8*)slim_pd, &h, data);
+
+  if (h.ts.tv_sec != slim_flushed) {
+    pcap_dump_flush(slim_pd);
+    slim_flushed = h.ts.tv_sec;
+  }
+
+}
+
+
 /* Show PCAP interface list */
 
 static void list_interfaces(void) {
@@ -459,6 +707,21 @@ static void prepare_pcap(void) {
   char pcap_err[PCAP_ERRBUF_SIZE];
   u8* orig_iface = use_iface;
 
+  if (follow_dir) {
+
+    if (set_promisc)
+      FATAL("Dude, how am I supposed to make a file promiscuous?");
+
+    if (use_iface || read_file)
+      FATAL("Option -F can't be combined with -i or -r.");
+
+    /* Capture files are opened one by one in the event loop. */
+
+    follow_open(follow_dir, state_dir);
+    return;
+
+  }
+
   if (read_file) {
 
     if (set_promisc)
@@ -533,7 +796,7 @@ static void prepare_pcap(void) {
 
 /* Initialize BPF filtering */
 
-static void prepare_bpf(void) {
+static void prepare_bpf(u8 quiet) {
 
   struct bpf_program flt;
 
@@ -598,9 +861,19 @@ retry_no_vlan:
   if (pcap_setfilter(pt, &flt))
     FATAL("pcap_setfilter() didn't work, strange.");
 
-  pcap_freecode(&flt);
+  /* Indexed reads skip around and filter on their own, see read_indexed(). */
 
-  if (!orig_rule) {
+  if (win_from || win_to || win_host) {
+    if (win_flt_set) pcap_freecode(&win_flt);
+    win_flt     = flt;
+    win_flt_set = 1;
+  } else pcap_freecode(&flt);
+
+  if (quiet) {
+
+    if (orig_rule) ck_free(final_rule);
+
+  } else if (!orig_rule) {
 
     SAYF("[+] Default packet filtering configured%s.\n",
          vlan_support ? " [+VLAN]" : "");
@@ -726,6 +999,154 @@ static void abort_handler(int sig) {
 }
 
 
+/* Handler for SIGUSR1: look for new signature deltas. */
+
+static void delta_handler(int sig) {
+  delta_pending = 1;
+}
+
+
+/* Fill out the response to an API stats query. */
+
+void fill_api_stats(struct p0f_stats_response* r) {
+
+  struct pcap_stat ps;
+  struct rusage ru;
+
+  memset(r, 0, sizeof(struct p0f_stats_response));
+
+  r->magic      = P0F_STATS_RESP_MAGIC;
+  r->status     = P0F_STATUS_OK;
+  r->start_time = start_time;
+  r->cur_time   = time(NULL);
+  r->packets    = packet_cnt;
+  r->records    = obs_cnt;
+  r->hosts      = host_cnt;
+  r->flows      = flow_cnt;
+  r->ts_flows   = ts_flow_cnt;
+  r->conns      = conn_cnt;
+
+  r->rematch_hosts   = rematch_hosts;
+  r->rematch_left    = rematch_left();
+  r->rematch_changed = rematch_changed;
+
+  r->http_cache_hits   = http_cache_hits;
+  r->http_cache_misses = http_cache_misses;
+  r->ua_cache_hits     = ua_cache_hits;
+  r->ua_cache_misses   = ua_cache_misses;
+
+  r->fp_revision = fp_revision;
+  r->fp_digest   = fp_digest;
+
+  memcpy(r->lat_process, lat_process, sizeof(lat_process));
+  memcpy(r->lat_update,  lat_update,  sizeof(lat_update));
+  memcpy(r->lat_visible, lat_visible, sizeof(lat_visible));
+
+  if (!follow_dir && !pcap_stats(pt, &ps)) {
+    r->pcap_recv   = ps.ps_recv;
+    r->pcap_drop   = ps.ps_drop;
+    r->pcap_ifdrop = ps.ps_ifdrop;
+  }
+
+  if (!getrusage(RUSAGE_SELF, &ru)) {
+    r->cpu_user_ms = ru.ru_utime.tv_sec * 1000 + ru.ru_utime.tv_usec / 1000;
+    r->cpu_sys_ms  = ru.ru_stime.tv_sec * 1000 + ru.ru_stime.tv_usec / 1000;
+  }
+
+}
+
+
+/* Open the next capture file in follow mode, if one is ready. */
+
+static void follow_open_next(void) {
+
+  char pcap_err[PCAP_ERRBUF_SIZE];
+  static u8 got_link;
+  u8*  name;
+  s64  off;
+  s32  fd;
+
+  while ((fd = follow_next(&name, &off)) >= 0) {
+
+    FILE* f = fdopen(fd, "r");
+
+    if (!f) PFATAL("fdopen() failed.");
+
+    pt = pcap_fopen_offline(f, pcap_err);
+
+    if (!pt) {
+      WARN("Skipping '%s': %s", name, pcap_err);
+      fclose(f);
+      follow_done();
+      continue;
+    }
+
+    if (got_link && pcap_datalink(pt) != link_type) {
+      WARN("Skipping '%s': link type differs from the first file.", name);
+      pcap_close(pt);
+      pt = NULL;
+      follow_done();
+      continue;
+    }
+
+    if (off && fseek(f, off, SEEK_SET)) PFATAL("fseek() failed.");
+
+    link_type = pcap_datalink(pt);
+    prepare_bpf(got_link);
+    got_link = 1;
+
+    if (!daemon_mode)
+      SAYF("[+] Processing '%s'%s.\n", name, off ? " (resumed)" : "");
+
+    return;
+
+  }
+
+}
+
+
+/* Process the next batch of packets from the current file in follow mode;
+   move on to the next file once done. */
+
+static void follow_step(void) {
+
+  s32 ret;
+
+  if (!pt) {
+    follow_events();
+    follow_open_next();
+    if (!pt) return;
+  }
+
+  ret = pcap_dispatch(pt, FOLLOW_BATCH, (pcap_handler)parse_packet, 0);
+
+  if (ret > 0) {
+    follow_progress(ftell(pcap_file(pt)));
+    return;
+  }
+
+  if (ret < 0) WARN("Error reading capture file: %s", pcap_geterr(pt));
+
+  pcap_close(pt);
+  pt = NULL;
+
+  follow_done();
+  follow_events();
+  follow_open_next();
+
+}
+
+
+/* What to poll() on in follow mode: the current file, which is always
+   readable, or inotify while waiting for the next one. */
+
+static s32 follow_pollfd(void) {
+
+  return pt ? fileno(pcap_file(pt)) : follow_fd();
+
+}
+
+
 #ifndef __CYGWIN__
 
 /* Regenerate pollfd data for poll() */
@@ -733,7 +1154,7 @@ static void abort_handler(int sig) {
 static u32 regen_pfds(struct pollfd* pfds, struct api_client** ctable) {
   u32 i, count = 2;
 
-  pfds[0].fd     = pcap_fileno(pt);
+  pfds[0].fd     = follow_dir ? follow_pollfd() : pcap_fileno(pt);
   pfds[0].events = (POLLIN | POLLERR | POLLHUP);
 
   DEBUG("[#] Recomputing pollfd data, pcap_fd = %d.\n", pfds[0].fd);
@@ -750,9 +1171,12 @@ static u32 regen_pfds(struct pollfd* pfds, struct api_client** ctable) {
     ctable[count] = api_cl + i;
 
     /* If we haven't received a complete query yet, wait for POLLIN.
-       Otherwise, we want to write stuff. */
+       Otherwise, we want to write stuff - unless it's a parked wait
+       query, which only needs to hear about hangups. */
 
-    if (api_cl[i].in_off < sizeof(struct p0f_api_query))
+    if (api_cl[i].parked)
+      pfds[count].events = (POLLERR | POLLHUP);
+    else if (!api_cl[i].out_len)
       pfds[count].events = (POLLIN | POLLERR | POLLHUP);
     else
       pfds[count].events = (POLLOUT | POLLERR | POLLHUP);
@@ -795,6 +1219,8 @@ static void live_event_loop(void) {
   ctable = ck_alloc((1 + (api_sock ? (1 + api_max_conn) : 0)) *
                     sizeof(struct api_client*));
 
+  if (follow_dir) follow_open_next();
+
   pfd_count = regen_pfds(pfds, ctable);
 
   if (!daemon_mode) 
@@ -802,7 +1228,7 @@ static void live_event_loop(void) {
 
   while (!stop_soon) {
 
-    s32 pret, i;
+    s32 pret, i, timeout;
     u32 cur;
 
     /* We use a 250 ms timeout to keep Ctrl-C responsive without resortng to
@@ -810,11 +1236,30 @@ static void live_event_loop(void) {
 
 poll_again:
 
-    pret = poll(pfds, pfd_count, 250);
+    if (delta_pending) {
+      delta_pending = 0;
+      if (apply_deltas(delta_fd)) rematch_start();
+    }
+
+    if (dgram_spec) dgram_flush();
+
+    /* Cached hosts are re-matched a slice at a time after a delta; don't
+       wait in poll() while that's still going. Don't oversleep parked API
+       wait queries either. */
+
+    timeout = rematch_step() ? 0 : 250;
+
+    if (api_answer_parked(&timeout)) pfd_count = regen_pfds(pfds, ctable);
+
+    pret = poll(pfds, pfd_count, timeout);
 
     if (pret < 0) {
-      if (errno == EINTR) break;
+
+      /* Signals: either stop_soon or delta_pending is set now. */
+
+      if (errno == EINTR) continue;
       PFATAL("poll() failed.");
+
     }
 
     if (!pret) { if (log_file) fflush(lf); continue; }
@@ -833,12 +1278,12 @@ poll_again:
 
           /* Write API response, restart state when complete. */
 
-          if (ctable[cur]->in_off < sizeof(struct p0f_api_query))
+          if (!ctable[cur]->out_len)
             FATAL("Inconsistent p0f_api_response state.\n");
 
           i = write(pfds[cur].fd, 
                    ((char*)&ctable[cur]->out_data) + ctable[cur]->out_off,
-                   sizeof(struct p0f_api_response) - ctable[cur]->out_off);
+                   ctable[cur]->out_len - ctable[cur]->out_off);
 
           if (i <= 0) PFATAL("write() on API socket fails despite POLLOUT.");
 
@@ -846,9 +1291,11 @@ poll_again:
 
           /* All done? Back to square zero then! */
 
-          if (ctable[cur]->out_off == sizeof(struct p0f_api_response)) {
+          if (ctable[cur]->out_off == ctable[cur]->out_len) {
 
              ctable[cur]->in_off = ctable[cur]->out_off = 0;
+             ctable[cur]->out_len = 0;
+             ctable[cur]->in_len  = sizeof(u32);
              pfds[cur].events   = (POLLIN | POLLERR | POLLHUP);
 
           }
@@ -861,9 +1308,16 @@ poll_again:
 
           /* Process traffic on the capture interface. */
 
-          if (pcap_dispatch(pt, -1, (pcap_handler)parse_packet, 0) < 0)
+          if (follow_dir) {
+
+            follow_step();
+            pfds[0].fd = follow_pollfd();
+
+          } else if (pcap_dispatch(pt, -1, (pcap_handler)parse_packet, 0) < 0)
             FATAL("Packet capture interface is down.");
 
+          note_batch_done();
+
           break;
 
         case 1:
@@ -890,6 +1344,8 @@ poll_again:
                 PFATAL("fcntl() to set O_NONBLOCK on API connection fails.");
 
               api_cl[i].in_off = api_cl[i].out_off = 0;
+              api_cl[i].out_len = 0;
+              api_cl[i].in_len  = sizeof(u32);
               pfd_count = regen_pfds(pfds, ctable);
 
               DEBUG("[#] Accepted new API connection, fd %d.\n", api_cl[i].fd);
@@ -906,23 +1362,36 @@ poll_again:
 
           /* Receive API query, dispatch when complete. */
 
-          if (ctable[cur]->in_off >= sizeof(struct p0f_api_query))
+          if (ctable[cur]->out_len ||
+              ctable[cur]->in_off >= ctable[cur]->in_len)
             FATAL("Inconsistent p0f_api_query state.\n");
 
           i = read(pfds[cur].fd, 
                    ((char*)&ctable[cur]->in_data) + ctable[cur]->in_off,
-                   sizeof(struct p0f_api_query) - ctable[cur]->in_off);
+                   ctable[cur]->in_len - ctable[cur]->in_off);
 
           if (i < 0) PFATAL("read() on API socket fails despite POLLIN.");
 
           ctable[cur]->in_off += i;
 
+          /* Once the magic is in, we know how long the query is. */
+
+          if (ctable[cur]->in_off == sizeof(u32))
+            ctable[cur]->in_len = api_query_len(ctable[cur]->in_data.host.magic);
+
           /* Query in place? Compute response and prepare to send it back. */
 
-          if (ctable[cur]->in_off == sizeof(struct p0f_api_query)) {
+          if (ctable[cur]->in_off == ctable[cur]->in_len) {
+
+            ctable[cur]->out_len = handle_query((u8*)&ctable[cur]->in_data,
+                                                (u8*)&ctable[cur]->out_data);
 
-            handle_query(&ctable[cur]->in_data, &ctable[cur]->out_data);
-            pfds[cur].events = (POLLOUT | POLLERR | POLLHUP);
+            if (ctable[cur]->out_len) {
+              pfds[cur].events = (POLLOUT | POLLERR | POLLHUP);
+            } else {
+              api_park(ctable[cur]);
+              pfds[cur].events = (POLLERR | POLLHUP);
+            }
 
           }
 
@@ -946,6 +1415,8 @@ poll_again:
 
           close(pfds[cur].fd);
           ctable[cur]->fd = -1;
+
+          if (ctable[cur]->parked) api_unpark(ctable[cur]);
  
           pfd_count = regen_pfds(pfds, ctable);
           goto poll_again;
@@ -978,6 +1449,8 @@ poll_again:
 
     if (ret < 0) return;
 
+    note_batch_done();
+
     if (log_file && !ret) fflush(lf);
 
     write(2, NULL, 0);
@@ -991,20 +1464,160 @@ poll_again:
 }
 
 
+/* Packet callback for -T: drop packets outside the time window. */
+
+static void window_packet(void* junk, const struct pcap_pkthdr* hdr,
+                          const u8* data) {
+
+  if (hdr->ts.tv_sec < win_from || (win_to && hdr->ts.tv_sec > win_to))
+    return;
+
+  parse_packet(junk, hdr, data);
+
+}
+
+
+/* Does an indexed region possibly have anything for -T and -a? */
+
+static u8 index_match(u32 first_ts, u32 last_ts, u8* bloom, u32 size) {
+
+  if (last_ts < win_from || (win_to && first_ts > win_to)) return 0;
+
+  return !win_host || idx_bloom_has(bloom, size, win_addr, win_alen);
+
+}
+
+
+/* Read a file using its index, if there is one: skip blocks that don't
+   match -T or -a. libpcap filtering is replaced with an accept-all rule, so
+   that we know where each packet ends, and the real filter is applied here.
+   Returns 0 if the file needs to be read sequentially after all. */
+
+static u8 read_indexed(u8* fname) {
+
+  struct p0f_idx_hdr* ih = index_load(fname);
+  struct p0f_idx_block* blk;
+  struct bpf_program all;
+  FILE* f = pcap_file(pt);
+
+  u64 pos = 0;
+  u32 i, used = 0;
+
+  if (!ih) return 0;
+
+  blk = (struct p0f_idx_block*)(ih + 1);
+
+  if (!ih->blocks || !index_match(ih->first_ts, ih->last_ts, ih->bloom,
+                                  P0F_IDX_FBLOOM)) {
+
+    SAYF("[+] Index says '%s' has nothing of interest, skipping.\n", fname);
+    ck_free(ih);
+    return 1;
+
+  }
+
+  if (pcap_compile(pt, &all, "", 1, 0) || pcap_setfilter(pt, &all))
+    FATAL("Unable to reset the packet filter.");
+
+  pcap_freecode(&all);
+
+  for (i = 0; i < ih->blocks && !stop_soon; i++) {
+
+    u64 end = (i + 1 < ih->blocks) ? blk[i + 1].offset : ih->pcap_size;
+
+    if (!index_match(blk[i].first_ts, blk[i].last_ts, blk[i].bloom,
+                     P0F_IDX_BLOOM)) continue;
+
+    used++;
+
+    if (pos != blk[i].offset) {
+      if (fseek(f, blk[i].offset, SEEK_SET)) PFATAL("fseek() failed.");
+      pos = blk[i].offset;
+    }
+
+    while (pos < end) {
+
+      struct pcap_pkthdr* hdr;
+      const u8* data;
+
+      if (pcap_next_ex(pt, &hdr, &data) != 1) break;
+
+      /* Classic pcap: 16-byte record header, then captured data. */
+
+      pos += 16 + hdr->caplen;
+
+      if (win_flt_set && !pcap_offline_filter(&win_flt, hdr, data)) continue;
+
+      window_packet(NULL, hdr, data);
+
+    }
+
+  }
+
+  SAYF("[+] Index: read %u of %u blocks of '%s'.\n", used, ih->blocks, fname);
+
+  ck_free(ih);
+  return 1;
+
+}
+
+
+/* Open the next -r file. Returns 0 if it should be skipped. */
+
+static u8 open_read_file(u8* fname) {
+
+  char pcap_err[PCAP_ERRBUF_SIZE];
+
+  if (pt) pcap_close(pt);
+
+  pt = pcap_open_offline((char*)fname, pcap_err);
+
+  if (!pt) {
+    WARN("Skipping '%s': %s", fname, pcap_err);
+    return 0;
+  }
+
+  if (pcap_datalink(pt) != link_type) {
+    WARN("Skipping '%s': link type differs from the first file.", fname);
+    return 0;
+  }
+
+  SAYF("[+] Will read pcap data from file '%s'.\n", fname);
+
+  prepare_bpf(1);
+  return 1;
+
+}
+
+
 /* Simple event loop for processing offline captures. */
 
 static void offline_event_loop(void) {
 
+  u32 i;
+
   if (!daemon_mode) 
     SAYF("[+] Processing capture data.\n\n");
 
-  while (!stop_soon)  {
+  for (i = 0; i < read_cnt && !stop_soon; i++) {
+
+    if (i && !open_read_file(read_list[i])) continue;
+
+    if (!win_from && !win_to && !win_host) {
+
+      while (!stop_soon)
+        if (pcap_dispatch(pt, -1, (pcap_handler)parse_packet, 0) <= 0) break;
+
+    } else if (!read_indexed(read_list[i])) {
 
-    if (pcap_dispatch(pt, -1, (pcap_handler)parse_packet, 0) <= 0) return;
+      while (!stop_soon)
+        if (pcap_dispatch(pt, -1, (pcap_handler)window_packet, 0) <= 0) break;
+
+    }
 
   }
 
-  WARN("User-initiated shutdown.");
+  if (stop_soon) WARN("User-initiated shutdown.");
 
 }
 
@@ -1014,6 +1627,7 @@ static void offline_event_loop(void) {
 int main(int argc, char** argv) {
 
   s32 r;
+  u32 i, rot_mb;
 
   setlinebuf(stdout);
 
@@ -1022,13 +1636,54 @@ int main(int argc, char** argv) {
   if (getuid() != geteuid())
     FATAL("Please don't make me setuid. See README for more.\n");
 
-  while ((r = getopt(argc, argv, "+LS:df:i:m:o:pr:s:t:u:")) != -1) switch (r) {
+  while ((r = getopt(argc, argv, "+D:F:G:JLP:R:S:T:U:a:c:df:i:m:o:pr:s:t:u:w:")) != -1) switch (r) {
+
+    case 'D':
+
+      if (delta_dir)
+        FATAL("Multiple -D options not supported.");
+
+      delta_dir = (u8*)optarg;
+      break;
+
+    case 'G':
+
+      agg_add_prefix((u8*)optarg);
+      break;
+
+    case 'J':
+
+      json_log = 1;
+      break;
 
     case 'L':
 
       list_interfaces();
       exit(0);
 
+    case 'P':
+
+      if (plugin_spec_cnt == MAX_PLUGINS)
+        FATAL("Too many -P options (limit: %u).", MAX_PLUGINS);
+
+      plugin_spec[plugin_spec_cnt++] = (u8*)optarg;
+      break;
+
+    case 'R':
+
+      if (rot_keep)
+        FATAL("Multiple -R options not supported.");
+
+      if (sscanf(optarg, "%u,%u,%u", &rot_mb, &rot_age, &rot_keep) != 3 ||
+          rot_mb > 100000 || rot_age > 1000000 || !rot_keep ||
+          rot_keep > 1000 || (!rot_mb && !rot_age))
+        FATAL("Outlandish value specified for -R.");
+
+      rot_size = rot_mb * 1024ULL * 1024;
+      rot_age  *= 60;
+
+      break;
+
     case 'S':
 
 #ifdef __CYGWIN__
@@ -1050,6 +1705,22 @@ int main(int argc, char** argv) {
 #endif /* ^__CYGWIN__ */
 
 
+    case 'U':
+
+      if (dgram_spec)
+        FATAL("Multiple -U options not supported.");
+
+      dgram_spec = (u8*)optarg;
+      break;
+
+    case 'c':
+
+      if (state_dir)
+        FATAL("Multiple -c options not supported.");
+
+      state_dir = (u8*)optarg;
+      break;
+
     case 'd':
 
       if (daemon_mode)
@@ -1106,10 +1777,44 @@ int main(int argc, char** argv) {
 
     case 'r':
 
-      if (read_file)
-        FATAL("Multiple -r options not supported.");
+      read_list = DFL_ck_realloc(read_list, (read_cnt + 1) * sizeof(u8*));
+      read_list[read_cnt++] = (u8*)optarg;
+
+      read_file = read_list[0];
+
+      break;
+
+    case 'T':
 
-      read_file = (u8*)optarg;
+      if (win_from || win_to)
+        FATAL("Multiple -T options not supported.");
+
+      if (sscanf(optarg, "%u,%u", &win_from, &win_to) != 2 ||
+          (win_to && win_to < win_from))
+        FATAL("Bad time window for -T (use 'from,to' in unix time).");
+
+      break;
+
+    case 'a':
+
+      if (win_host)
+        FATAL("Multiple -a options not supported.");
+
+      win_host = (u8*)optarg;
+
+      if (inet_pton(AF_INET, (char*)win_host, win_addr) == 1) win_alen = 4;
+      else if (inet_pton(AF_INET6, (char*)win_host, win_addr) == 1)
+        win_alen = 16;
+      else FATAL("Bad IPv4 or IPv6 address for -a.");
+
+      break;
+
+    case 'F':
+
+      if (follow_dir)
+        FATAL("Multiple -F options not supported.");
+
+      follow_dir = (u8*)optarg;
 
       break;
 
@@ -1132,12 +1837,15 @@ int main(int argc, char** argv) {
 
     case 't':
 
-      if (conn_max_age != CONN_MAX_AGE || host_idle_limit != HOST_IDLE_LIMIT)
+      if (conn_max_age != CONN_MAX_AGE || host_idle_limit != HOST_IDLE_LIMIT ||
+          uptime_max_age != UPTIME_MAX_AGE)
         FATAL("Multiple -t options not supported.");
 
-      if (sscanf(optarg, "%u,%u", &conn_max_age, &host_idle_limit) != 2 ||
+      if (sscanf(optarg, "%u,%u,%u", &conn_max_age, &host_idle_limit,
+                 &uptime_max_age) < 2 ||
           !conn_max_age || conn_max_age > 1000000 ||
-          !host_idle_limit || host_idle_limit > 1000000)
+          !host_idle_limit || host_idle_limit > 1000000 ||
+          !uptime_max_age || uptime_max_age > 1000000)
         FATAL("Outlandish value specified for -t.");
 
       break;
@@ -1151,6 +1859,15 @@ int main(int argc, char** argv) {
 
       break;
 
+    case 'w':
+
+      if (slim_file)
+        FATAL("Multiple -w options not supported.");
+
+      slim_file = (u8*)optarg;
+
+      break;
+
     default: usage();
 
   }
@@ -1165,16 +1882,44 @@ int main(int argc, char** argv) {
   if (read_file && api_sock)
     FATAL("API mode looks down on ofline captures.");
 
+  if ((win_from || win_to || win_host) && !read_file)
+    FATAL("Options -T and -a make sense only with -r.");
+
+  if (read_cnt > 1 && switch_user)
+    FATAL("Multiple -r files can't be combined with -u.");
+
+  /* Let BPF do the host filtering; the index only helps skip data. */
+
+  if (win_host) {
+
+    u8* rule = DFL_ck_alloc(strlen((char*)win_host) +
+                        (orig_rule ? strlen((char*)orig_rule) : 0) + 32);
+
+    if (orig_rule)
+      sprintf((char*)rule, "(host %s) and (%s)", win_host, orig_rule);
+    else
+      sprintf((char*)rule, "host %s", win_host);
+
+    orig_rule = rule;
+
+  }
+
   if (!api_sock && api_max_conn != API_MAX_CONN)
     FATAL("Option -S makes sense only with -s.");
 
+  if (json_log && !log_file && !dgram_spec)
+    FATAL("Option -J makes sense only with -o or -U.");
+
+  if (rot_keep && !log_file)
+    FATAL("Option -R makes sense only with -o.");
+
   if (daemon_mode) {
 
     if (read_file)
       FATAL("Daemon mode and offline captures don't mix.");
 
-    if (!log_file && !api_sock)
-      FATAL("Daemon mode requires -o or -s.");
+    if (!log_file && !api_sock && !dgram_spec && !plugin_spec_cnt)
+      FATAL("Daemon mode requires -o, -s, -U, or -P.");
 
 #ifdef __CYGWIN__
 
@@ -1199,12 +1944,45 @@ int main(int argc, char** argv) {
 
   http_init();
 
+  flow_pool_init(max_conn * FLOW_CHUNKS_PER_CONN);
+
   read_config(fp_file ? fp_file : (u8*)FP_FILE);
 
+  if (delta_dir) {
+
+    /* Keep the directory open, so that it's reachable after chroot(). */
+
+    delta_fd = open((char*)delta_dir, O_RDONLY | O_DIRECTORY);
+    if (delta_fd < 0) PFATAL("Cannot open delta directory '%s'.", delta_dir);
+
+    apply_deltas(delta_fd);
+
+  }
+
+  if (state_dir) journal_open(state_dir);
+
   prepare_pcap();
-  prepare_bpf();
+  if (!follow_dir) prepare_bpf(0);
 
   if (log_file) open_log();
+  if (dgram_spec) dgram_init(dgram_spec);
+
+  if (slim_file) {
+
+    s32 fd = open((char*)slim_file, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW |
+                  O_LARGEFILE, 0600);
+
+    if (fd < 0 || !(slim_f = fdopen(fd, "w")))
+      PFATAL("Cannot create '%s'.", slim_file);
+
+    slim_export = 1;
+
+  }
+
+  for (i = 0; i < plugin_spec_cnt; i++) plugin_load(plugin_spec[i]);
+
+  want_records = (log_file || dgram_spec);
+  if (rot_keep) logrot_init(log_file, rot_keep);
   if (api_sock) open_api();
   
   if (daemon_mode) {
@@ -1213,18 +1991,61 @@ int main(int argc, char** argv) {
   }
   
   if (switch_user) drop_privs();
+  if (switch_user && dgram_spec) dgram_chroot();
 
   if (daemon_mode) fork_off();
 
+  if (rot_keep) logrot_start();
+  plugin_start(read_file || follow_dir);
+  journal_start(read_file || follow_dir);
+
   signal(SIGHUP, daemon_mode ? SIG_IGN : abort_handler);
   signal(SIGINT, abort_handler);
   signal(SIGTERM, abort_handler);
 
+  if (delta_dir && !read_file) signal(SIGUSR1, delta_handler);
+
+  start_time    = time(NULL);
+  track_latency = !read_file && !follow_dir;
+
   if (read_file) offline_event_loop(); else live_event_loop();
 
-  if (!daemon_mode)
+  if (rot_keep) {
+    fflush(lf);
+    logrot_shutdown();
+  }
+
+  if (dgram_spec) {
+    dgram_flush();
+    if (!daemon_mode) dgram_report();
+  }
+
+  if (follow_dir) {
+    if (pt) follow_progress(ftell(pcap_file(pt)));
+    follow_shutdown();
+  }
+
+  plugin_shutdown();
+  journal_shutdown();
+
+  if (slim_pd) pcap_dump_close(slim_pd);
+  else if (slim_f) fclose(slim_f);
+
+  if (!daemon_mode) {
+
+    struct pcap_stat ps;
+
     SAYF("\nAll done. Processed %llu packets.\n", packet_cnt);
 
+    if (slim_file)
+      SAYF("[+] Wrote %llu packets to '%s'.\n", slim_cnt, slim_file);
+
+    if (!read_file && !follow_dir && !pcap_stats(pt, &ps) && (ps.ps_drop || ps.ps_ifdrop))
+      WARN("Capture dropped %u packets (%u by the interface).", ps.ps_drop,
+           ps.ps_ifdrop);
+
+  }
+
 #ifdef DEBUG_BUILD
   destroy_all_hosts();
   TRK_report();
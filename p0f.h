@@ -16,13 +16,22 @@
 
 extern u8  daemon_mode;
 extern s32 link_type;
-extern u32 max_conn, max_hosts, conn_max_age, host_idle_limit, hash_seed;
+extern u32 max_conn, max_hosts, conn_max_age, host_idle_limit, uptime_max_age,
+           hash_seed;
 
 void start_observation(char* keyword, u8 field_cnt, u8 to_srv,
                        struct packet_flow* pf);
 
 void add_observation_field(char* key, u8* value);
 
+void add_observation_num(char* key, s64 value);
+
+void slim_write(const struct pcap_pkthdr* hdr, const u8* data, u32 caplen);
+
+struct p0f_stats_response;
+
+void fill_api_stats(struct p0f_stats_response* r);
+
 #define OBSERVF(_key, _fmt...) do { \
     u8* _val; \
     _val = alloc_printf(_fmt); \
@@ -36,11 +45,18 @@ struct api_client {
 
   s32 fd;                               /* -1 if slot free                    */
 
-  struct p0f_api_query in_data;         /* Query recv buffer                  */
-  u32 in_off;                           /* Query buffer offset                */
+  union p0f_api_any_query in_data;      /* Query recv buffer                  */
+  u32 in_off,                           /* Query buffer offset                */
+      in_len;                           /* Expected query length              */
+
+  union p0f_api_any_response out_data;  /* Response transmit buffer           */
+  u32 out_off,                          /* Response buffer offset             */
+      out_len;                          /* Response length, 0 if none pending */
 
-  struct p0f_api_response out_data;     /* Response transmit buffer           */
-  u32 out_off;                          /* Response buffer offset             */
+  u8  parked;                           /* Wait query held back?              */
+  u8  woken;                            /* Host got a verdict since parking   */
+  u64 wait_until;                       /* Deadline (wall clock, ms)          */
+  struct api_client* wait_next;         /* Next parked client in bucket       */
 
 };
 
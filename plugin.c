@@ -0,0 +1,345 @@
+/*
+   p0f - output plugins
+   --------------------
+
+   Observation records are staged on the capture thread, then copied into a
+   bounded queue for every loaded plugin. A single output thread drains the
+   queues and hands records to plugins in batches. If a plugin can't keep up,
+   its queue fills up and new records are dropped for that plugin only; when
+   reading offline captures, the capture thread waits for room instead.
+
+   Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>
+
+   Distributed under the terms and conditions of GNU LGPL.
+
+ */
+
+#define _FROM_PLUGIN
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stddef.h>
+#include <dlfcn.h>
+#include <pthread.h>
+
+#include "types.h"
+#include "config.h"
+#include "debug.h"
+#include "alloc-inl.h"
+#include "process.h"
+#include "p0f.h"
+#include "plugin.h"
+
+struct plugin_state {
+
+  void* dl;                             /* dlopen() handle                    */
+  struct p0f_plugin* ops;               /* Exported descriptor                */
+  void* ctx;                            /* Value returned by init()           */
+
+  struct p0f_record* ring;              /* PLUGIN_QUEUE records               */
+  u32 head,                             /* Oldest queued record               */
+      cnt,                              /* Queued records (incl. in flight)   */
+      peak;                             /* Highest cnt seen                   */
+
+  u64 delivered,                        /* Records handed to batch()          */
+      dropped,                          /* Records dropped, queue full        */
+      batches;                          /* Number of batch() calls            */
+
+};
+
+static struct plugin_state plugins[MAX_PLUGINS];
+
+u8 plugin_cnt;                          /* Number of loaded plugins           */
+
+static struct p0f_record stage;         /* Record being assembled             */
+static u32 stage_used;                  /* Bytes of stage.data in use         */
+
+static pthread_t out_thread;            /* Output thread                      */
+
+static pthread_mutex_t plug_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  plug_cond  = PTHREAD_COND_INITIALIZER,
+                       space_cond = PTHREAD_COND_INITIALIZER;
+
+static u8 out_stop,                     /* Output thread asked to exit?       */
+          out_running,                  /* Output thread started?             */
+          out_wait;                     /* Wait for room instead of dropping? */
+
+
+/* Load a plugin. Spec is path[:arg]. */
+
+void plugin_load(u8* spec) {
+
+  struct plugin_state* p;
+  u8* path = DFL_ck_strdup(spec);
+  u8* arg  = (u8*)strchr((char*)path, ':');
+
+  if (plugin_cnt == MAX_PLUGINS) FATAL("Too many plugins (limit: %u).",
+                                       MAX_PLUGINS);
+
+  if (arg) *(arg++) = 0;
+
+  p = plugins + plugin_cnt;
+
+  p->dl = dlopen((char*)path, RTLD_NOW | RTLD_LOCAL);
+
+  if (!p->dl) FATAL("Unable to load plugin '%s': %s", path, dlerror());
+
+  p->ops = dlsym(p->dl, "p0f_plugin");
+
+  if (!p->ops) FATAL("Plugin '%s' does not export 'p0f_plugin'.", path);
+
+  if (p->ops->abi != P0F_PLUGIN_ABI)
+    FATAL("Plugin '%s' built for ABI %u (need %u).", path, p->ops->abi,
+          P0F_PLUGIN_ABI);
+
+  if (!p->ops->name || !p->ops->init || !p->ops->batch)
+    FATAL("Plugin '%s' has an incomplete descriptor.", path);
+
+  p->ctx = p->ops->init((char*)arg);
+
+  if (!p->ctx) FATAL("Plugin '%s' failed to initialize.", p->ops->name);
+
+  p->ring = DFL_ck_alloc(PLUGIN_QUEUE * sizeof(struct p0f_record));
+
+  plugin_cnt++;
+
+  SAYF("[+] Loaded output plugin '%s' from '%s'.\n", p->ops->name, path);
+
+  DFL_ck_free(path);
+
+}
+
+
+/* Output thread. Batches are delivered without holding the lock; slots in
+   flight still count toward 'cnt', so the capture thread won't reuse them. */
+
+static void* output_main(void* arg) {
+
+  u32 i;
+
+  pthread_mutex_lock(&plug_mutex);
+
+  while (1) {
+
+    u8 work = 0;
+
+    for (i = 0; i < plugin_cnt; i++) {
+
+      struct plugin_state* p = plugins + i;
+      u32 head = p->head, n;
+
+      if (!p->cnt) continue;
+
+      /* Don't wrap around the end of the ring within one batch. */
+
+      n = MIN(p->cnt, PLUGIN_QUEUE - head);
+
+      pthread_mutex_unlock(&plug_mutex);
+      p->ops->batch(p->ctx, p->ring + head, n);
+      pthread_mutex_lock(&plug_mutex);
+
+      p->head = (head + n) % PLUGIN_QUEUE;
+      p->cnt -= n;
+      p->delivered += n;
+      p->batches++;
+
+      if (out_wait) pthread_cond_signal(&space_cond);
+
+      work = 1;
+
+    }
+
+    if (work) continue;
+    if (out_stop) break;
+
+    pthread_cond_wait(&plug_cond, &plug_mutex);
+
+  }
+
+  pthread_mutex_unlock(&plug_mutex);
+
+  for (i = 0; i < plugin_cnt; i++)
+    if (plugins[i].ops->fini) plugins[i].ops->fini(plugins[i].ctx);
+
+  return NULL;
+
+}
+
+
+/* Start the output thread. Must be called after fork_off(). With 'wait' set
+   (offline captures), full queues stall the capture thread instead of losing
+   records. */
+
+void plugin_start(u8 wait) {
+
+  if (!plugin_cnt) return;
+
+  out_wait = wait;
+
+  if (pthread_create(&out_thread, NULL, output_main, NULL))
+    FATAL("Unable to start plugin output thread.");
+
+  out_running = 1;
+
+}
+
+
+/* Start a new record. */
+
+void plugin_begin(char* module, u8 to_srv, struct packet_flow* f) {
+
+  stage.abi       = P0F_PLUGIN_ABI;
+  stage.size      = sizeof(struct p0f_record);
+  stage.time      = get_unix_time();
+  stage.module    = module;
+  stage.ip_ver    = f->client->ip_ver;
+  stage.subj      = to_srv ? P0F_SUBJ_CLI : P0F_SUBJ_SRV;
+  stage.flags     = 0;
+  stage.cli_port  = f->cli_port;
+  stage.srv_port  = f->srv_port;
+  stage.field_cnt = 0;
+
+  memcpy(stage.cli_addr, f->client->addr, 16);
+  memcpy(stage.srv_addr, f->server->addr, 16);
+
+  stage_used = 0;
+
+}
+
+
+/* Grab the next field slot, or NULL if we ran out. */
+
+static struct p0f_field* next_field(char* key) {
+
+  struct p0f_field* ret;
+
+  if (stage.field_cnt == P0F_REC_MAX_FIELDS) {
+    stage.flags |= P0F_REC_TRUNCATED;
+    return NULL;
+  }
+
+  ret = stage.fields + stage.field_cnt++;
+
+  ret->key  = key;
+  ret->str  = NULL;
+  ret->num  = 0;
+  ret->type = P0F_FIELD_NULL;
+
+  return ret;
+
+}
+
+
+/* Add string field; values that don't fit are truncated. */
+
+void plugin_add_str(char* key, u8* val) {
+
+  struct p0f_field* fl = next_field(key);
+  u32 len, room;
+
+  if (!fl || !val) return;
+
+  len  = strlen((char*)val);
+  room = P0F_REC_DATA - stage_used;
+
+  if (!room) {
+    stage.flags |= P0F_REC_TRUNCATED;
+    return;
+  }
+
+  if (len >= room) {
+    len = room - 1;
+    stage.flags |= P0F_REC_TRUNCATED;
+  }
+
+  memcpy(stage.data + stage_used, val, len);
+  stage.data[stage_used + len] = 0;
+
+  fl->str  = stage.data + stage_used;
+  fl->type = P0F_FIELD_STR;
+
+  stage_used += len + 1;
+
+}
+
+
+/* Add numeric field. */
+
+void plugin_add_num(char* key, s64 val) {
+
+  struct p0f_field* fl = next_field(key);
+
+  if (!fl) return;
+
+  fl->num  = val;
+  fl->type = P0F_FIELD_NUM;
+
+}
+
+
+/* Queue the staged record for every plugin. String pointers are rebased to
+   point into the destination slot. */
+
+void plugin_commit(void) {
+
+  u32 i, j, clen = offsetof(struct p0f_record, data) + stage_used;
+
+  pthread_mutex_lock(&plug_mutex);
+
+  for (i = 0; i < plugin_cnt; i++) {
+
+    struct plugin_state* p = plugins + i;
+    struct p0f_record* r;
+
+    while (out_wait && p->cnt == PLUGIN_QUEUE)
+      pthread_cond_wait(&space_cond, &plug_mutex);
+
+    if (p->cnt == PLUGIN_QUEUE) {
+      p->dropped++;
+      continue;
+    }
+
+    r = p->ring + (p->head + p->cnt) % PLUGIN_QUEUE;
+
+    memcpy(r, &stage, clen);
+
+    for (j = 0; j < r->field_cnt; j++)
+      if (r->fields[j].str)
+        r->fields[j].str = r->data + (stage.fields[j].str - stage.data);
+
+    p->cnt++;
+    if (p->cnt > p->peak) p->peak = p->cnt;
+
+  }
+
+  pthread_cond_signal(&plug_cond);
+  pthread_mutex_unlock(&plug_mutex);
+
+}
+
+
+/* Drain queues, stop the output thread, and say how things went. */
+
+void plugin_shutdown(void) {
+
+  u32 i;
+
+  if (!out_running) return;
+
+  pthread_mutex_lock(&plug_mutex);
+  out_stop = 1;
+  pthread_cond_signal(&plug_cond);
+  pthread_mutex_unlock(&plug_mutex);
+
+  pthread_join(out_thread, NULL);
+
+  if (daemon_mode) return;
+
+  for (i = 0; i < plugin_cnt; i++)
+    SAYF("[+] Plugin '%s': %llu records in %llu batches, %llu dropped, "
+         "peak queue %u.\n", plugins[i].ops->name, plugins[i].delivered,
+         plugins[i].batches, plugins[i].dropped, plugins[i].peak);
+
+}
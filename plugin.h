@@ -0,0 +1,115 @@
+/*
+   p0f - output plugin interface
+   -----------------------------
+
+   Output plugins are shared objects loaded with -P. Each one must export a
+   'struct p0f_plugin' named 'p0f_plugin'. Observation records are delivered
+   in batches from a dedicated output thread, never from the capture thread.
+
+   Records stay valid only for the duration of the batch() call.
+
+   Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>
+
+   Distributed under the terms and conditions of GNU LGPL.
+
+ */
+
+#ifndef _HAVE_PLUGIN_H
+#define _HAVE_PLUGIN_H
+
+#include "types.h"
+
+/* Bumped whenever the layout of anything below changes incompatibly. Fields
+   may be appended to p0f_record without a bump; check rec->size. */
+
+#define P0F_PLUGIN_ABI       1
+
+#define P0F_REC_MAX_FIELDS   16
+#define P0F_REC_DATA         2048
+
+#define P0F_FIELD_NULL       0x00       /* Value unknown                      */
+#define P0F_FIELD_STR        0x01       /* String in 'str'                    */
+#define P0F_FIELD_NUM        0x02       /* Integer in 'num'                   */
+
+#define P0F_SUBJ_CLI         0x01
+#define P0F_SUBJ_SRV         0x02
+
+#define P0F_REC_TRUNCATED    0x01       /* Some fields or values didn't fit   */
+
+struct p0f_field {
+
+  const char* key;                      /* Field name, e.g. "os"              */
+  const char* str;                      /* Value, if P0F_FIELD_STR            */
+  s64 num;                              /* Value, if P0F_FIELD_NUM            */
+  u8  type;                             /* P0F_FIELD_*                        */
+
+};
+
+struct p0f_record {
+
+  u32 abi;                              /* P0F_PLUGIN_ABI                     */
+  u32 size;                             /* sizeof(struct p0f_record)          */
+
+  u32 time;                             /* Unix time of the observation       */
+  const char* module;                   /* "syn", "http request", etc         */
+
+  u8  ip_ver;                           /* P0F_ADDR_IPV4 or P0F_ADDR_IPV6     */
+  u8  subj;                             /* P0F_SUBJ_*                         */
+  u8  flags;                            /* P0F_REC_*                          */
+
+  u8  cli_addr[16];                     /* Client address                     */
+  u8  srv_addr[16];                     /* Server address                     */
+  u16 cli_port;                         /* Client port                        */
+  u16 srv_port;                         /* Server port                        */
+
+  u32 field_cnt;                        /* Number of valid fields             */
+  struct p0f_field fields[P0F_REC_MAX_FIELDS];
+
+  char data[P0F_REC_DATA];              /* Storage for string values          */
+
+};
+
+struct p0f_plugin {
+
+  u32 abi;                              /* Must be P0F_PLUGIN_ABI             */
+  const char* name;                     /* Short name, for messages           */
+
+  /* Called once at startup, before privileges are dropped and before p0f
+     forks into background, so don't start threads here. 'arg' is the text
+     after ':' in -P, or NULL. Return NULL to abort startup. */
+
+  void* (*init)(const char* arg);
+
+  /* Called from the output thread with one or more records. */
+
+  void (*batch)(void* ctx, const struct p0f_record* recs, u32 cnt);
+
+  /* Called from the output thread on shutdown. May be NULL. */
+
+  void (*fini)(void* ctx);
+
+};
+
+#if defined(_FROM_P0F) || defined(_FROM_PLUGIN)
+
+#include "process.h"
+
+void plugin_load(u8* spec);
+
+void plugin_start(u8 wait);
+
+void plugin_begin(char* module, u8 to_srv, struct packet_flow* f);
+
+void plugin_add_str(char* key, u8* val);
+
+void plugin_add_num(char* key, s64 val);
+
+void plugin_commit(void);
+
+void plugin_shutdown(void);
+
+extern u8 plugin_cnt;
+
+#endif /* _FROM_P0F || _FROM_PLUGIN */
+
+#endif /* !_HAVE_PLUGIN_H */
@@ -36,17 +36,28 @@
 #include "fp_tcp.h"
 #include "fp_mtu.h"
 #include "fp_http.h"
+#include "flow_buf.h"
+#include "journal.h"
+#include "agg.h"
+#include "hll.h"
 
 u64 packet_cnt;                         /* Total number of packets processed  */
 
 static s8 link_off = -1;                /* Link-specific IP header offset     */
 static u8 bad_packets;                  /* Seen non-IP packets?               */
 
-static struct host_data *host_by_age,   /* All host entries, by last mod      */
-                        *newest_host;   /* Tail of the list                   */
+static struct host_data
+  *host_by_age[HOST_SEGS],              /* Host entries, by segment and age   */
+  *newest_host[HOST_SEGS];              /* Tails of the lists                 */
 
-static struct packet_flow *flow_by_age, /* All flows, by creation time        */
-                          *newest_flow; /* Tail of the list                   */
+static u32 prot_cnt;                    /* Hosts in HOST_PROTECTED            */
+
+static struct packet_flow               /* Flows by state, then by the time   */
+  *flow_by_age[FLOW_STATES],            /* they entered it                    */
+  *newest_flow[FLOW_STATES];            /* Tails of the lists                 */
+
+static struct ts_flow *ts_by_age,       /* Compact uptime-only records        */
+                      *newest_ts;       /* Tail of the list                   */
 
 static struct timeval* cur_time;        /* Current time, courtesy of pcap     */
 
@@ -54,8 +65,43 @@ static struct timeval* cur_time;        /* Current time, courtesy of pcap     */
 
 static struct host_data    *host_b[HOST_BUCKETS];
 static struct packet_flow  *flow_b[FLOW_BUCKETS];
+static struct ts_flow      *ts_b[FLOW_BUCKETS];
+static struct conn_verdict *conn_b[FLOW_BUCKETS];
+
+static struct conn_verdict *conn_by_age,/* Closed connection verdicts, by     */
+                           *newest_conn;/* close time                         */
+
+static u32 conn_closed;                 /* Closed records still around        */
+
+u32 host_cnt, flow_cnt, ts_flow_cnt,    /* Counters for bookkeeping purposes  */
+    conn_cnt;
+
+/* Packet-to-verdict latency tracking (live captures only): */
+
+u8  track_latency;                      /* Enabled?                           */
+
+u32 lat_process[P0F_LAT_BUCKETS],       /* Capture -> start of processing     */
+    lat_update[P0F_LAT_BUCKETS],        /* Capture -> host record updated     */
+    lat_visible[P0F_LAT_BUCKETS];       /* Capture -> visible to API queries  */
 
-static u32 host_cnt, flow_cnt;          /* Counters for bookkeeping purposes  */
+static u64 pending_cap[LAT_PENDING];    /* Capture times of unpublished data  */
+static u32 pending_cnt;                 /* Number of entries in pending_cap   */
+
+/* Slim capture export (-w): */
+
+u8  slim_export;                        /* Enabled?                           */
+u64 slim_cnt;                           /* Packets written                    */
+
+static u8  slim_keep;                   /* Current packet affected state?     */
+static u32 slim_used;                   /* Payload bytes it contributed       */
+
+/* Re-matching of cached hosts after signature deltas: */
+
+u8  rematch_active;                     /* Pass in progress?                  */
+u32 rematch_hosts,                      /* Hosts visited in current pass      */
+    rematch_changed;                    /* ...and verdicts changed            */
+
+static u32 rematch_bucket;              /* Next host_b[] bucket to visit      */
 
 static void flow_dispatch(struct packet_data* pk);
 static void nuke_flows(u8 silent);
@@ -77,6 +123,74 @@ u32 get_unix_time(void) {
 }
 
 
+/* Wall clock time in microseconds, comparable with pcap timestamps. */
+
+static u64 wall_us(void) {
+
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return ((u64)tv.tv_sec) * 1000000 + tv.tv_usec;
+
+}
+
+
+/* Add a sample to a log2 latency histogram. Clock steps may produce capture
+   times in the future; these go to bucket 0. */
+
+static void add_latency(u32* hist, u64 cap_us, u64 now_us) {
+
+  u64 diff = (now_us > cap_us) ? now_us - cap_us : 0;
+  u32 b = 0;
+
+  while (diff > 1 && b < P0F_LAT_BUCKETS - 1) {
+    diff >>= 1;
+    b++;
+  }
+
+  hist[b]++;
+
+}
+
+
+/* Called by fingerprinting code whenever a host record was just updated
+   with a verdict derived from the current packet. */
+
+void note_host_update(void) {
+
+  u64 cap_us;
+
+  if (!track_latency) return;
+
+  cap_us = ((u64)cur_time->tv_sec) * 1000000 + cur_time->tv_usec;
+
+  add_latency(lat_update, cap_us, wall_us());
+
+  if (pending_cnt < LAT_PENDING) pending_cap[pending_cnt++] = cap_us;
+
+}
+
+
+/* Called by the event loop after a pcap_dispatch() batch, right before API
+   queries get serviced again; host updates made so far are now visible. */
+
+void note_batch_done(void) {
+
+  u64 now_us;
+  u32 i;
+
+  if (!pending_cnt) return;
+
+  now_us = wall_us();
+
+  for (i = 0; i < pending_cnt; i++)
+    add_latency(lat_visible, pending_cap[i], now_us);
+
+  pending_cnt = 0;
+
+}
+
+
 /* Find link-specific offset (pcap knows, but won't tell). */
 
 static void find_offset(const u8* data, s32 total_len) {
@@ -213,8 +327,10 @@ void parse_packet(void* junk, const struct pcap_pkthdr* hdr, const u8* data) {
   struct tcp_hdr* tcp;
   struct packet_data pk;
 
+  const u8* raw = data;
+
   s32 packet_len;
-  u32 tcp_doff;
+  u32 tcp_doff, wire_len;
 
   u8* opt_end;
 
@@ -222,7 +338,15 @@ void parse_packet(void* junk, const struct pcap_pkthdr* hdr, const u8* data) {
 
   cur_time = (struct timeval*)&hdr->ts;
 
-  if (!(packet_cnt % EXPIRE_INTERVAL)) expire_cache();
+  if (track_latency)
+    add_latency(lat_process, ((u64)cur_time->tv_sec) * 1000000 +
+                cur_time->tv_usec, wall_us());
+
+  /* Runs at most once per second of capture time; checking on every packet
+     keeps expiry independent of unrelated traffic, so that slim captures
+     replay the same way as the originals. */
+
+  expire_cache();
 
   /* Be paranoid about how much data we actually have off the wire. */
 
@@ -290,14 +414,17 @@ void parse_packet(void* junk, const struct pcap_pkthdr* hdr, const u8* data) {
     }
 
     /* If the packet claims to be longer than the recv buffer, best to back
-       off - even though we could just ignore this and recover. */
+       off - even though we could just ignore this and recover. Captures cut
+       short on purpose (snaplen, -w) are fine, as long as headers fit. */
 
-    if (tot_len > packet_len) {
+    if (tot_len > packet_len && hdr->caplen >= hdr->len) {
       DEBUG("[#] ipv4.tot_len = %u but packet_len = %u, bailing out!\n",
             tot_len, packet_len);
       return;
     }
 
+    wire_len = tot_len;
+
     /* And finally, bail out if after skipping the IPv4 header as specified
        (including options), there wouldn't be enough room for TCP. */
 
@@ -356,6 +483,7 @@ void parse_packet(void* junk, const struct pcap_pkthdr* hdr, const u8* data) {
 
     tcp = (struct tcp_hdr*)(data + hdr_len);
     packet_len -= hdr_len;
+    wire_len   -= hdr_len;
     
   } else if ((*data >> 4) == IP_VER6) {
 
@@ -384,14 +512,17 @@ void parse_packet(void* junk, const struct pcap_pkthdr* hdr, const u8* data) {
     }
 
     /* If the packet claims to be longer than the data we have, best to back
-       off - even though we could just ignore this and recover. */
+       off - even though we could just ignore this and recover. Again, fine
+       if the capture was truncated on purpose. */
 
-    if (tot_len > packet_len) {
+    if (tot_len > packet_len && hdr->caplen >= hdr->len) {
       DEBUG("[#] ipv6.tot_len = %u but packet_len = %u, bailing out!\n",
             tot_len, packet_len);
       return;
     }
 
+    wire_len = tot_len;
+
     /* Bail out if the subsequent protocol is not TCP. One day, we may try
        to parse and skip IPv6 extensions, but there seems to be no point in
        it today. */
@@ -422,6 +553,7 @@ void parse_packet(void* junk, const struct pcap_pkthdr* hdr, const u8* data) {
 
     tcp = (struct tcp_hdr*)(ip6 + 1);
     packet_len -= sizeof(struct ipv6_hdr);
+    wire_len   -= sizeof(struct ipv6_hdr);
 
   } else {
 
@@ -522,17 +654,20 @@ void parse_packet(void* junk, const struct pcap_pkthdr* hdr, const u8* data) {
 
   if (tcp->flags & TCP_PUSH) pk.quirks |= QUIRK_PUSH;
 
-  /* Handle payload data. */
+  /* Handle payload data. Sequence tracking needs the on-the-wire length,
+     even if not all of it was captured. */
 
-  if (tcp_doff == packet_len) {
+  if (tcp_doff == wire_len) {
 
     pk.payload = NULL;
     pk.pay_len = 0;
+    pk.pay_cap = 0;
 
   } else {
 
     pk.payload = (u8*)data + tcp_doff;
-    pk.pay_len = packet_len - tcp_doff;
+    pk.pay_len = wire_len - tcp_doff;
+    pk.pay_cap = packet_len - tcp_doff;
 
   }
 
@@ -730,8 +865,18 @@ abort_options:
 
   }
 
+  slim_keep = 0;
+  slim_used = 0;
+
   flow_dispatch(&pk);
 
+  /* Keep just the headers and whatever payload went into flow buffers. */
+
+  if (slim_export && slim_keep) {
+    slim_write(hdr, raw, opt_end - raw + slim_used);
+    slim_cnt++;
+  }
+
 }
 
 
@@ -790,6 +935,229 @@ struct host_data* lookup_host(u8* addr, u8 ip_ver) {
 }
 
 
+/* History rings are carved out of larger slabs and recycled through a free
+   list; since every host has at most one, their number is bounded by -m. */
+
+static struct host_hist* hist_free;     /* Free rings, linked via first entry */
+
+
+/* Get a history ring. */
+
+static struct host_hist* alloc_hist(void) {
+
+  struct host_hist* ret;
+
+  if (!hist_free) {
+
+    struct host_hist* slab;
+    u32 i;
+
+    slab = DFL_ck_alloc(HIST_SLAB * HOST_HISTORY * sizeof(struct host_hist));
+
+    for (i = 0; i < HIST_SLAB; i++) {
+      struct host_hist* r = slab + i * HOST_HISTORY;
+      *(struct host_hist**)r = hist_free;
+      hist_free = r;
+    }
+
+  }
+
+  ret = hist_free;
+  hist_free = *(struct host_hist**)ret;
+
+  return ret;
+
+}
+
+
+/* Record a new connection in host history. */
+
+void add_host_history(struct host_data* h, s32 sig_id, s16 name_id, u8 dist,
+                      u16 port, u8 flags) {
+
+  struct host_hist* e;
+
+  if (!h->hist) h->hist = alloc_hist();
+
+  e = h->hist + h->hist_next;
+
+  e->time     = get_unix_time();
+  e->sig_id   = sig_id;
+  e->name_id  = name_id;
+  e->port     = port;
+  e->dist     = dist;
+  e->flags    = flags;
+
+  h->hist_next = (h->hist_next + 1) % HOST_HISTORY;
+  if (h->hist_cnt < HOST_HISTORY) h->hist_cnt++;
+
+}
+
+
+/* Service sets come from slabs and a free list, too. */
+
+static struct host_svc* svc_free;       /* Free sets, linked via first entry  */
+
+
+/* Get a service set. */
+
+static struct host_svc* alloc_svc(void) {
+
+  struct host_svc* ret;
+
+  if (!svc_free) {
+
+    struct host_svc* slab;
+    u32 i;
+
+    slab = DFL_ck_alloc(SVC_SLAB * HOST_SERVICES * sizeof(struct host_svc));
+
+    for (i = 0; i < SVC_SLAB; i++) {
+      struct host_svc* s = slab + i * HOST_SERVICES;
+      *(struct host_svc**)s = svc_free;
+      svc_free = s;
+    }
+
+  }
+
+  ret = svc_free;
+  svc_free = *(struct host_svc**)ret;
+
+  return ret;
+
+}
+
+
+/* Note that a host serves something on a port. Name and label IDs of -1
+   leave the app known for the port as is. */
+
+void add_host_service(struct host_data* h, u16 port, s32 name_id,
+                      s32 label_id, u8 flags) {
+
+  struct host_svc* e;
+  u32 i;
+
+  if (!h->svc) h->svc = alloc_svc();
+
+  for (i = 0; i < h->svc_cnt && h->svc[i].port < port; i++);
+
+  if (i == h->svc_cnt || h->svc[i].port != port) {
+
+    /* New port. If there's no room, forget the one seen least recently. */
+
+    if (h->svc_cnt == HOST_SERVICES) {
+
+      u32 j, old = 0;
+
+      for (j = 1; j < HOST_SERVICES; j++)
+        if (h->svc[j].last_seen < h->svc[old].last_seen) old = j;
+
+      memmove(h->svc + old, h->svc + old + 1,
+              (HOST_SERVICES - old - 1) * sizeof(struct host_svc));
+
+      h->svc_cnt--;
+      if (old < i) i--;
+
+    }
+
+    memmove(h->svc + i + 1, h->svc + i,
+            (h->svc_cnt - i) * sizeof(struct host_svc));
+
+    e = h->svc + i;
+
+    e->port       = port;
+    e->flags      = 0;
+    e->name_id    = -1;
+    e->label_id   = -1;
+    e->first_seen = get_unix_time();
+
+    h->svc_cnt++;
+
+  } else e = h->svc + i;
+
+  e->flags    |= flags;
+  e->last_seen = get_unix_time();
+
+  if (name_id != -1) {
+    e->name_id  = name_id;
+    e->label_id = label_id;
+  }
+
+}
+
+
+/* Remove host from its by-age linked list. */
+
+static void unlink_host(struct host_data* h) {
+
+  if (CP(h->newer)) h->newer->older = h->older;
+  else newest_host[h->seg] = h->older;
+
+  if (CP(h->older)) h->older->newer = h->newer;
+  else host_by_age[h->seg] = h->newer; 
+
+  h->older = h->newer = NULL;
+
+  if (h->seg == HOST_PROTECTED) prot_cnt--;
+
+}
+
+
+/* Append host to the newest end of a segment. */
+
+static void link_host(struct host_data* h, u8 seg) {
+
+  h->seg = seg;
+
+  if (CP(newest_host[seg])) {
+
+    newest_host[seg]->newer = h;
+    h->older = newest_host[seg];
+
+  } else host_by_age[seg] = h;
+
+  newest_host[seg] = h;
+
+  if (seg == HOST_PROTECTED) prot_cnt++;
+
+}
+
+
+/* Insert host into a segment by last_seen, so that expire_cache() can stop
+   at the first host that is still fresh. Hosts newer than everything else
+   are simply appended; otherwise, this walks the segment, so it's only meant
+   for one-off use when restoring state. */
+
+static void insert_host(struct host_data* h, u8 seg) {
+
+  struct host_data* n = host_by_age[seg];
+
+  if (!CP(newest_host[seg]) || newest_host[seg]->last_seen <= h->last_seen) {
+    link_host(h, seg);
+    return;
+  }
+
+  while (CP(n) && n->last_seen <= h->last_seen) n = n->newer;
+
+  if (!n) {
+    link_host(h, seg);
+    return;
+  }
+
+  h->seg   = seg;
+  h->newer = n;
+  h->older = n->older;
+
+  if (CP(n->older)) n->older->newer = h;
+  else host_by_age[seg] = h;
+
+  n->older = h;
+
+  if (seg == HOST_PROTECTED) prot_cnt++;
+
+}
+
+
 /* Destroy host data. */
 
 static void destroy_host(struct host_data* h) {
@@ -810,22 +1178,29 @@ static void destroy_host(struct host_data* h) {
   if (CP(h->prev)) h->prev->next = h->next;
   else host_b[bucket] = h->next;
 
-  /* Remove from the by-age linked list. */
-
-  if (CP(h->newer)) h->newer->older = h->older;
-  else newest_host = h->older;
+  unlink_host(h);
 
-  if (CP(h->older)) h->older->newer = h->newer;
-  else host_by_age = h->newer; 
+  agg_drop_host(h);
 
   /* Free memory. */
 
   ck_free(h->last_syn);
   ck_free(h->last_synack);
 
-  ck_free(h->http_resp);
+  http_free_sig(h->http_resp);
+  http_free_sig(h->http_req);
   ck_free(h->http_req_os);
 
+  if (h->hist) {
+    *(struct host_hist**)h->hist = hist_free;
+    hist_free = h->hist;
+  }
+
+  if (h->svc) {
+    *(struct host_svc**)h->svc = svc_free;
+    svc_free = h->svc;
+  }
+
   ck_free(h);
 
   host_cnt--;
@@ -833,21 +1208,29 @@ static void destroy_host(struct host_data* h) {
 }
 
 
-/* Indiscriminately kill some of the older hosts. */
+/* Kill some of the older hosts. Demoted hosts go first, then hosts on
+   probation; if they can't make up the quota (say, most are pinned by
+   flows), protected ones follow. */
 
 static void nuke_hosts(void) {
 
   u32 kcnt = 1 + (host_cnt * KILL_PERCENT / 100);
-  struct host_data* target = host_by_age;
+  u8  seg;
 
   WARN("Too many host entries, deleting %u. Use -m to adjust.", kcnt);
 
   nuke_flows(1);
 
-  while (kcnt && CP(target)) {
-    struct host_data* next = target->older;
-    if (!target->use_cnt) { kcnt--; destroy_host(target); }
-    target = next;
+  for (seg = 0; seg < HOST_SEGS && kcnt; seg++) {
+
+    struct host_data* target = host_by_age[seg];
+
+    while (kcnt && CP(target)) {
+      struct host_data* next = target->newer;
+      if (!target->use_cnt) { kcnt--; destroy_host(target); }
+      target = next;
+    }
+
   }
 
 }
@@ -877,16 +1260,9 @@ static struct host_data* create_host(u8* addr, u8 ip_ver) {
 
   host_b[bucket] = nh;
 
-  /* Insert into the by-age linked list. */
- 
-  if (CP(newest_host)) {
-
-    newest_host->newer = nh;
-    nh->older = newest_host;
-
-  } else host_by_age = nh;
+  /* Insert into the by-age linked list; new hosts start on probation. */
 
-  newest_host = nh;
+  link_host(nh, HOST_PROBATION);
 
   /* Populate other data. */
 
@@ -898,9 +1274,15 @@ static struct host_data* create_host(u8* addr, u8 ip_ver) {
   nh->last_up_min     = -1;
   nh->last_class_id   = -1;
   nh->last_name_id    = -1;
+  nh->last_label_id   = -1;
   nh->http_name_id    = -1;
+  nh->http_label_id   = -1;
+  nh->link_id         = -1;
+  nh->lang_id         = -1;
   nh->distance        = -1;
 
+  agg_new_host(nh);
+
   host_cnt++;
 
   return nh;
@@ -908,7 +1290,36 @@ static struct host_data* create_host(u8* addr, u8 ip_ver) {
 }
 
 
-/* Touch host data to make it more recent. */
+/* Create host data for a record loaded from disk (see journal.c), as if
+   last seen at 'seen', and put it where it belongs by age. Returns NULL if
+   the host is already known. */
+
+struct host_data* restore_host(u8* addr, u8 ip_ver, u32 seen) {
+
+  struct timeval tv, *saved = cur_time;
+  struct host_data* h;
+
+  if (lookup_host(addr, ip_ver)) return NULL;
+
+  tv.tv_sec  = seen;
+  tv.tv_usec = 0;
+
+  cur_time = &tv;
+  h = create_host(addr, ip_ver);
+  cur_time = saved;
+
+  unlink_host(h);
+  insert_host(h, HOST_PROBATION);
+
+  return h;
+
+}
+
+
+/* Touch host data to make it more recent. Hosts on probation get promoted;
+   if the protected segment is over its limit, its least recently seen host
+   is demoted. Hosts leave the protected segment in last_seen order, so the
+   demoted segment stays sorted with a plain append. */
 
 static void touch_host(struct host_data* h) {
 
@@ -916,26 +1327,19 @@ static void touch_host(struct host_data* h) {
 
   DEBUG("[#] Refreshing host data: %s\n", addr_to_str(h->addr, h->ip_ver));
 
-  if (h != CP(newest_host)) {
+  if (h != CP(newest_host[HOST_PROTECTED])) {
 
-    /* Remove from the the by-age linked list. */
+    unlink_host(h);
+    link_host(h, HOST_PROTECTED);
 
-    CP(h->newer);
-    h->newer->older = h->older;
+    if (prot_cnt > (u64)max_hosts * PROTECT_PERCENT / 100) {
 
-    if (CP(h->older)) h->older->newer = h->newer;
-    else host_by_age = h->newer; 
+      struct host_data* d = host_by_age[HOST_PROTECTED];
 
-    /* Re-insert in front. */
+      unlink_host(d);
+      link_host(d, HOST_DEMOTED);
 
-    newest_host->newer = h;
-    h->older = newest_host;
-    h->newer = NULL;
-
-    newest_host = h;
-
-    /* This wasn't the only entry on the list, so there is no
-       need to update the tail (host_by_age). */
+    }
 
   }
 
@@ -947,6 +1351,211 @@ static void touch_host(struct host_data* h) {
 
 
 
+/* Remove flow from its by-age linked list. */
+
+static void unlink_flow(struct packet_flow* f) {
+
+  if (CP(f->newer)) f->newer->older = f->older;
+  else { CP(newest_flow[f->state]); newest_flow[f->state] = f->older; }
+
+  if (CP(f->older)) f->older->newer = f->newer;
+  else flow_by_age[f->state] = f->newer; 
+
+  f->older = f->newer = NULL;
+
+}
+
+
+/* Append flow to the list for a given state. */
+
+static void link_flow(struct packet_flow* f, u8 state) {
+
+  f->state      = state;
+  f->state_time = get_unix_time();
+
+  if (CP(newest_flow[state])) {
+    newest_flow[state]->newer = f;
+    f->older = newest_flow[state];
+  } else flow_by_age[state] = f;
+
+  newest_flow[state] = f;
+
+}
+
+
+/* Move flow to another state, restarting its timeout. */
+
+static void set_flow_state(struct packet_flow* f, u8 state) {
+
+  if (f->state == state) return;
+
+  DEBUG("[#] Flow state %u -> %u.\n", f->state, state);
+
+  unlink_flow(f);
+  link_flow(f, state);
+
+}
+
+
+/* Timeout for flows in a given state, in seconds. Unanswered SYNs are cheap
+   to lose; established flows with no payload are only good for uptime
+   measurements; the full connection timeout (-t c) is reserved for flows
+   with application data coming in. */
+
+static u32 flow_timeout(u8 state) {
+
+  switch (state) {
+
+    case FLOW_SYN:   return MIN(SYN_MAX_AGE, conn_max_age);
+    case FLOW_ESTAB: return uptime_max_age;
+    default:         return conn_max_age;
+
+  }
+
+}
+
+
+/* Calculate hash bucket for conn_verdict. */
+
+static u32 get_conn_bucket(u8 ip_ver, u8* cli_addr, u16 cli_port,
+                           u8* srv_addr, u16 srv_port) {
+
+  u32 alen = (ip_ver == IP_VER4) ? 4 : 16;
+  u32 bucket;
+
+  bucket  = hash32(cli_addr, alen, hash_seed);
+  bucket ^= hash32(srv_addr, alen, ~hash_seed);
+  bucket ^= hash32(&cli_port, 2, hash_seed);
+  bucket ^= hash32(&srv_port, 2, ~hash_seed);
+
+  return bucket % FLOW_BUCKETS;
+
+}
+
+
+/* Look up verdicts for a connection, client side first. */
+
+struct conn_verdict* lookup_conn(u8 ip_ver, u8* cli_addr, u16 cli_port,
+                                 u8* srv_addr, u16 srv_port) {
+
+  u32 alen = (ip_ver == IP_VER4) ? 4 : 16;
+  struct conn_verdict* cv;
+
+  if (!conn_cnt) return NULL;
+
+  cv = conn_b[get_conn_bucket(ip_ver, cli_addr, cli_port, srv_addr, srv_port)];
+
+  while (CP(cv)) {
+
+    if (cv->ip_ver == ip_ver && cv->cli_port == cli_port &&
+        cv->srv_port == srv_port && !memcmp(cv->cli_addr, cli_addr, alen) &&
+        !memcmp(cv->srv_addr, srv_addr, alen)) return cv;
+
+    cv = cv->next;
+
+  }
+
+  return NULL;
+
+}
+
+
+/* Destroy connection verdicts. */
+
+static void destroy_conn(struct conn_verdict* cv) {
+
+  CP(cv);
+
+  if (CP(cv->next)) cv->next->prev = cv->prev;
+
+  if (CP(cv->prev)) cv->prev->next = cv->next;
+  else { CP(conn_b[cv->bucket]); conn_b[cv->bucket] = cv->next; }
+
+  if (cv->closed) {
+
+    if (CP(cv->newer)) cv->newer->older = cv->older;
+    else newest_conn = cv->older;
+
+    if (CP(cv->older)) cv->older->newer = cv->newer;
+    else conn_by_age = cv->newer;
+
+    conn_closed--;
+
+  }
+
+  ck_free(cv);
+
+  conn_cnt--;
+
+}
+
+
+/* Start keeping verdicts for a new connection. Any leftovers from an earlier
+   connection with the same tuple go away. */
+
+static struct conn_verdict* create_conn(struct packet_flow* f) {
+
+  struct host_data* cli = f->client;
+  struct host_data* srv = f->server;
+  struct conn_verdict* cv;
+
+  cv = lookup_conn(cli->ip_ver, cli->addr, f->cli_port, srv->addr, f->srv_port);
+  if (cv) destroy_conn(cv);
+
+  cv = ck_alloc(sizeof(struct conn_verdict));
+
+  cv->ip_ver   = cli->ip_ver;
+  cv->cli_port = f->cli_port;
+  cv->srv_port = f->srv_port;
+  cv->created  = get_unix_time();
+
+  memcpy(cv->cli_addr, cli->addr, 16);
+  memcpy(cv->srv_addr, srv->addr, 16);
+
+  cv->os_name_id   = cv->os_label_id   = -1;
+  cv->http_name_id = cv->http_label_id = -1;
+  cv->link_id      = cv->lang_id       = -1;
+  cv->distance     = -1;
+
+  cv->bucket = get_conn_bucket(cv->ip_ver, cv->cli_addr, cv->cli_port,
+                               cv->srv_addr, cv->srv_port);
+
+  if (CP(conn_b[cv->bucket])) {
+    conn_b[cv->bucket]->prev = cv;
+    cv->next = conn_b[cv->bucket];
+  }
+
+  conn_b[cv->bucket] = cv;
+
+  conn_cnt++;
+  return cv;
+
+}
+
+
+/* The flow is going away; keep its verdicts for CONN_LINGER seconds more,
+   or until there are too many closed records around. */
+
+static void close_conn(struct conn_verdict* cv) {
+
+  CP(cv);
+
+  if (conn_closed >= max_conn) destroy_conn(conn_by_age);
+
+  cv->closed = get_unix_time();
+
+  if (CP(newest_conn)) {
+    newest_conn->newer = cv;
+    cv->older = newest_conn;
+  } else conn_by_age = cv;
+
+  newest_conn = cv;
+
+  conn_closed++;
+
+}
+
+
 /* Destroy a flow. */
 
 static void destroy_flow(struct packet_flow* f) {
@@ -969,23 +1578,19 @@ static void destroy_flow(struct packet_flow* f) {
   if (CP(f->prev)) f->prev->next = f->next;
   else { CP(flow_b[f->bucket]); flow_b[f->bucket] = f->next; }
 
-  /* Remove from the by-age linked list. */
-
-  if (CP(f->newer)) f->newer->older = f->older;
-  else { CP(newest_flow); newest_flow = f->older; }
-
-  if (CP(f->older)) f->older->newer = f->newer;
-  else flow_by_age = f->newer; 
+  unlink_flow(f);
 
   /* Free memory, etc. */
 
   f->client->use_cnt--;
   f->server->use_cnt--;
 
+  close_conn(f->cv);
+
   free_sig_hdrs(&f->http_tmp);
 
-  ck_free(f->request);
-  ck_free(f->response);
+  flow_buf_free(&f->request);
+  flow_buf_free(&f->response);
   ck_free(f);
 
   flow_cnt--;  
@@ -993,11 +1598,12 @@ static void destroy_flow(struct packet_flow* f) {
 }
 
 
-/* Indiscriminately kill some of the oldest flows. */
+/* Kill some of the oldest flows, least promising states first. */
 
 static void nuke_flows(u8 silent) {
 
   u32 kcnt = 1 + (flow_cnt * KILL_PERCENT / 100);
+  u8  state;
 
   if (silent)
     DEBUG("[#] Pruning connections - trying to delete %u...\n",kcnt);
@@ -1005,7 +1611,11 @@ static void nuke_flows(u8 silent) {
     WARN("Too many tracked connections, deleting %u. "
          "Use -m to adjust.", kcnt);
 
-  while (kcnt-- && flow_by_age) destroy_flow(flow_by_age);
+  for (state = 0; state < FLOW_STATES; state++)
+    while (kcnt && flow_by_age[state]) {
+      destroy_flow(flow_by_age[state]);
+      kcnt--;
+    }
 
 }
 
@@ -1055,12 +1665,7 @@ static struct packet_flow* create_flow_from_syn(struct packet_data* pk) {
 
   /* Insert into the by-age linked list */
  
-  if (CP(newest_flow)) {
-    newest_flow->newer = nf;
-    nf->older = newest_flow;
-  } else flow_by_age = nf;
-
-  newest_flow = nf;
+  link_flow(nf, FLOW_SYN);
 
   /* Populate other data */
 
@@ -1071,12 +1676,49 @@ static struct packet_flow* create_flow_from_syn(struct packet_data* pk) {
 
   nf->next_cli_seq = pk->seq + 1;
 
+  nf->cv = create_conn(nf);
+
   flow_cnt++;
   return nf;
 
 }
 
 
+/* Check if packet belongs to a connection between two endpoints. Sets
+   *to_srv if so. */
+
+static u8 match_tuple(struct packet_data* pk, struct host_data* cli,
+                      u16 cli_port, struct host_data* srv, u16 srv_port,
+                      u8* to_srv) {
+
+  u32 alen = (pk->ip_ver == IP_VER4) ? 4 : 16;
+
+  CP(cli);
+  CP(srv);
+
+  if (pk->ip_ver != cli->ip_ver) return 0;
+
+  if (pk->sport == cli_port && pk->dport == srv_port &&
+      !memcmp(pk->src, cli->addr, alen) && !memcmp(pk->dst, srv->addr, alen)) {
+
+    *to_srv = 1;
+    return 1;
+
+  }
+
+  if (pk->dport == cli_port && pk->sport == srv_port &&
+      !memcmp(pk->dst, cli->addr, alen) && !memcmp(pk->src, srv->addr, alen)) {
+
+    *to_srv = 0;
+    return 1;
+
+  }
+
+  return 0;
+
+}
+
+
 /* Look up an existing flow. */
 
 static struct packet_flow* lookup_flow(struct packet_data* pk, u8* to_srv) {
@@ -1086,32 +1728,126 @@ static struct packet_flow* lookup_flow(struct packet_data* pk, u8* to_srv) {
 
   while (CP(f)) {
 
-    CP(f->client);
-    CP(f->server);
+    if (match_tuple(pk, f->client, f->cli_port, f->server, f->srv_port,
+                    to_srv)) return f;
 
-    if (pk->ip_ver != f->client->ip_ver) goto lookup_next;
+    f = f->next;
 
-    if (pk->sport == f->cli_port && pk->dport == f->srv_port &&
-        !memcmp(pk->src, f->client->addr, (pk->ip_ver == IP_VER4) ? 4 : 16) &&
-        !memcmp(pk->dst, f->server->addr, (pk->ip_ver == IP_VER4) ? 4 : 16)) {
+  }
 
-      *to_srv = 1;
-      return f;
+  return NULL;
 
-    }
+}
 
-    if (pk->dport == f->cli_port && pk->sport == f->srv_port &&
-        !memcmp(pk->dst, f->client->addr, (pk->ip_ver == IP_VER4) ? 4 : 16) &&
-        !memcmp(pk->src, f->server->addr, (pk->ip_ver == IP_VER4) ? 4 : 16)) {
 
-      *to_srv = 0;
-      return f;
+/* Destroy a compact record. */
 
-    }
+static void destroy_ts_flow(struct ts_flow* tf) {
 
-lookup_next:
+  CP(tf);
 
-    f = f->next;
+  if (CP(tf->next)) tf->next->prev = tf->prev;
+
+  if (CP(tf->prev)) tf->prev->next = tf->next;
+  else { CP(ts_b[tf->bucket]); ts_b[tf->bucket] = tf->next; }
+
+  if (CP(tf->newer)) tf->newer->older = tf->older;
+  else newest_ts = tf->older;
+
+  if (CP(tf->older)) tf->older->newer = tf->newer;
+  else ts_by_age = tf->newer;
+
+  tf->client->use_cnt--;
+  tf->server->use_cnt--;
+
+  ck_free(tf);
+
+  ts_flow_cnt--;
+
+}
+
+
+/* Retire a flow that no module needs payload for anymore. If an uptime
+   reading is still possible, keep just enough state for that, locking in
+   the current SYN and SYN+ACK timestamps. */
+
+static void compact_flow(struct packet_flow* f) {
+
+  struct tcp_sig* syn    = f->client->last_syn;
+  struct tcp_sig* synack = f->server->last_synack;
+  struct ts_flow* tf;
+
+  u8 want_cli = !f->cli_tps && syn && syn->ts1;
+  u8 want_srv = !f->srv_tps && synack && synack->ts1;
+
+  if (f->sendsyn || (!want_cli && !want_srv)) {
+    destroy_flow(f);
+    return;
+  }
+
+  if (ts_flow_cnt >= max_conn) destroy_ts_flow(ts_by_age);
+
+  tf = ck_alloc(sizeof(struct ts_flow));
+
+  tf->client   = f->client;
+  tf->server   = f->server;
+  tf->cli_port = f->cli_port;
+  tf->srv_port = f->srv_port;
+  tf->bucket   = f->bucket;
+  tf->created  = get_unix_time();
+
+  if (want_cli) {
+    tf->cli_ts1     = syn->ts1;
+    tf->cli_recv_ms = syn->recv_ms;
+  }
+
+  if (want_srv) {
+    tf->srv_ts1     = synack->ts1;
+    tf->srv_recv_ms = synack->recv_ms;
+  }
+
+  tf->client->use_cnt++;
+  tf->server->use_cnt++;
+
+  if (CP(ts_b[tf->bucket])) {
+    ts_b[tf->bucket]->prev = tf;
+    tf->next = ts_b[tf->bucket];
+  }
+
+  ts_b[tf->bucket] = tf;
+
+  if (CP(newest_ts)) {
+    newest_ts->newer = tf;
+    tf->older = newest_ts;
+  } else ts_by_age = tf;
+
+  newest_ts = tf;
+
+  ts_flow_cnt++;
+
+  DEBUG("[#] Flow compacted for uptime tracking (%u records).\n", ts_flow_cnt);
+
+  destroy_flow(f);
+
+}
+
+
+/* Look up a compact record. */
+
+static struct ts_flow* lookup_ts_flow(struct packet_data* pk, u8* to_srv) {
+
+  struct ts_flow* tf;
+
+  if (!ts_flow_cnt) return NULL;
+
+  tf = ts_b[get_flow_bucket(pk)];
+
+  while (CP(tf)) {
+
+    if (match_tuple(pk, tf->client, tf->cli_port, tf->server, tf->srv_port,
+                    to_srv)) return tf;
+
+    tf = tf->next;
 
   }
 
@@ -1120,11 +1856,34 @@ lookup_next:
 }
 
 
+/* Feed a packet with no full flow to its compact record, if any. Drop the
+   record once both sides are done, or when the connection closes. */
+
+static void ts_flow_dispatch(struct packet_data* pk) {
+
+  struct ts_flow* tf;
+  u8 to_srv = 0;
+
+  tf = lookup_ts_flow(pk, &to_srv);
+  if (!tf) return;
+
+  slim_keep = 1;
+
+  check_ts_compact(to_srv, pk, tf);
+
+  if ((pk->tcp_type & (TCP_FIN | TCP_RST)) ||
+      ((tf->cli_tps || !tf->cli_ts1) && (tf->srv_tps || !tf->srv_ts1)))
+    destroy_ts_flow(tf);
+
+}
+
+
 /* Go through host and flow cache, expire outdated items. */
 
 static void expire_cache(void) {
   struct host_data* target;
   static u32 pt;
+  u8 seg, state;
 
   u32 ct = get_unix_time();
 
@@ -1133,17 +1892,52 @@ static void expire_cache(void) {
 
   DEBUG("[#] Cache expiration kicks in...\n");
 
-  while (CP(flow_by_age) && ct - flow_by_age->created > conn_max_age)
-    destroy_flow(flow_by_age);
+  for (state = 0; state < FLOW_STATES; state++) {
+
+    u32 limit = flow_timeout(state);
+
+    while (CP(flow_by_age[state]) &&
+           ct - flow_by_age[state]->state_time > limit)
+      destroy_flow(flow_by_age[state]);
+
+  }
+
+  while (CP(ts_by_age) && ct - ts_by_age->created > uptime_max_age)
+    destroy_ts_flow(ts_by_age);
+
+  while (CP(conn_by_age) && ct - conn_by_age->closed > CONN_LINGER)
+    destroy_conn(conn_by_age);
+
+  for (seg = 0; seg < HOST_SEGS; seg++) {
+
+    target = host_by_age[seg];
+
+    while (CP(target) && ct - target->last_seen > host_idle_limit * 60) {
+      struct host_data* newer = target->newer;
+      if (!target->use_cnt) destroy_host(target);
+      target = newer;
+    }
+
+  }
+
+}
+
 
-  target = host_by_age;
+/* Append payload to a flow buffer. If the packet was not captured in full,
+   anything that follows would leave a gap, so the buffer is closed. Returns
+   the number of bytes stored. */
 
-  while (CP(target) && ct - target->last_seen > host_idle_limit * 60) {
-    struct host_data* newer = target->newer;
-    if (!target->use_cnt) destroy_host(target);
-    target = newer;
+static u32 append_payload(struct flow_buf* b, struct packet_data* pk,
+                          u32 amt) {
+
+  if (pk->pay_cap < amt) {
+    amt = flow_buf_append(b, pk->payload, pk->pay_cap);
+    b->capped = 1;
+    return amt;
   }
 
+  return flow_buf_append(b, pk->payload, amt);
+
 }
 
 
@@ -1165,6 +1959,22 @@ static void flow_dispatch(struct packet_data* pk) {
     
   f = lookup_flow(pk, &to_srv);
 
+  /* No full flow? The connection may still have a compact record. A new
+     SYN simply drops it, as it starts a new connection. */
+
+  if (!f && ts_flow_cnt) {
+
+    struct ts_flow* tf;
+
+    if (pk->tcp_type == TCP_SYN) {
+      if ((tf = lookup_ts_flow(pk, &to_srv))) destroy_ts_flow(tf);
+    } else if (pk->tcp_type != (TCP_SYN | TCP_ACK)) {
+      ts_flow_dispatch(pk);
+      return;
+    }
+
+  }
+
   switch (pk->tcp_type) {
 
     case TCP_SYN:
@@ -1179,6 +1989,8 @@ static void flow_dispatch(struct packet_data* pk) {
 
       }
 
+      slim_keep = 1;
+
       f = create_flow_from_syn(pk);
 
       tsig = fingerprint_tcp(1, pk, f);
@@ -1222,6 +2034,7 @@ static void flow_dispatch(struct packet_data* pk) {
 
       if (f->sendsyn) {
 
+        slim_keep = 1;
         fingerprint_tcp(0, pk, f);
         destroy_flow(f);
         return;
@@ -1247,6 +2060,10 @@ static void flow_dispatch(struct packet_data* pk) {
       }
 
       f->acked = 1;
+      slim_keep = 1;
+
+      hll_server_add(pk->ip_ver, f->server->addr, f->srv_port, f->client->addr);
+      add_host_service(f->server, f->srv_port, -1, -1, P0F_SVC_SYNACK);
 
       tsig = fingerprint_tcp(0, pk, f);
 
@@ -1267,6 +2084,8 @@ static void flow_dispatch(struct packet_data* pk) {
 
       f->next_srv_seq = pk->seq + 1;
 
+      set_flow_state(f, FLOW_ESTAB);
+
       break;
 
     case TCP_RST | TCP_ACK:
@@ -1276,6 +2095,7 @@ static void flow_dispatch(struct packet_data* pk) {
 
        if (f) {
 
+         slim_keep = 1;
          check_ts_tcp(to_srv, pk, f);
          destroy_flow(f);
 
@@ -1287,6 +2107,8 @@ static void flow_dispatch(struct packet_data* pk) {
 
       if (!f) return;
 
+      slim_keep = 1;
+
       /* Stop there, you criminal scum! */
 
       if (f->sendsyn) {
@@ -1314,18 +2136,17 @@ static void flow_dispatch(struct packet_data* pk) {
           if (f->next_cli_seq - pk->pay_len != pk->seq)
             DEBUG("[#] Expected client seq 0x%08x, got 0x%08x.\n", f->next_cli_seq, pk->seq);
  
+          slim_keep = 0;
           return;
         }
 
         /* Append data */
 
-        if (f->req_len < MAX_FLOW_DATA && pk->pay_len) {
+        if (flow_buf_room(&f->request) && pk->pay_len) {
 
-          u32 read_amt = MIN(pk->pay_len, MAX_FLOW_DATA - f->req_len);
+          u32 read_amt = MIN(pk->pay_len, MAX_FLOW_DATA - f->request.len);
 
-          f->request = ck_realloc_kb(f->request, f->req_len + read_amt + 1);
-          memcpy(f->request + f->req_len, pk->payload, read_amt);
-          f->req_len += read_amt;
+          slim_used = append_payload(&f->request, pk, read_amt);
 
         }
 
@@ -1343,19 +2164,18 @@ static void flow_dispatch(struct packet_data* pk) {
             DEBUG("[#] Expected server seq 0x%08x, got 0x%08x.\n",
                   f->next_cli_seq, pk->seq);
  
+          slim_keep = 0;
           return;
 
         }
 
         /* Append data */
 
-        if (f->resp_len < MAX_FLOW_DATA && pk->pay_len) {
+        if (flow_buf_room(&f->response) && pk->pay_len) {
 
-          u32 read_amt = MIN(pk->pay_len, MAX_FLOW_DATA - f->resp_len);
+          u32 read_amt = MIN(pk->pay_len, MAX_FLOW_DATA - f->response.len);
 
-          f->response = ck_realloc_kb(f->response, f->resp_len + read_amt + 1);
-          memcpy(f->response + f->resp_len, pk->payload, read_amt);
-          f->resp_len += read_amt;
+          slim_used = append_payload(&f->response, pk, read_amt);
 
         }
 
@@ -1372,14 +2192,15 @@ static void flow_dispatch(struct packet_data* pk) {
       if (!need_more) {
 
         DEBUG("[#] All modules done, no need to keep tracking flow.\n");
-        destroy_flow(f);
+        compact_flow(f);
 
-      } else if (f->req_len >= MAX_FLOW_DATA && f->resp_len >= MAX_FLOW_DATA) {
+      } else if (!flow_buf_room(&f->request) &&
+                 !flow_buf_room(&f->response)) {
 
         DEBUG("[#] Per-flow capture size limit exceeded.\n");
-        destroy_flow(f);
+        compact_flow(f);
 
-      }
+      } else set_flow_state(f, FLOW_HTTP);
 
       break;
 
@@ -1435,6 +2256,7 @@ void add_nat_score(u8 to_srv, struct packet_flow* f, u16 reason, u8 score) {
     reason = hd->nat_reasons;
 
     hd->last_nat = get_unix_time();
+    hd->last_nat_reasons = reason;
 
     memset(scores, 0, NAT_SCORES);
     hd->nat_reasons = 0;
@@ -1475,8 +2297,12 @@ void add_nat_score(u8 to_srv, struct packet_flow* f, u16 reason, u8 score) {
 
   add_observation_field("reason", rea[0] ? (rea + 1) : NULL);
 
+  add_observation_num("score", score);
+
   OBSERVF("raw_hits", "%u,%u,%u,%u", over_5, over_2, over_1, over_0);
 
+  journal_host(hd);
+
 }
 
 
@@ -1526,11 +2352,169 @@ void verify_tool_class(u8 to_srv, struct packet_flow* f, u32* sys, u32 sys_cnt)
 }
 
 
+/* Start re-matching all cached hosts against the signature database; called
+   after deltas are applied. Restarts the pass if one is in progress. */
+
+void rematch_start(void) {
+
+  rematch_bucket  = 0;
+  rematch_hosts   = 0;
+  rematch_changed = 0;
+  rematch_active  = 1;
+
+}
+
+
+/* Redo the verdicts of a single host from its stored signatures, replaying
+   them in the order they were seen. Verdicts restored by journal_open()
+   with no signatures to back them are left alone. */
+
+static void rematch_host(struct host_data* h) {
+
+  s32 old_os = h->last_label_id, old_app = h->http_label_id;
+  u8  old_q  = h->last_quality, old_bad = h->bad_sw;
+
+  u64 when[4];
+  u8  what[4], cnt = 0, i, j;
+
+  if (h->last_syn) {
+    when[cnt] = h->last_syn->recv_ms;
+    what[cnt++] = 0;
+  }
+
+  if (h->last_synack) {
+    when[cnt] = h->last_synack->recv_ms;
+    what[cnt++] = 1;
+  }
+
+  /* HTTP dates have one-second granularity; sort them after TCP data seen
+     in the same second. */
+
+  if (h->http_req) {
+    when[cnt] = h->http_req->recv_date * 1000ULL + 999;
+    what[cnt++] = 2;
+  }
+
+  if (h->http_resp) {
+    when[cnt] = h->http_resp->recv_date * 1000ULL + 999;
+    what[cnt++] = 3;
+  }
+
+  if (!cnt) return;
+
+  for (i = 1; i < cnt; i++)
+
+    for (j = i; j && when[j - 1] > when[j]; j--) {
+
+      u64 tw = when[j];
+      u8  tk = what[j];
+
+      when[j] = when[j - 1];
+      what[j] = what[j - 1];
+
+      when[j - 1] = tw;
+      what[j - 1] = tk;
+
+    }
+
+  h->last_class_id = -1;
+  h->last_name_id  = -1;
+  h->last_flavor   = NULL;
+  h->last_label_id = -1;
+  h->last_quality  = 0;
+
+  if (h->http_req || h->http_resp) {
+    h->http_name_id  = -1;
+    h->http_flavor   = NULL;
+    h->http_label_id = -1;
+    h->http_quality  = 0;
+    h->bad_sw        = 0;
+  }
+
+  for (i = 0; i < cnt; i++) switch (what[i]) {
+    case 0: tcp_rematch(1, h); break;
+    case 1: tcp_rematch(0, h); break;
+    case 2: http_rematch(1, h); break;
+    case 3: http_rematch(0, h); break;
+  }
+
+  rematch_hosts++;
+
+  agg_update_host(h);
+
+  if (h->last_label_id != old_os || h->http_label_id != old_app ||
+      h->last_quality != old_q || h->bad_sw != old_bad) {
+    rematch_changed++;
+    journal_host(h);
+  }
+
+}
+
+
+/* Re-match the next slice of the host table. Returns 1 if there's more. */
+
+u8 rematch_step(void) {
+
+  u32 done = 0;
+
+  if (!rematch_active) return 0;
+
+  while (rematch_bucket < HOST_BUCKETS && done < REMATCH_SLICE) {
+
+    struct host_data* h = host_b[rematch_bucket++];
+
+    while (CP(h)) {
+      rematch_host(h);
+      h = h->next;
+      done++;
+    }
+
+  }
+
+  if (rematch_bucket < HOST_BUCKETS) return 1;
+
+  rematch_active = 0;
+
+  DEBUG("[#] Re-match done: %u hosts, %u changed.\n", rematch_hosts,
+        rematch_changed);
+
+  return 0;
+
+}
+
+
+/* Number of hosts the current re-match pass has yet to visit. */
+
+u32 rematch_left(void) {
+
+  u32 b, ret = 0;
+
+  if (!rematch_active) return 0;
+
+  for (b = rematch_bucket; b < HOST_BUCKETS; b++) {
+    struct host_data* h = host_b[b];
+    while (CP(h)) { ret++; h = h->next; }
+  }
+
+  return ret;
+
+}
+
+
 /* Clean up everything. */
 
 void destroy_all_hosts(void) {
 
-  while (flow_by_age) destroy_flow(flow_by_age);
-  while (host_by_age) destroy_host(host_by_age);
+  u8 state, seg;
+
+  for (state = 0; state < FLOW_STATES; state++)
+    while (flow_by_age[state]) destroy_flow(flow_by_age[state]);
+
+  while (ts_by_age) destroy_ts_flow(ts_by_age);
+
+  while (conn_by_age) destroy_conn(conn_by_age);
+
+  for (seg = 0; seg < HOST_SEGS; seg++)
+    while (host_by_age[seg]) destroy_host(host_by_age[seg]);
 
 }
@@ -14,8 +14,10 @@
 #include <pcap.h>
 
 #include "types.h"
+#include "api.h"
 #include "fp_tcp.h"
 #include "fp_http.h"
+#include "flow_buf.h"
 
 /* Parsed information handed over by the pcap callback: */
 
@@ -50,6 +52,7 @@ struct packet_data {
 
   u8* payload;                          /* TCP payload                        */
   u16 pay_len;                          /* Length of TCP payload              */
+  u16 pay_cap;                          /* How much of it was captured        */
 
   u32 seq;                              /* seq value seen                     */
 
@@ -81,6 +84,41 @@ struct packet_data {
 #define QUIRK_OPT_EXWS       0x08000000 /* Excessive window scaling           */
 #define QUIRK_OPT_BAD        0x10000000 /* Problem parsing TCP options        */
 
+/* Entry in the per-host history ring: */
+
+struct host_hist {
+
+  u32 time;                             /* Observation time (unix time)       */
+  s32 sig_id;                           /* p0f.fp line of matched sig, or -1  */
+  s16 name_id;                          /* Matched OS / app name ID, or -1    */
+  u16 port;                             /* Server port of the connection      */
+  u8  dist;                             /* Measured distance                  */
+  u8  flags;                            /* P0F_HIST_*                         */
+
+};
+
+/* Entry in the per-host service set: */
+
+struct host_svc {
+
+  u16 port;                             /* Server port                        */
+  u8  flags;                            /* P0F_SVC_*                          */
+  s32 name_id;                          /* HTTP server name ID, or -1         */
+  s32 label_id;                         /* Label of that match, or -1         */
+  u32 first_seen;                       /* First seen on the port (unix time) */
+  u32 last_seen;                        /* Last seen on the port (unix time)  */
+
+};
+
+/* Host eviction segments, in the order they are pruned. New hosts start out
+   on probation and move to the protected segment once seen in another
+   connection; hosts pushed out of the protected segment are demoted: */
+
+#define HOST_DEMOTED        0
+#define HOST_PROBATION      1
+#define HOST_PROTECTED      2
+#define HOST_SEGS           3
+
 /* Host record with persistent fingerprinting data: */
 
 struct host_data {
@@ -88,6 +126,7 @@ struct host_data {
   struct host_data *prev, *next;        /* Linked lists                       */
   struct host_data *older, *newer;
   u32 use_cnt;                          /* Number of packet_flows attached    */
+  u8  seg;                              /* HOST_DEMOTED, _PROBATION, ...      */
 
   u32 first_seen;                       /* Record created (unix time)         */
   u32 last_seen;                        /* Host last seen (unix time)         */
@@ -102,14 +141,18 @@ struct host_data {
   s32 last_class_id;                    /* OS class ID (-1 = not found)       */
   s32 last_name_id;                     /* OS name ID (-1 = not found)        */
   u8* last_flavor;                      /* Last OS flavor                     */
+  s32 last_label_id;                    /* Label of last OS match (-1 = none) */
 
   u8  last_quality;                     /* Generic or fuzzy match?            */
+  u32 last_tcp;                         /* Last SYN / SYN+ACK verdict (wall)  */
 
   u8* link_type;                        /* MTU-derived link type              */
+  s32 link_id;                          /* ID of link_type (-1 = none)        */
 
   u8  cli_scores[NAT_SCORES];           /* Scoreboard for client NAT          */
   u8  srv_scores[NAT_SCORES];           /* Scoreboard for server NAT          */
   u16 nat_reasons;                      /* NAT complaints                     */
+  u16 last_nat_reasons;                 /* Reasons for the last NAT verdict   */
 
   u32 last_nat;                         /* Last NAT detection time            */
   u32 last_chg;                         /* Last OS change detection time      */
@@ -120,21 +163,44 @@ struct host_data {
 
   s32 last_up_min;                      /* Last computed uptime (-1 = none)   */
   u32 up_mod_days;                      /* Uptime modulo (days)               */
+  u32 up_freq;                          /* Timestamp clock frequency (Hz)     */
 
   /* HTTP business: */
 
   struct http_sig* http_req_os;         /* Last request, if class != -1       */
-  struct http_sig* http_resp;           /* Last response                      */
+  struct http_sig* http_req;            /* Last request, with headers         */
+  struct http_sig* http_resp;           /* Last response, with headers        */
 
   s32 http_name_id;                     /* Client name ID (-1 = not found)    */
   u8* http_flavor;                      /* Client flavor                      */
+  s32 http_label_id;                    /* Label of last app match (-1 = none)*/
+  u8  http_quality;                     /* Generic app match?                 */
 
   u8* language;                         /* Detected language                  */
+  s32 lang_id;                          /* ID of language (-1 = none)         */
 
   u8  bad_sw;                           /* Used dishonest U-A or Server?      */
 
   u16 http_resp_port;                   /* Port on which response seen        */
 
+  /* Recent connections, newest at hist[hist_next - 1]: */
+
+  struct host_hist* hist;               /* HOST_HISTORY entries, or NULL      */
+  u8  hist_next;                        /* Next slot to write                 */
+  u8  hist_cnt;                         /* Valid entries                      */
+
+  /* Ports the host answers on, sorted by port: */
+
+  struct host_svc* svc;                 /* HOST_SERVICES entries, or NULL     */
+  u8  svc_cnt;                          /* Valid entries                      */
+
+  /* What the host is counted as in agg.c: */
+
+  u32 agg_pfx;                          /* -G prefixes it falls in (bitmap)   */
+  s32 agg_os;                           /* Counted OS name ID (-1 = none)     */
+  s32 agg_app;                          /* Counted app name ID (-1 = none)    */
+  s32 agg_link;                         /* Counted link ID (-1 = none)        */
+
 };
 
 /* Reasons for NAT detection: */
@@ -154,6 +220,47 @@ struct host_data {
 #define NAT_APP_DATE         0x0800     /* Date changes in a weird way        */
 #define NAT_APP_UA           0x1000     /* User-Agent OS inconsistency        */
 
+/* Flow states, each with its own timeout (see flow_timeout()): */
+
+#define FLOW_SYN             0x00       /* Waiting for SYN+ACK                */
+#define FLOW_ESTAB           0x01       /* No payload yet, uptime tracking    */
+#define FLOW_HTTP            0x02       /* Collecting HTTP headers            */
+
+#define FLOW_STATES          3
+
+/* Verdicts on the client side of a single connection, for API queries by
+   tuple. Kept while the flow is tracked, then for CONN_LINGER seconds: */
+
+struct conn_verdict {
+
+  struct conn_verdict *prev, *next;     /* Linked lists                       */
+  struct conn_verdict *older, *newer;   /* By close time, closed ones only    */
+  u32 bucket;                           /* Bucket this record belongs to      */
+
+  u8  ip_ver;                           /* Address type                       */
+  u8  cli_addr[16];                     /* Client address                     */
+  u8  srv_addr[16];                     /* Server address                     */
+  u16 cli_port;                         /* Client port                        */
+  u16 srv_port;                         /* Server port                        */
+
+  u32 created;                          /* SYN seen at (unix time)            */
+  u32 closed;                           /* Flow gone at (0 = still tracked)   */
+
+  s32 os_name_id;                       /* OS name ID (-1 = not found)        */
+  s32 os_label_id;                      /* Label of OS match (-1 = none)      */
+  u8  os_quality;                       /* Generic or fuzzy match?            */
+  s16 distance;                         /* Distance (-1 = unknown)            */
+
+  s32 link_id;                          /* Link type ID (-1 = none)           */
+
+  s32 http_name_id;                     /* Client app name ID (-1 = none)     */
+  s32 http_label_id;                    /* Label of app match (-1 = none)     */
+  u8  http_quality;                     /* Generic app match?                 */
+  s32 lang_id;                          /* Language ID (-1 = none)            */
+  u8  bad_sw;                           /* Dishonest U-A?                     */
+
+};
+
 /* TCP flow record, maintained until all fingerprinting modules are happy: */
 
 struct packet_flow {
@@ -162,6 +269,9 @@ struct packet_flow {
   struct packet_flow *older, *newer;
   u32 bucket;                           /* Bucket this flow belongs to        */
 
+  u8  state;                            /* FLOW_*                             */
+  u32 state_time;                       /* State entered at (unix time)      */
+
   struct host_data* client;             /* Requesting client                  */
   struct host_data* server;             /* Target server                      */
 
@@ -174,12 +284,10 @@ struct packet_flow {
   s16 srv_tps;                          /* Computed TS divisor (-1 = bad)     */ 
   s16 cli_tps;
 
-  u8* request;                          /* Client-originating data            */
-  u32 req_len;                          /* Captured data length               */
+  struct flow_buf request;              /* Client-originating data            */
   u32 next_cli_seq;                     /* Next seq on cli -> srv packet      */
 
-  u8* response;                         /* Server-originating data            */
-  u32 resp_len;                         /* Captured data length               */
+  struct flow_buf response;             /* Server-originating data            */
   u32 next_srv_seq;                     /* Next seq on srv -> cli packet      */
   u16 syn_mss;                          /* MSS on SYN packet                  */
 
@@ -195,9 +303,49 @@ struct packet_flow {
 
   struct http_sig http_tmp;             /* Temporary signature                */
 
+  struct conn_verdict* cv;              /* Verdicts for this connection       */
+
+};
+
+/* Compact record that replaces a packet_flow once no module needs payload,
+   kept only to take a later timestamp sample for uptime detection: */
+
+struct ts_flow {
+
+  struct ts_flow *prev, *next;          /* Linked lists                       */
+  struct ts_flow *older, *newer;
+  u32 bucket;                           /* Bucket this record belongs to      */
+
+  struct host_data* client;             /* Requesting client                  */
+  struct host_data* server;             /* Target server                      */
+
+  u16 cli_port;                         /* Client port                        */
+  u16 srv_port;                         /* Server port                        */
+
+  u32 cli_ts1;                          /* TS1 on the SYN (0 = none)          */
+  u32 srv_ts1;                          /* TS1 on the SYN+ACK (0 = none)      */
+
+  u64 cli_recv_ms;                      /* SYN received at (ms)               */
+  u64 srv_recv_ms;                      /* SYN+ACK received at (ms)           */
+
+  s16 cli_tps;                          /* Computed TS divisor (-1 = bad)     */
+  s16 srv_tps;
+
+  u32 created;                          /* Record creation date (unix time)   */
+
 };
 
 extern u64 packet_cnt;
+extern u32 host_cnt, flow_cnt, ts_flow_cnt, conn_cnt;
+
+extern u8  track_latency;
+extern u8  slim_export;
+extern u64 slim_cnt;
+
+extern u8  rematch_active;
+extern u32 rematch_hosts, rematch_changed;
+extern u32 lat_process[P0F_LAT_BUCKETS], lat_update[P0F_LAT_BUCKETS],
+           lat_visible[P0F_LAT_BUCKETS];
 
 void parse_packet(void* junk, const struct pcap_pkthdr* hdr, const u8* data);
 
@@ -209,8 +357,26 @@ u32 get_unix_time(void);
 void add_nat_score(u8 to_srv, struct packet_flow* f, u16 reason, u8 score);
 void verify_tool_class(u8 to_srv, struct packet_flow* f, u32* sys, u32 sys_cnt);
 
+struct host_data* restore_host(u8* addr, u8 ip_ver, u32 seen);
+
+void note_host_update(void);
+void note_batch_done(void);
+
+void add_host_history(struct host_data* h, s32 sig_id, s16 name_id, u8 dist,
+                      u16 port, u8 flags);
+
+void add_host_service(struct host_data* h, u16 port, s32 name_id,
+                      s32 label_id, u8 flags);
+
 struct host_data* lookup_host(u8* addr, u8 ip_ver);
 
+struct conn_verdict* lookup_conn(u8 ip_ver, u8* cli_addr, u16 cli_port,
+                                 u8* srv_addr, u16 srv_port);
+
+void rematch_start(void);
+u8 rematch_step(void);
+u32 rematch_left(void);
+
 void destroy_all_hosts(void);
 
 #endif /* !_HAVE_PROCESS_H */
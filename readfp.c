@@ -16,11 +16,13 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
 
 #include <sys/fcntl.h>
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "types.h"
 #include "config.h"
@@ -29,6 +31,7 @@
 #include "fp_tcp.h"
 #include "fp_mtu.h"
 #include "fp_http.h"
+#include "hash.h"
 #include "readfp.h"
 
 static u32 sig_cnt;                     /* Total number of p0f.fp sigs        */
@@ -46,13 +49,75 @@ static u32* cur_sys;                    /* Current 'sys' values               */
 static u32  cur_sys_cnt;                /* Number of 'sys' entries            */
 
 u8 **fp_os_classes,                     /* Map of OS classes                  */
-   **fp_os_names;                       /* Map of OS names                    */
+   **fp_os_names,                       /* Map of OS names                    */
+   **fp_flavors;                        /* Map of flavors, by label ID        */
 
-static u32 class_cnt,                   /* Sizes for maps                     */
-           name_cnt,
-           label_id,                    /* Current label ID                   */
+u32 fp_name_cnt,                        /* Sizes for maps                     */
+    fp_flavor_cnt,
+    fp_class_cnt;
+
+/* Case-insensitive hash indexes of fp_os_names and fp_os_classes: */
+
+struct name_index {
+  u32* ids[NAME_BUCKETS];               /* IDs in each bucket                 */
+  u32  cnt[NAME_BUCKETS];               /* Number of IDs in bucket            */
+};
+
+static struct name_index name_idx, class_idx;
+
+static u32 label_id,                    /* Current label ID                   */
            line_no;                     /* Current line number                */
 
+static u8  in_delta;                    /* Parsing a delta file?              */
+static s32 delta_rev;                   /* Revision declared by delta         */
+
+u32 fp_revision,                        /* Signature database revision        */
+    fp_digest;                          /* Hash of all files applied so far   */
+
+
+/* Case-insensitive FNV-1a hash of a name, reduced to a bucket number. */
+
+static u32 name_bucket(u8* name, u32 len) {
+
+  u32 ret = 0x811c9dc5;
+
+  while (len--) ret = (ret ^ tolower(*name++)) * 0x01000193;
+
+  return ret % NAME_BUCKETS;
+
+}
+
+
+/* Find a name in an index over 'map'. Returns its ID, or -1. */
+
+static s32 index_find(struct name_index* idx, u8** map, u8* name, u32 len) {
+
+  u32  b = name_bucket(name, len);
+  u32* p = idx->ids[b];
+  u32  i = idx->cnt[b];
+
+  while (i--) {
+    if (!strncasecmp((char*)name, (char*)map[*p], len) && !map[*p][len])
+      return *p;
+    p++;
+  }
+
+  return -1;
+
+}
+
+
+/* Add a name to an index. */
+
+static void index_add(struct name_index* idx, u32 id, u8* name, u32 len) {
+
+  u32 b = name_bucket(name, len);
+
+  FP_GROW(idx->ids[b], idx->cnt[b]);
+  idx->ids[b][idx->cnt[b]++] = id;
+
+}
+
 
 /* Parse 'classes' parameter by populating fp_os_classes. */
 
@@ -71,9 +136,10 @@ static void config_parse_classes(u8* val) {
     if (nxt == val || (*nxt && *nxt != ','))
       FATAL("Malformed class entry in line %u.", line_no);
 
-    fp_os_classes = DFL_ck_realloc(fp_os_classes, (class_cnt + 1) * sizeof(u8*));
+    FP_GROW(fp_os_classes, fp_class_cnt);
 
-    fp_os_classes[class_cnt++] = DFL_ck_memdup_str(val, nxt - val);
+    fp_os_classes[fp_class_cnt] = DFL_ck_memdup_str(val, nxt - val);
+    index_add(&class_idx, fp_class_cnt++, val, nxt - val);
 
     val = nxt;
 
@@ -84,24 +150,18 @@ static void config_parse_classes(u8* val) {
 
 /* Look up or create OS or application id. */
 
-u32 lookup_name_id(u8* name, u8 len) {
-
-  u32 i;
+u32 lookup_name_id(u8* name, u32 len) {
 
-  for (i = 0; i < name_cnt; i++)
-    if (!strncasecmp((char*)name, (char*)fp_os_names[i], len)
-        && !fp_os_names[i][len]) break;
+  s32 i = index_find(&name_idx, fp_os_names, name, len);
 
-  if (i == name_cnt) {
+  if (i >= 0) return i;
 
-    sig_name = name_cnt;
+  FP_GROW(fp_os_names, fp_name_cnt);
 
-    fp_os_names = DFL_ck_realloc(fp_os_names, (name_cnt + 1) * sizeof(u8*));
-    fp_os_names[name_cnt++] = DFL_ck_memdup_str(name, len);
+  fp_os_names[fp_name_cnt] = DFL_ck_memdup_str(name, len);
+  index_add(&name_idx, fp_name_cnt, name, len);
 
-  }
-
-  return i;
+  return fp_name_cnt++;
 
 }
 
@@ -111,7 +171,7 @@ u32 lookup_name_id(u8* name, u8 len) {
 static void config_parse_label(u8* val) {
 
   u8* nxt;
-  u32 i;
+  s32 i;
 
   /* Simplified handling for [mtu] signatures. */
 
@@ -145,10 +205,9 @@ static void config_parse_label(u8* val) {
 
     *nxt = 0;
 
-    for (i = 0; i < class_cnt; i++)
-      if (!strcasecmp((char*)val, (char*)fp_os_classes[i])) break;
+    i = index_find(&class_idx, fp_os_classes, val, nxt - val);
 
-    if (i == class_cnt) FATAL("Unknown class '%s' in line %u.", val, line_no);
+    if (i < 0) FATAL("Unknown class '%s' in line %u.", val, line_no);
 
     sig_class = i;
 
@@ -167,6 +226,15 @@ static void config_parse_label(u8* val) {
 
   label_id++;
 
+  /* Label IDs double as flavor IDs for the API. */
+
+  while (fp_flavor_cnt <= label_id) {
+    FP_GROW(fp_flavors, fp_flavor_cnt);
+    fp_flavors[fp_flavor_cnt++] = NULL;
+  }
+
+  fp_flavors[label_id] = sig_flavor;
+
 }
 
 
@@ -183,7 +251,7 @@ static void config_parse_sys(u8* val) {
 
     u8* nxt;
     u8  is_cl = 0, orig;
-    u32 i;
+    s32 i;
 
     while (isblank(*val) || *val == ',') val++;
 
@@ -201,27 +269,15 @@ static void config_parse_sys(u8* val) {
 
     if (is_cl) {
 
-      for (i = 0; i < class_cnt; i++)
-        if (!strcasecmp((char*)val, (char*)fp_os_classes[i])) break;
+      i = index_find(&class_idx, fp_os_classes, val, nxt - val);
 
-      if (i == class_cnt)
-        FATAL("Unknown class '%s' in line %u.", val, line_no);
+      if (i < 0) FATAL("Unknown class '%s' in line %u.", val, line_no);
 
       i |= SYS_CLASS_FLAG;
 
-    } else {
-
-      for (i = 0; i < name_cnt; i++)
-        if (!strcasecmp((char*)val, (char*)fp_os_names[i])) break;
+    } else i = lookup_name_id(val, nxt - val);
 
-      if (i == name_cnt) {
-        fp_os_names = DFL_ck_realloc(fp_os_names, (name_cnt + 1) * sizeof(u8*));
-        fp_os_names[name_cnt++] = DFL_ck_memdup_str(val, nxt - val);
-      }
-
-    }
-
-    cur_sys = DFL_ck_realloc(cur_sys, (cur_sys_cnt + 1) * 4);
+    FP_GROW(cur_sys, cur_sys_cnt);
     cur_sys[cur_sys_cnt++] = i;
 
     *nxt = orig;
@@ -232,6 +288,53 @@ static void config_parse_sys(u8* val) {
 }
 
 
+/* Parse 'revision' parameter. */
+
+static void config_parse_revision(u8* val) {
+
+  u8* nxt = val;
+
+  while (isdigit(*nxt)) nxt++;
+
+  if (nxt == val || *nxt || nxt - val > 9)
+    FATAL("Malformed revision in line %u.", line_no);
+
+  if (in_delta) delta_rev = atoi((char*)val);
+  else fp_revision = atoi((char*)val);
+
+}
+
+
+/* Handle 'retire' in delta files: parse the label, then unlink every
+   signature carrying it in the current section. */
+
+static void config_parse_retire(u8* val) {
+
+  u32 cnt;
+
+  if (mod_type == CF_MOD_MTU)
+    FATAL("MTU signatures can't be retired (line %u).", line_no);
+
+  config_parse_label(val);
+
+  if (mod_type == CF_MOD_TCP)
+    cnt = tcp_retire_sigs(mod_to_srv, generic, sig_class, sig_name, sig_flavor);
+  else
+    cnt = http_retire_sigs(mod_to_srv, generic, sig_class, sig_name, sig_flavor);
+
+  if (!cnt) FATAL("Nothing to retire in line %u.", line_no);
+
+  if (sig_flavor) {
+    DFL_ck_free(sig_flavor);
+    sig_flavor = NULL;
+    fp_flavors[label_id] = NULL;
+  }
+
+  sig_cnt -= cnt;
+
+}
+
+
 /* Read p0f.fp line, dispatching it to fingerprinting modules as necessary. */
 
 static void config_parse_line(u8* line) {
@@ -318,6 +421,22 @@ static void config_parse_line(u8* line) {
 
     config_parse_classes(val);
 
+  } else if (!strcmp((char*)line, "revision")) {
+
+    if (state != CF_NEED_SECT) 
+      FATAL("misplaced 'revision' in line %u.", line_no);
+
+    config_parse_revision(val);
+
+  } else if (!strcmp((char*)line, "retire")) {
+
+    if (!in_delta || (state != CF_NEED_LABEL && state != CF_NEED_SIG))
+      FATAL("misplaced 'retire' in line %u.", line_no);
+
+    config_parse_retire(val);
+
+    state = CF_NEED_LABEL;
+
   } else if (!strcmp((char*)line, "ua_os")) {
 
     if (state != CF_NEED_LABEL || mod_to_srv != 1 || mod_type != CF_MOD_HTTP) 
@@ -380,32 +499,12 @@ static void config_parse_line(u8* line) {
 }
 
 
-/* Top-level file parsing. */
-
-void read_config(u8* fname) {
-
-  s32 f;
-  struct stat st;
-  u8  *data, *cur;
+/* Parse NUL-terminated file data, line by line. */
 
-  f = open((char*)fname, O_RDONLY);
-  if (f < 0) PFATAL("Cannot open '%s' for reading.", fname);
+static void parse_config(u8* cur) {
 
-  if (fstat(f, &st)) PFATAL("fstat() on '%s' failed.", fname);
-
-  if (!st.st_size) { 
-    close(f);
-    goto end_fp_read;
-  }
-
-  cur = data = ck_alloc(st.st_size + 1);
-
-  if (read(f, data, st.st_size) != st.st_size)
-    FATAL("Short read from '%s'.", fname);
-
-  data[st.st_size] = 0;
-
-  close(f);
+  line_no = 0;
+  state   = CF_NEED_SECT;
 
   /* If you put NUL in your p0f.fp... Well, sucks to be you. */
 
@@ -436,15 +535,143 @@ void read_config(u8* fname) {
 
   }
 
-  ck_free(data);
+}
+
+
+/* Read a whole file, relative to dir_fd unless AT_FDCWD. Returns NULL if
+   the file doesn't exist and 'may_fail' is set. */
+
+static u8* read_whole(s32 dir_fd, u8* fname, u32* len, u8 may_fail) {
+
+  s32 f;
+  struct stat st;
+  u8* data;
+
+  f = openat(dir_fd, (char*)fname, O_RDONLY);
+
+  if (f < 0) {
+    if (may_fail && errno == ENOENT) return NULL;
+    PFATAL("Cannot open '%s' for reading.", fname);
+  }
+
+  if (fstat(f, &st)) PFATAL("fstat() on '%s' failed.", fname);
+
+  data = ck_alloc(st.st_size + 1);
+
+  if (read(f, data, st.st_size) != st.st_size)
+    FATAL("Short read from '%s'.", fname);
+
+  data[st.st_size] = 0;
+
+  close(f);
+
+  *len = st.st_size;
+  return data;
+
+}
+
+
+/* Top-level file parsing. */
+
+void read_config(u8* fname) {
+
+  u8* data;
+  u32 len;
+
+  data = read_whole(AT_FDCWD, fname, &len, 0);
 
-end_fp_read:  
+  parse_config(data);
+
+  fp_digest = hash32(data, len, 0);
+
+  ck_free(data);
 
   if (!sig_cnt)
     SAYF("[!] No signatures found in '%s'.\n", fname);
   else 
-    SAYF("[+] Loaded %u signature%s from '%s'.\n", sig_cnt,
-         sig_cnt == 1 ? "" : "s", fname);
+    SAYF("[+] Loaded %u signature%s from '%s' (revision %u, digest %08x).\n",
+         sig_cnt, sig_cnt == 1 ? "" : "s", fname, fp_revision, fp_digest);
+
+}
+
+
+/* Parse a delta file on top of what we have. */
+
+static void parse_delta(u8* data) {
+
+  in_delta  = 1;
+  delta_rev = -1;
+
+  parse_config(data);
+
+  if (delta_rev < 0) FATAL("Delta file does not declare a 'revision'.");
+
+  if (delta_rev != fp_revision + 1)
+    FATAL("Delta file is for revision %d, expected %u.", delta_rev,
+          fp_revision + 1);
+
+  in_delta = 0;
+
+}
+
+
+/* Apply delta files named <rev>.fp from a directory, one revision at a
+   time, for as long as the next one exists. Parsing errors are fatal, so
+   every delta is first tried in a throwaway child process; a broken one is
+   rejected and leaves the running database alone. Returns the number of
+   deltas applied. */
+
+u32 apply_deltas(s32 dir_fd) {
+
+  u32 applied = 0;
+
+  while (1) {
+
+    u8  fname[32], *data;
+    u32 len, old_cnt = sig_cnt;
+    s32 pid, status;
+
+    sprintf((char*)fname, "%u.fp", fp_revision + 1);
+
+    data = read_whole(dir_fd, fname, &len, 1);
+    if (!data) return applied;
+
+    /* Don't let the child flush our pending output a second time. */
+
+    fflush(NULL);
+
+    pid = fork();
+    if (pid < 0) PFATAL("fork() failed.");
+
+    if (!pid) {
+      parse_delta(data);
+      _exit(0);
+    }
+
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status)) {
+
+      WARN("Delta '%s' rejected, staying at revision %u.", fname,
+           fp_revision);
+
+      ck_free(data);
+      return applied;
+
+    }
+
+    parse_delta(data);
+
+    fp_revision++;
+    fp_digest = hash32(data, len, fp_digest);
+    applied++;
+
+    ck_free(data);
+
+    SAYF("[+] Applied delta '%s' (%+d signatures), now at revision %u "
+         "(digest %08x).\n", fname, (s32)(sig_cnt - old_cnt), fp_revision,
+         fp_digest);
+
+  }
 
 }
 
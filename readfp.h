@@ -33,9 +33,26 @@
 
 extern u8** fp_os_classes;
 extern u8** fp_os_names;
+extern u8** fp_flavors;
+
+extern u32 fp_name_cnt, fp_flavor_cnt, fp_class_cnt;
+
+extern u32 fp_revision, fp_digest;
 
 void read_config(u8* fname);
 
-u32 lookup_name_id(u8* name, u8 len);
+u32 apply_deltas(s32 dir_fd);
+
+u32 lookup_name_id(u8* name, u32 len);
+
+/* Make room for one more element in an array holding _cnt entries. Arrays
+   grow by doubling whenever _cnt hits a power of two, so the capacity needs
+   no separate tracking; shrinking _cnt in between is fine. */
+
+#define FP_GROW(_arr, _cnt) do { \
+    if (!((_cnt) & ((_cnt) - 1))) \
+      (_arr) = DFL_ck_realloc((_arr), \
+                              ((_cnt) ? (_cnt) * 2 : 1) * sizeof(*(_arr))); \
+  } while (0)
 
 #endif /* !_HAVE_READFP_H */
@@ -2,7 +2,17 @@
    p0f-client - simple API client
    ------------------------------
 
-   Can be used to query p0f API sockets.
+   Can be used to query p0f API sockets. With -H, shows the most recent
+   connections seen from the host instead of the summary; with -S, the ports
+   it was seen serving on, and the HTTP server on each. With -2, uses the
+   compact ID-based query and resolves IDs with dictionary queries; a real
+   client would cache the dictionaries until fp_revision changes. With
+   -W ms, waits up to the given time for a fresh SYN from the host, as a
+   proxy that just accepted a connection would. With -C, looks up verdicts
+   for a single connection, given as client_ip/port server_ip/port. With -A,
+   lists host counts per OS, HTTP application and link type, for the whole
+   cache or for the n-th -G prefix. With -D, shows the estimated number of
+   distinct clients of a server_ip/port, or of distinct hosts per OS.
 
    Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>
 
@@ -81,25 +91,549 @@ static void parse_addr6(char* str, u8* ret) {
 }
 
 
+/* Read and print a history response. */
+
+static void show_history(s32 sock) {
+
+  static struct p0f_hist_response r;
+
+  u8 tmp[128];
+  u32 i;
+
+  if (read(sock, &r, sizeof(struct p0f_hist_response)) !=
+      sizeof(struct p0f_hist_response)) FATAL("Short read from API socket.");
+
+  if (r.magic != P0F_HIST_RESP_MAGIC)
+    FATAL("Bad response magic (0x%08x).\n", r.magic);
+
+  if (r.status == P0F_STATUS_BADQUERY)
+    FATAL("P0f did not understand the query.\n");
+
+  if (r.status == P0F_STATUS_NOMATCH || !r.count) {
+    SAYF("No history for this host in p0f cache.\n");
+    return;
+  }
+
+  if (r.count > P0F_HIST_MAX) FATAL("Bad history entry count (%u).", r.count);
+
+  for (i = 0; i < r.count; i++) {
+
+    struct p0f_hist_entry* e = r.entry + i;
+    time_t ut = e->time;
+
+    strftime((char*)tmp, 128, "%Y/%m/%d %H:%M:%S", localtime(&ut));
+
+    SAYF("%s  %-6s port %-5u dist %-3u%s  ", tmp,
+         (e->flags & P0F_HIST_SYNACK) ? "server" : "client", e->port,
+         e->distance, (e->flags & P0F_HIST_BAD_TTL) ? "+" : " ");
+
+    if (e->sig_id < 0) SAYF("no match\n");
+    else SAYF("sig line %d (name ID %d)%s%s\n", e->sig_id, e->name_id,
+              (e->flags & P0F_HIST_GENERIC) ? " [generic]" : "",
+              (e->flags & P0F_HIST_FUZZY) ? " [fuzzy]" : "");
+
+  }
+
+}
+
+
+/* Resolve a single dictionary ID over an open connection. */
+
+static u8* lookup_id(s32 sock, u8 dict, s32 id) {
+
+  static struct p0f_dict_response r;
+  struct p0f_dict_query q;
+
+  if (id < 0) return (u8*)"";
+
+  memset(&q, 0, sizeof(struct p0f_dict_query));
+
+  q.magic    = P0F_DICT_QUERY_MAGIC;
+  q.dict     = dict;
+  q.first_id = id;
+
+  if (write(sock, &q, sizeof(struct p0f_dict_query)) !=
+      sizeof(struct p0f_dict_query)) FATAL("Short write to API socket.");
+
+  if (read(sock, &r, sizeof(struct p0f_dict_response)) !=
+      sizeof(struct p0f_dict_response)) FATAL("Short read from API socket.");
+
+  if (r.magic != P0F_DICT_RESP_MAGIC)
+    FATAL("Bad response magic (0x%08x).\n", r.magic);
+
+  if (r.status != P0F_STATUS_OK || !r.count) return (u8*)"";
+
+  r.data[P0F_DICT_DATA - 1] = 0;
+  return r.data;
+
+}
+
+
+/* Read and print a service set response. */
+
+static void show_services(s32 sock) {
+
+  static struct p0f_svc_response r;
+
+  u8 tmp[128];
+  u32 i;
+
+  if (read(sock, &r, sizeof(struct p0f_svc_response)) !=
+      sizeof(struct p0f_svc_response)) FATAL("Short read from API socket.");
+
+  if (r.magic != P0F_SVC_RESP_MAGIC)
+    FATAL("Bad response magic (0x%08x).\n", r.magic);
+
+  if (r.status == P0F_STATUS_BADQUERY)
+    FATAL("P0f did not understand the query.\n");
+
+  if (r.status == P0F_STATUS_NOMATCH || !r.count) {
+    SAYF("No known services for this host in p0f cache.\n");
+    return;
+  }
+
+  if (r.count > P0F_SVC_MAX) FATAL("Bad service entry count (%u).", r.count);
+
+  for (i = 0; i < r.count; i++) {
+
+    struct p0f_svc_entry* e = r.entry + i;
+    time_t ut = e->last_seen;
+
+    strftime((char*)tmp, 128, "%Y/%m/%d %H:%M:%S", localtime(&ut));
+
+    SAYF("port %-5u  last seen %s  %s%s", e->port, tmp,
+         (e->flags & P0F_SVC_SYNACK) ? "tcp" : "",
+         (e->flags & P0F_SVC_HTTP) ? " http" : "");
+
+    if (e->name_id >= 0) {
+      SAYF("  %s ", lookup_id(sock, P0F_DICT_NAME, e->name_id));
+      SAYF("%s", lookup_id(sock, P0F_DICT_FLAVOR, e->flavor_id));
+    }
+
+    SAYF("\n");
+
+  }
+
+}
+
+
+/* Parse ip/port, as p0f prints it. Returns P0F_ADDR_*. */
+
+static u8 parse_endpoint(char* str, u8* addr, u16* port) {
+
+  char* sl = strrchr(str, '/');
+  u32 val;
+
+  if (!sl || sscanf(sl + 1, "%u", &val) != 1 || val > 65535)
+    FATAL("Malformed endpoint (use ip/port).");
+
+  *sl   = 0;
+  *port = val;
+
+  if (strchr(str, ':')) {
+    parse_addr6(str, addr);
+    return P0F_ADDR_IPV6;
+  }
+
+  parse_addr4(str, addr);
+  return P0F_ADDR_IPV4;
+
+}
+
+
+/* Connect to the API socket. */
+
+static s32 open_api(char* path) {
+
+  static struct sockaddr_un sun;
+  s32 sock;
+
+  sock = socket(PF_UNIX, SOCK_STREAM, 0);
+
+  if (sock < 0) PFATAL("Call to socket() failed.");
+
+  sun.sun_family = AF_UNIX;
+
+  if (strlen(path) >= sizeof(sun.sun_path))
+    FATAL("API socket filename is too long for sockaddr_un (blame Unix).");
+
+  strcpy(sun.sun_path, path);
+
+  if (connect(sock, (struct sockaddr*)&sun, sizeof(sun)))
+    PFATAL("Can't connect to API socket.");
+
+  return sock;
+
+}
+
+
+/* Query and print verdicts for a single connection. */
+
+static void show_tuple(char* path, char* cli, char* srv) {
+
+  static struct p0f_tuple_query q;
+  static struct p0f_tuple_response r;
+
+  s32 sock;
+  u16 cport, sport;
+
+  q.magic     = P0F_TUPLE_QUERY_MAGIC;
+  q.addr_type = parse_endpoint(cli, q.cli_addr, &cport);
+
+  if (parse_endpoint(srv, q.srv_addr, &sport) != q.addr_type)
+    FATAL("Client and server address types differ.");
+
+  q.cli_port = cport;
+  q.srv_port = sport;
+
+  sock = open_api(path);
+
+  if (write(sock, &q, sizeof(struct p0f_tuple_query)) !=
+      sizeof(struct p0f_tuple_query)) FATAL("Short write to API socket.");
+
+  if (read(sock, &r, sizeof(struct p0f_tuple_response)) !=
+      sizeof(struct p0f_tuple_response)) FATAL("Short read from API socket.");
+
+  if (r.magic != P0F_TUPLE_RESP_MAGIC)
+    FATAL("Bad response magic (0x%08x).\n", r.magic);
+
+  if (r.status == P0F_STATUS_BADQUERY)
+    FATAL("P0f did not understand the query.\n");
+
+  if (r.status == P0F_STATUS_NOMATCH) {
+    SAYF("No such connection in p0f cache.\n");
+    close(sock);
+    return;
+  }
+
+  SAYF("Connection    = %s\n", r.closed ? "closed" : "tracked");
+
+  if (r.os_name_id < 0) SAYF("Detected OS   = ???\n");
+  else {
+    SAYF("Detected OS   = %s ", lookup_id(sock, P0F_DICT_NAME, r.os_name_id));
+    SAYF("%s%s%s\n", lookup_id(sock, P0F_DICT_FLAVOR, r.os_flavor_id),
+         (r.os_match_q & P0F_MATCH_GENERIC) ? " [generic]" : "",
+         (r.os_match_q & P0F_MATCH_FUZZY) ? " [fuzzy]" : "");
+  }
+
+  if (r.http_name_id < 0) SAYF("HTTP software = ???\n");
+  else {
+    SAYF("HTTP software = %s ", lookup_id(sock, P0F_DICT_NAME, r.http_name_id));
+    SAYF("%s (ID %s)\n", lookup_id(sock, P0F_DICT_FLAVOR, r.http_flavor_id),
+         (r.bad_sw == 2) ? "is fake" :
+         (r.bad_sw ? "OS mismatch" : "seems legit"));
+  }
+
+  SAYF("Network link  = %s\n", r.link_id < 0 ? (u8*)"???" :
+       lookup_id(sock, P0F_DICT_LINK, r.link_id));
+
+  SAYF("Language      = %s\n", r.language_id < 0 ? (u8*)"???" :
+       lookup_id(sock, P0F_DICT_LANG, r.language_id));
+
+  if (r.distance == -1) SAYF("Distance      = ???\n");
+  else SAYF("Distance      = %u\n", r.distance);
+
+  close(sock);
+
+}
+
+
+/* List per-OS, per-application and per-link host counts for all hosts
+   (prefix 0) or for the n-th -G prefix. */
+
+static void show_agg(char* path, u32 prefix) {
+
+  static struct p0f_agg_query q;
+  static struct p0f_agg_response r;
+
+  static const u8  kinds[] = { P0F_AGG_OS, P0F_AGG_APP, P0F_AGG_LINK };
+  static const u8  dicts[] = { P0F_DICT_NAME, P0F_DICT_NAME, P0F_DICT_LINK };
+  static const char* titles[] = { "Operating systems", "HTTP applications",
+                                  "Link types" };
+
+  s32 sock;
+  u32 i, j;
+
+  if (prefix > 255) FATAL("Bad prefix number.");
+
+  sock = open_api(path);
+
+  for (i = 0; i < 3; i++) {
+
+    q.magic    = P0F_AGG_QUERY_MAGIC;
+    q.kind     = kinds[i];
+    q.prefix   = prefix;
+    q.first_id = 0;
+
+    do {
+
+      if (write(sock, &q, sizeof(struct p0f_agg_query)) !=
+          sizeof(struct p0f_agg_query)) FATAL("Short write to API socket.");
+
+      if (read(sock, &r, sizeof(struct p0f_agg_response)) !=
+          sizeof(struct p0f_agg_response))
+        FATAL("Short read from API socket.");
+
+      if (r.magic != P0F_AGG_RESP_MAGIC)
+        FATAL("Bad response magic (0x%08x).\n", r.magic);
+
+      if (r.status == P0F_STATUS_BADQUERY)
+        FATAL("P0f did not understand the query.\n");
+
+      if (r.status == P0F_STATUS_NOMATCH)
+        FATAL("No such prefix (p0f has %s -G options).\n",
+              prefix > 1 ? "fewer" : "no");
+
+      if (r.count > P0F_AGG_MAX) FATAL("Bad entry count (%u).", r.count);
+
+      if (!q.first_id) {
+
+        if (!i) {
+
+          if (r.addr_type) {
+
+            char addr[INET6_ADDRSTRLEN];
+
+            inet_ntop(r.addr_type == P0F_ADDR_IPV4 ? AF_INET : AF_INET6,
+                      r.addr, addr, sizeof(addr));
+
+            SAYF("Hosts in %s/%u: %u\n", addr, r.prefix_len, r.hosts);
+
+          } else SAYF("Hosts in cache: %u\n", r.hosts);
+
+        }
+
+        SAYF("\n%s:\n", titles[i]);
+
+      }
+
+      for (j = 0; j < r.count; j++)
+        SAYF("  %8u  %s\n", r.entry[j].hosts,
+             lookup_id(sock, dicts[i], r.entry[j].id));
+
+      q.first_id = r.next_id;
+
+    } while (r.next_id < r.total);
+
+  }
+
+  close(sock);
+
+}
+
+
+/* Send a distinct count query, return the response. */
+
+static struct p0f_card_response* card_query(s32 sock,
+                                            struct p0f_card_query* q) {
+
+  static struct p0f_card_response r;
+
+  q->magic = P0F_CARD_QUERY_MAGIC;
+
+  if (write(sock, q, sizeof(struct p0f_card_query)) !=
+      sizeof(struct p0f_card_query)) FATAL("Short write to API socket.");
+
+  if (read(sock, &r, sizeof(struct p0f_card_response)) !=
+      sizeof(struct p0f_card_response)) FATAL("Short read from API socket.");
+
+  if (r.magic != P0F_CARD_RESP_MAGIC)
+    FATAL("Bad response magic (0x%08x).\n", r.magic);
+
+  return &r;
+
+}
+
+
+/* Show distinct clients of a server:port, or, with no endpoint, distinct
+   hosts for every OS seen. */
+
+static void show_card(char* path, char* srv) {
+
+  static struct p0f_card_query q;
+  struct p0f_card_response* r;
+  s32 sock = open_api(path);
+
+  if (srv) {
+
+    u8  tmp[128];
+    u16 port;
+    time_t ut;
+
+    q.kind      = P0F_CARD_SERVER;
+    q.addr_type = parse_endpoint(srv, q.addr, &port);
+    q.port      = port;
+
+    r = card_query(sock, &q);
+
+    if (r->status == P0F_STATUS_BADQUERY)
+      FATAL("P0f did not understand the query.\n");
+
+    if (r->status == P0F_STATUS_NOMATCH) {
+      SAYF("No recent SYN+ACKs from this server:port.\n");
+      close(sock);
+      return;
+    }
+
+    ut = r->cur_start;
+    strftime((char*)tmp, 128, "%Y/%m/%d %H:%M:%S", localtime(&ut));
+
+    SAYF("Distinct clients, previous %u s = %u\n", r->window, r->prev_est);
+    SAYF("Distinct clients, since %s = %u\n", tmp, r->cur_est);
+
+  } else {
+
+    q.kind = P0F_CARD_OS;
+
+    SAYF("%-10s %-10s %s\n", "Previous", "Current", "OS");
+
+    /* Name IDs are dense; a 'bad query' answer means we're past the last
+       one. */
+
+    for (q.name_id = 0; ; q.name_id++) {
+
+      r = card_query(sock, &q);
+
+      if (r->status == P0F_STATUS_BADQUERY) break;
+      if (r->status != P0F_STATUS_OK) continue;
+
+      SAYF("%-10u %-10u %s\n", r->prev_est, r->cur_est,
+           lookup_id(sock, P0F_DICT_NAME, q.name_id));
+
+    }
+
+  }
+
+  close(sock);
+
+}
+
+
+/* Read a v2 response, resolve IDs, and convert it to the v1 format for
+   display. */
+
+static void get_response2(s32 sock, struct p0f_api_response* r) {
+
+  struct p0f_api_response2 r2;
+
+  if (read(sock, &r2, sizeof(struct p0f_api_response2)) !=
+      sizeof(struct p0f_api_response2)) FATAL("Short read from API socket.");
+
+  if (r2.magic != P0F_RESP2_MAGIC)
+    FATAL("Bad response magic (0x%08x).\n", r2.magic);
+
+  r->magic       = P0F_RESP_MAGIC;
+  r->status      = r2.status;
+  r->first_seen  = r2.first_seen;
+  r->last_seen   = r2.last_seen;
+  r->total_conn  = r2.total_conn;
+  r->uptime_min  = r2.uptime_min;
+  r->up_mod_days = r2.up_mod_days;
+  r->last_nat    = r2.last_nat;
+  r->last_chg    = r2.last_chg;
+  r->distance    = r2.distance;
+  r->bad_sw      = r2.bad_sw;
+  r->os_match_q  = r2.os_match_q;
+
+  if (r2.status == P0F_STATUS_TIMEOUT) {
+
+    SAYF("No fresh verdict in time, showing what's known.\n");
+
+    if (!r2.first_seen) {
+      r->status = P0F_STATUS_NOMATCH;
+      return;
+    }
+
+    r->status = P0F_STATUS_OK;
+
+  }
+
+  if (r->status != P0F_STATUS_OK) return;
+
+#define RESOLVE(_dst, _dict, _id) \
+    strncpy((char*)r->_dst, (char*)lookup_id(sock, _dict, r2._id), P0F_STR_MAX)
+
+  RESOLVE(os_name, P0F_DICT_NAME, os_name_id);
+  RESOLVE(os_flavor, P0F_DICT_FLAVOR, os_flavor_id);
+  RESOLVE(http_name, P0F_DICT_NAME, http_name_id);
+  RESOLVE(http_flavor, P0F_DICT_FLAVOR, http_flavor_id);
+  RESOLVE(link_type, P0F_DICT_LINK, link_id);
+  RESOLVE(language, P0F_DICT_LANG, language_id);
+
+#undef RESOLVE
+
+  SAYF("DB revision   = %u (digest %08x)\n", r2.fp_revision, r2.fp_digest);
+
+  if (r2.up_freq) SAYF("Clock freq    = %u Hz\n", r2.up_freq);
+
+  if (r2.nat_reasons) SAYF("NAT reasons   = 0x%04x\n", r2.nat_reasons);
+
+}
+
+
 int main(int argc, char** argv) {
 
   u8 tmp[128];
   struct tm* t;
 
-  static struct p0f_api_query q;
+  static struct p0f_wait_query q;
   static struct p0f_api_response r;
 
-  static struct sockaddr_un sun;
-
   s32  sock;
   time_t ut;
+  u8   hist = 0, svc = 0, v2 = 0, wait = 0;
+  u32  qlen = sizeof(struct p0f_api_query);
+
+  if (argc == 5 && !strcmp(argv[1], "-C")) {
+    show_tuple(argv[2], argv[3], argv[4]);
+    return 0;
+  }
+
+  if ((argc == 3 || argc == 4) && !strcmp(argv[1], "-D")) {
+    show_card(argv[2], argc == 4 ? argv[3] : NULL);
+    return 0;
+  }
+
+  if ((argc == 3 || argc == 4) && !strcmp(argv[1], "-A")) {
+    show_agg(argv[2], argc == 4 ? atoi(argv[3]) : 0);
+    return 0;
+  }
+
+  if (argc == 5 && !strcmp(argv[1], "-W")) {
+    wait = v2 = 1;
+    q.timeout_ms = atoi(argv[2]);
+    q.since = time(NULL);
+    qlen = sizeof(struct p0f_wait_query);
+    argv += 2;
+    argc -= 2;
+  } else if (argc == 4 && !strcmp(argv[1], "-H")) {
+    hist = 1;
+    argv++;
+    argc--;
+  } else if (argc == 4 && !strcmp(argv[1], "-S")) {
+    svc = 1;
+    argv++;
+    argc--;
+  } else if (argc == 4 && !strcmp(argv[1], "-2")) {
+    v2 = 1;
+    argv++;
+    argc--;
+  }
 
   if (argc != 3) {
-    ERRORF("Usage: p0f-client /path/to/socket host_ip\n");
+    ERRORF("Usage: p0f-client [ -H | -S | -2 | -W ms ] /path/to/socket "
+           "host_ip\n"
+           "       p0f-client -C /path/to/socket client_ip/port "
+           "server_ip/port\n"
+           "       p0f-client -A /path/to/socket [ prefix_no ]\n"
+           "       p0f-client -D /path/to/socket [ server_ip/port ]\n");
     exit(1);
   }
 
-  q.magic = P0F_QUERY_MAGIC;
+  if (wait) q.magic = P0F_WAIT_QUERY_MAGIC;
+  else if (svc) q.magic = P0F_SVC_QUERY_MAGIC;
+  else q.magic = hist ? P0F_HIST_QUERY_MAGIC :
+                 (v2 ? P0F_QUERY2_MAGIC : P0F_QUERY_MAGIC);
 
   if (strchr(argv[2], ':')) {
 
@@ -113,24 +647,25 @@ int main(int argc, char** argv) {
 
   }
 
-  sock = socket(PF_UNIX, SOCK_STREAM, 0);
-
-  if (sock < 0) PFATAL("Call to socket() failed.");
+  sock = open_api(argv[1]);
 
-  sun.sun_family = AF_UNIX;
+  if (write(sock, &q, qlen) != qlen) FATAL("Short write to API socket.");
 
-  if (strlen(argv[1]) >= sizeof(sun.sun_path))
-    FATAL("API socket filename is too long for sockaddr_un (blame Unix).");
-
-  strcpy(sun.sun_path, argv[1]);
+  if (hist) {
+    show_history(sock);
+    close(sock);
+    return 0;
+  }
 
-  if (connect(sock, (struct sockaddr*)&sun, sizeof(sun)))
-    PFATAL("Can't connect to API socket.");
+  if (svc) {
+    show_services(sock);
+    close(sock);
+    return 0;
+  }
 
-  if (write(sock, &q, sizeof(struct p0f_api_query)) !=
-      sizeof(struct p0f_api_query)) FATAL("Short write to API socket.");
+  if (v2) get_response2(sock, &r);
 
-  if (read(sock, &r, sizeof(struct p0f_api_response)) !=
+  else if (read(sock, &r, sizeof(struct p0f_api_response)) !=
       sizeof(struct p0f_api_response)) FATAL("Short read from API socket.");
   
   close(sock);
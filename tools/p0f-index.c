@@ -0,0 +1,251 @@
+/*
+   p0f-index - pcap index builder
+   ------------------------------
+
+   Builds <file>.idx for each classic pcap file given on the command line;
+   see index.h for the format. With the index in place, p0f -r ... -T from,to
+   and -a addr skip files and regions of files that can't be relevant:
+
+   p0f-index /archive/dump-*.pcap
+   p0f -r a.pcap -r b.pcap -T 1349960400,1349960700 -a 10.1.2.3
+
+   Indexes record the size and modification time of the pcap file, and are
+   ignored if either changes.
+
+   Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>
+
+   Distributed under the terms and conditions of GNU LGPL.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "../types.h"
+#include "../config.h"
+#include "../alloc-inl.h"
+#include "../debug.h"
+#include "../index.h"
+
+/* Link types we know how to find IP headers in: */
+
+#define LT_NULL         0
+#define LT_EN10MB       1
+#define LT_RAW1         12
+#define LT_RAW2         14
+#define LT_LOOP         108
+#define LT_RAW          101
+#define LT_LINUX_SLL    113
+
+
+/* Locate the IP header; returns its offset, or -1 if it's not IP. */
+
+static s32 ip_offset(u32 link, u8* data, u32 len) {
+
+  u32 off;
+  u16 proto;
+
+  switch (link) {
+
+    case LT_RAW: case LT_RAW1: case LT_RAW2: return 0;
+
+    case LT_NULL: case LT_LOOP: return 4;
+
+    case LT_LINUX_SLL:
+
+      if (len < 16) return -1;
+      proto = (data[14] << 8) | data[15];
+      off   = 16;
+      break;
+
+    case LT_EN10MB:
+
+      if (len < 14) return -1;
+      proto = (data[12] << 8) | data[13];
+      off   = 14;
+
+      while (proto == 0x8100 && len >= off + 4) {
+        proto = (data[off + 2] << 8) | data[off + 3];
+        off  += 4;
+      }
+
+      break;
+
+    default: return -1;
+
+  }
+
+  if (proto != 0x0800 && proto != 0x86dd) return -1;
+  return off;
+
+}
+
+
+/* Index a single file. */
+
+static void index_file(char* fname) {
+
+  struct p0f_idx_hdr* ih;
+  struct p0f_idx_block* blk = NULL;
+  struct stat st;
+
+  u32 hdr[6], rec[4], link, nblk = 0, alloc = 0, pcnt = 0;
+  u64 pos = 24, blk_start = 0;
+  u8  swap, pkt[65536], warned = 0;
+  u8  *dst, *tmp;
+  FILE* f;
+
+  f = fopen(fname, "r");
+  if (!f) PFATAL("Unable to open '%s'.", fname);
+
+  if (fstat(fileno(f), &st)) PFATAL("fstat() failed.");
+
+  if (fread(hdr, 4, 6, f) != 6) FATAL("'%s' is too short.", fname);
+
+  /* Microsecond and nanosecond variants, either byte order. */
+
+  if (hdr[0] == 0xa1b2c3d4 || hdr[0] == 0xa1b23c4d) swap = 0;
+  else if (hdr[0] == 0xd4c3b2a1 || hdr[0] == 0x4d3cb2a1) swap = 1;
+  else FATAL("'%s' is not a classic pcap file.", fname);
+
+  link = swap ? __builtin_bswap32(hdr[5]) : hdr[5];
+
+  ih = ck_alloc(sizeof(struct p0f_idx_hdr));
+
+  ih->magic      = P0F_IDX_MAGIC;
+  ih->pcap_size  = st.st_size;
+  ih->pcap_mtime = st.st_mtime;
+
+  while (fread(rec, 4, 4, f) == 4) {
+
+    u32 ts  = swap ? __builtin_bswap32(rec[0]) : rec[0];
+    u32 len = swap ? __builtin_bswap32(rec[2]) : rec[2];
+    struct p0f_idx_block* b;
+    s32 off;
+
+    if (len > sizeof(pkt)) FATAL("Corrupted record in '%s'.", fname);
+
+    if (fread(pkt, 1, len, f) != len) {
+      WARN("Truncated last record in '%s'.", fname);
+      break;
+    }
+
+    /* Start a new block? */
+
+    if (!nblk || pos - blk_start >= P0F_IDX_BLOCK) {
+
+      if (nblk == alloc) {
+        alloc = alloc ? alloc * 2 : 64;
+        blk   = ck_realloc(blk, alloc * sizeof(struct p0f_idx_block));
+      }
+
+      memset(blk + nblk, 0, sizeof(struct p0f_idx_block));
+
+      blk[nblk].offset   = pos;
+      blk[nblk].first_ts = ts;
+      blk[nblk].last_ts  = ts;
+
+      blk_start = pos;
+      nblk++;
+
+    }
+
+    b = blk + nblk - 1;
+
+    if (ts < b->first_ts) b->first_ts = ts;
+    if (ts > b->last_ts) b->last_ts = ts;
+
+    if (!pcnt || ts < ih->first_ts) ih->first_ts = ts;
+    if (ts > ih->last_ts) ih->last_ts = ts;
+
+    off = ip_offset(link, pkt, len);
+
+    if (off >= 0 && len >= off + 20 && (pkt[off] >> 4) == 4) {
+
+      idx_bloom_add(b->bloom, P0F_IDX_BLOOM, pkt + off + 12, 4);
+      idx_bloom_add(b->bloom, P0F_IDX_BLOOM, pkt + off + 16, 4);
+      idx_bloom_add(ih->bloom, P0F_IDX_FBLOOM, pkt + off + 12, 4);
+      idx_bloom_add(ih->bloom, P0F_IDX_FBLOOM, pkt + off + 16, 4);
+
+    } else if (off >= 0 && len >= off + 40 && (pkt[off] >> 4) == 6) {
+
+      idx_bloom_add(b->bloom, P0F_IDX_BLOOM, pkt + off + 8, 16);
+      idx_bloom_add(b->bloom, P0F_IDX_BLOOM, pkt + off + 24, 16);
+      idx_bloom_add(ih->bloom, P0F_IDX_FBLOOM, pkt + off + 8, 16);
+      idx_bloom_add(ih->bloom, P0F_IDX_FBLOOM, pkt + off + 24, 16);
+
+    } else if (off < 0 && link != LT_EN10MB && link != LT_LINUX_SLL) {
+
+      /* Can't tell addresses apart on this link type; match everything. */
+
+      if (!warned++)
+        WARN("Unsupported link type %u in '%s', no address filtering.",
+             link, fname);
+
+      memset(b->bloom, 0xff, P0F_IDX_BLOOM);
+      memset(ih->bloom, 0xff, P0F_IDX_FBLOOM);
+
+    }
+
+    pos += 16 + len;
+    pcnt++;
+
+  }
+
+  fclose(f);
+
+  ih->blocks = nblk;
+
+  /* Write to a temporary file, then rename into place. */
+
+  dst = ck_alloc(strlen(fname) + 16);
+  tmp = ck_alloc(strlen(fname) + 16);
+
+  sprintf((char*)dst, "%s" P0F_IDX_SUFFIX, fname);
+  sprintf((char*)tmp, "%s" P0F_IDX_SUFFIX ".new", fname);
+
+  f = fopen((char*)tmp, "w");
+  if (!f) PFATAL("Unable to create '%s'.", tmp);
+
+  if (fwrite(ih, sizeof(struct p0f_idx_hdr), 1, f) != 1 ||
+      (nblk && fwrite(blk, sizeof(struct p0f_idx_block), nblk, f) != nblk) ||
+      fclose(f))
+    PFATAL("Unable to write '%s'.", tmp);
+
+  if (rename((char*)tmp, (char*)dst)) PFATAL("Unable to rename '%s'.", tmp);
+
+  SAYF("[+] %s: %u packets, %u blocks.\n", fname, pcnt, nblk);
+
+  ck_free(dst);
+  ck_free(tmp);
+  ck_free(blk);
+  ck_free(ih);
+
+}
+
+
+int main(int argc, char** argv) {
+
+  s32 i;
+
+  if (argc < 2) {
+
+    ERRORF("Usage: p0f-index file.pcap [ file.pcap ... ]\n\n"
+           "Writes a block index (file.pcap" P0F_IDX_SUFFIX ") for each file, "
+           "used by p0f -r with -T or -a.\n");
+
+    exit(1);
+
+  }
+
+  for (i = 1; i < argc; i++) index_file(argv[i]);
+
+  return 0;
+
+}
@@ -0,0 +1,439 @@
+/*
+   p0f-replay - live path benchmark
+   --------------------------------
+
+   Replays a pcap file onto a network interface at a fixed packet rate, and
+   optionally asks a running p0f instance (-s) how many packets it processed
+   and dropped in the meantime. In ramp mode (-R), the rate is doubled until
+   p0f starts losing packets, giving the maximum sustainable rate. With -s,
+   each run also reports how soon after capture p0f verdicts became visible
+   to API queries (median and 99th percentile, as log2 bucket upper bounds).
+
+   The natural setup is a veth pair, with p0f listening on one end and this
+   tool sending on the other:
+
+   ip link add p0f0 type veth peer name p0f1
+   ip link set p0f0 up; ip link set p0f1 up
+   p0f -i p0f1 -s /tmp/p0f.sock -d -o /dev/null
+   p0f-replay -s /tmp/p0f.sock -R p0f0 traffic.pcap
+
+   Linux only (AF_PACKET). Needs CAP_NET_RAW.
+
+   Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>
+
+   Distributed under the terms and conditions of GNU LGPL.
+
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+
+#include "../types.h"
+#include "../config.h"
+#include "../alloc-inl.h"
+#include "../debug.h"
+#include "../api.h"
+
+#define REPLAY_BATCH    64              /* Packets per sendmmsg() call        */
+#define RAMP_START      10000           /* Default starting rate (pps)        */
+#define RAMP_MAX_STEPS  16              /* Give up doubling after this many   */
+#define LOSS_LIMIT      0.001           /* Acceptable loss fraction           */
+#define SETTLE_MS       1000            /* Time for p0f to catch up (ms)      */
+
+static u8** pkt_data;                   /* Packet payloads                    */
+static u32* pkt_len;                    /* Their lengths                      */
+static u32  pkt_cnt;                    /* Number of packets loaded           */
+
+static s32 tx_fd;                       /* AF_PACKET socket                   */
+static struct sockaddr_ll tx_addr;      /* Destination interface              */
+
+static char* api_path;                  /* p0f API socket, if any             */
+
+/* Result of a single run: */
+
+struct run_result {
+
+  u64 sent,                             /* Packets handed to the kernel       */
+      failed,                           /* Packets rejected by the kernel     */
+      seen,                             /* Packets processed by p0f           */
+      dropped;                          /* Packets dropped by capture         */
+
+  double secs,                          /* Sending time                       */
+         pps,                           /* Achieved sending rate              */
+         cpu;                           /* p0f CPU use, fraction of one core  */
+
+  u32 visible[P0F_LAT_BUCKETS];         /* Capture -> API visibility (delta)  */
+
+  u8 have_stats;                        /* Got data from p0f?                 */
+
+};
+
+
+/* Current monotonic time, in seconds. */
+
+static double now(void) {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+
+/* Read an Ethernet pcap file into memory. */
+
+static void load_pcap(char* fname) {
+
+  FILE* f = fopen(fname, "r");
+  u32 hdr[6], rec[4], alloc = 0;
+  u8  swap;
+
+  if (!f) PFATAL("Unable to open '%s'.", fname);
+
+  if (fread(hdr, 4, 6, f) != 6) FATAL("'%s' is too short.", fname);
+
+  if (hdr[0] == 0xa1b2c3d4) swap = 0;
+  else if (hdr[0] == 0xd4c3b2a1) swap = 1;
+  else FATAL("'%s' is not a classic pcap file.", fname);
+
+  if ((swap ? __builtin_bswap32(hdr[5]) : hdr[5]) != 1)
+    FATAL("Only Ethernet captures are supported.");
+
+  while (fread(rec, 4, 4, f) == 4) {
+
+    u32 len = swap ? __builtin_bswap32(rec[2]) : rec[2];
+
+    if (len > 65535) FATAL("Corrupted record in '%s'.", fname);
+
+    if (pkt_cnt == alloc) {
+      alloc = alloc ? alloc * 2 : 1024;
+      pkt_data = ck_realloc(pkt_data, alloc * sizeof(u8*));
+      pkt_len  = ck_realloc(pkt_len, alloc * sizeof(u32));
+    }
+
+    pkt_data[pkt_cnt] = ck_alloc(len);
+    pkt_len[pkt_cnt]  = len;
+
+    if (fread(pkt_data[pkt_cnt], 1, len, f) != len) {
+      WARN("Truncated last record in '%s'.", fname);
+      ck_free(pkt_data[pkt_cnt]);
+      break;
+    }
+
+    pkt_cnt++;
+
+  }
+
+  fclose(f);
+
+  if (!pkt_cnt) FATAL("No packets in '%s'.", fname);
+
+  SAYF("[+] Loaded %u packets from '%s'.\n", pkt_cnt, fname);
+
+}
+
+
+/* Open the sending socket. */
+
+static void open_iface(char* iface) {
+
+  tx_fd = socket(AF_PACKET, SOCK_RAW, 0);
+
+  if (tx_fd < 0) PFATAL("socket(AF_PACKET) failed (need root?)");
+
+  tx_addr.sll_family  = AF_PACKET;
+  tx_addr.sll_ifindex = if_nametoindex(iface);
+
+  if (!tx_addr.sll_ifindex) FATAL("No such interface: '%s'.", iface);
+
+  if (bind(tx_fd, (struct sockaddr*)&tx_addr, sizeof(tx_addr)))
+    PFATAL("bind() to '%s' failed.", iface);
+
+}
+
+
+/* Query p0f stats. Returns 0 on failure. */
+
+static u8 get_stats(struct p0f_stats_response* r) {
+
+  static struct sockaddr_un sun;
+  u32 magic = P0F_STATS_QUERY_MAGIC;
+  s32 sock;
+  u8  ok;
+
+  if (!api_path) return 0;
+
+  sock = socket(PF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) PFATAL("Call to socket() failed.");
+
+  sun.sun_family = AF_UNIX;
+
+  if (strlen(api_path) >= sizeof(sun.sun_path))
+    FATAL("API socket filename is too long for sockaddr_un (blame Unix).");
+
+  strcpy(sun.sun_path, api_path);
+
+  if (connect(sock, (struct sockaddr*)&sun, sizeof(sun)))
+    PFATAL("Can't connect to API socket.");
+
+  ok = (write(sock, &magic, 4) == 4 &&
+        read(sock, r, sizeof(struct p0f_stats_response)) ==
+        sizeof(struct p0f_stats_response) &&
+        r->magic == P0F_STATS_RESP_MAGIC);
+
+  close(sock);
+
+  if (!ok) WARN("Bad stats response (old p0f?)");
+
+  return ok;
+
+}
+
+
+/* Send the capture 'loops' times at 'pps' packets per second (0 = as fast
+   as possible), then collect p0f stats. */
+
+static void run(double pps, u32 loops, struct run_result* res) {
+
+  struct mmsghdr msgs[REPLAY_BATCH];
+  struct iovec   iov[REPLAY_BATCH];
+  struct p0f_stats_response s1, s2;
+  u64 total = (u64)pkt_cnt * loops, done = 0;
+  double start;
+  u32 i;
+
+  memset(res, 0, sizeof(struct run_result));
+
+  res->have_stats = get_stats(&s1);
+
+  start = now();
+
+  while (done < total) {
+
+    u32 n = MIN(total - done, REPLAY_BATCH);
+    s32 ret;
+
+    /* Pace batches so that we never get ahead of the schedule. */
+
+    if (pps > 0) {
+
+      double due = start + done / pps, delay = due - now();
+
+      if (delay > 0) {
+        struct timespec ts;
+        ts.tv_sec  = (u32)delay;
+        ts.tv_nsec = (delay - ts.tv_sec) * 1e9;
+        nanosleep(&ts, NULL);
+      }
+
+      /* Keep batches down to ~1 ms worth of traffic. */
+
+      n = MIN(n, MAX(1, (u32)(pps / 1000)));
+
+    }
+
+    memset(msgs, 0, n * sizeof(struct mmsghdr));
+
+    for (i = 0; i < n; i++) {
+
+      u32 p = (done + i) % pkt_cnt;
+
+      iov[i].iov_base = pkt_data[p];
+      iov[i].iov_len  = pkt_len[p];
+
+      msgs[i].msg_hdr.msg_name    = &tx_addr;
+      msgs[i].msg_hdr.msg_namelen = sizeof(tx_addr);
+      msgs[i].msg_hdr.msg_iov     = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen  = 1;
+
+    }
+
+    ret = sendmmsg(tx_fd, msgs, n, 0);
+
+    if (ret <= 0) {
+
+      if (errno == ENOBUFS || errno == EAGAIN || errno == EINTR) continue;
+
+      /* Oversized or otherwise unsendable packet; skip it. */
+
+      res->failed++;
+      done++;
+      continue;
+
+    }
+
+    res->sent += ret;
+    done      += ret;
+
+  }
+
+  res->secs = now() - start;
+  res->pps  = res->sent / res->secs;
+
+  if (!res->have_stats) return;
+
+  usleep(SETTLE_MS * 1000);
+
+  if (!get_stats(&s2)) {
+    res->have_stats = 0;
+    return;
+  }
+
+  res->seen    = s2.packets - s1.packets;
+  res->dropped = (s2.pcap_drop - s1.pcap_drop) +
+                 (s2.pcap_ifdrop - s1.pcap_ifdrop);
+  res->cpu     = ((s2.cpu_user_ms + s2.cpu_sys_ms) -
+                  (s1.cpu_user_ms + s1.cpu_sys_ms)) / 1000.0 / res->secs;
+
+  for (i = 0; i < P0F_LAT_BUCKETS; i++)
+    res->visible[i] = s2.lat_visible[i] - s1.lat_visible[i];
+
+}
+
+
+/* Fraction of sent packets that p0f never processed. */
+
+static double loss(struct run_result* r) {
+
+  if (!r->sent || r->seen >= r->sent) return 0;
+  return (double)(r->sent - r->seen) / r->sent;
+
+}
+
+
+/* Latency percentile 'pct' from a log2 histogram, as the upper bound of
+   the matching bucket in us; 0 if there are no samples. */
+
+static u64 lat_pct(u32* hist, double pct) {
+
+  u64 total = 0, sum = 0;
+  u32 i;
+
+  for (i = 0; i < P0F_LAT_BUCKETS; i++) total += hist[i];
+
+  if (!total) return 0;
+
+  for (i = 0; i < P0F_LAT_BUCKETS - 1; i++) {
+    sum += hist[i];
+    if (sum >= total * pct) break;
+  }
+
+  return 1ULL << (i + 1);
+
+}
+
+
+static void report(double target, struct run_result* r) {
+
+  if (target > 0) SAYF("target %10.0f pps  ", target);
+  else SAYF("target  line rate      ");
+
+  SAYF("sent %10llu in %6.2fs (%10.0f pps)", r->sent, r->secs, r->pps);
+
+  if (r->failed) SAYF(", %llu failed", r->failed);
+
+  if (r->have_stats)
+    SAYF("  p0f: %10llu seen, %llu dropped, %.2f%% lost, %3.0f%% CPU",
+         r->seen, r->dropped, loss(r) * 100, r->cpu * 100);
+
+  if (r->have_stats && lat_pct(r->visible, 0.5))
+    SAYF(", verdicts p50 <%llu us p99 <%llu us", lat_pct(r->visible, 0.5),
+         lat_pct(r->visible, 0.99));
+
+  SAYF("\n");
+
+}
+
+
+static void usage(char* argv0) {
+
+  ERRORF("Usage: %s [ -p pps ] [ -l loops ] [ -s api_sock [ -R ] ] iface "
+         "file.pcap\n\n"
+         "  -p pps   - sending rate (default: line rate; %u for -R)\n"
+         "  -l n     - replay the capture n times per run (default: 1)\n"
+         "  -s path  - collect stats from the p0f API socket at 'path'\n"
+         "  -R       - double the rate until p0f can't keep up\n",
+         argv0, RAMP_START);
+
+  exit(1);
+
+}
+
+
+int main(int argc, char** argv) {
+
+  struct run_result res;
+  double pps = 0, best = 0;
+  u32 loops = 1, step;
+  u8 ramp = 0;
+  s32 opt;
+
+  while ((opt = getopt(argc, argv, "+Rl:p:s:")) != -1)
+
+    switch (opt) {
+
+      case 'R': ramp  = 1; break;
+      case 'l': loops = atoi(optarg); break;
+      case 'p': pps   = atof(optarg); break;
+      case 's': api_path = optarg; break;
+      default:  usage(argv[0]);
+
+    }
+
+  if (optind + 2 != argc || !loops || pps < 0) usage(argv[0]);
+
+  if (ramp && !api_path) FATAL("-R needs -s to see how p0f is doing.");
+
+  load_pcap(argv[optind + 1]);
+  open_iface(argv[optind]);
+
+  if (!ramp) {
+    run(pps, loops, &res);
+    report(pps, &res);
+    return 0;
+  }
+
+  if (!pps) pps = RAMP_START;
+
+  for (step = 0; step < RAMP_MAX_STEPS; step++, pps *= 2) {
+
+    run(pps, loops, &res);
+    report(pps, &res);
+
+    if (!res.have_stats) FATAL("Lost contact with p0f.");
+
+    if (loss(&res) > LOSS_LIMIT || res.dropped) break;
+
+    best = res.pps;
+
+    /* If we can't send any faster, p0f isn't the bottleneck. */
+
+    if (res.pps < pps * 0.9) {
+      SAYF("[*] Sender can't go faster; p0f kept up at %.0f pps.\n", best);
+      return 0;
+    }
+
+  }
+
+  if (best) SAYF("[+] Maximum sustainable rate: %.0f pps.\n", best);
+  else SAYF("[-] p0f lost packets even at %.0f pps.\n", pps);
+
+  return 0;
+
+}
@@ -0,0 +1,140 @@
+/*
+   p0f-sink-sample - sample output plugin
+   --------------------------------------
+
+   Writes every observation as a single tab-separated line to the file given
+   as the plugin argument (or stderr), and prints a per-module tally on exit.
+   Meant as a starting point for real plugins:
+
+   p0f -i eth0 -P ./p0f-sink-sample.so:/tmp/records.txt
+
+   Copyright (C) 2012 by Michal Zalewski <lcamtuf@coredump.cx>
+
+   Distributed under the terms and conditions of GNU LGPL.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#include "../types.h"
+#include "../api.h"
+#include "../plugin.h"
+
+#define MAX_MODS 16
+
+struct sink_ctx {
+
+  FILE* out;                            /* Output stream                      */
+
+  const char* mod_name[MAX_MODS];       /* Module names seen                  */
+  u64 mod_cnt[MAX_MODS];                /* Records per module                 */
+
+};
+
+
+static void* sink_init(const char* arg) {
+
+  struct sink_ctx* ctx = calloc(1, sizeof(struct sink_ctx));
+
+  if (!ctx) return NULL;
+
+  ctx->out = arg ? fopen(arg, "a") : stderr;
+
+  if (!ctx->out) {
+    free(ctx);
+    return NULL;
+  }
+
+  return ctx;
+
+}
+
+
+static void tally(struct sink_ctx* ctx, const char* mod) {
+
+  u32 i;
+
+  /* Module names are static strings inside p0f, so pointers are stable. */
+
+  for (i = 0; i < MAX_MODS && ctx->mod_name[i]; i++)
+    if (ctx->mod_name[i] == mod) break;
+
+  if (i == MAX_MODS) return;
+
+  ctx->mod_name[i] = mod;
+  ctx->mod_cnt[i]++;
+
+}
+
+
+static void sink_batch(void* opaque, const struct p0f_record* recs, u32 cnt) {
+
+  struct sink_ctx* ctx = opaque;
+  u32 i, j;
+
+  for (i = 0; i < cnt; i++) {
+
+    const struct p0f_record* r = recs + i;
+    char cli[INET6_ADDRSTRLEN], srv[INET6_ADDRSTRLEN];
+    s32 af = (r->ip_ver == P0F_ADDR_IPV4) ? AF_INET : AF_INET6;
+
+    if (r->size < sizeof(struct p0f_record)) continue;
+
+    inet_ntop(af, r->cli_addr, cli, sizeof(cli));
+    inet_ntop(af, r->srv_addr, srv, sizeof(srv));
+
+    fprintf(ctx->out, "%u\t%s\t%s/%u\t%s/%u", r->time, r->module, cli,
+            r->cli_port, srv, r->srv_port);
+
+    for (j = 0; j < r->field_cnt; j++) {
+
+      const struct p0f_field* f = r->fields + j;
+
+      switch (f->type) {
+        case P0F_FIELD_STR: fprintf(ctx->out, "\t%s=%s", f->key, f->str); break;
+        case P0F_FIELD_NUM: fprintf(ctx->out, "\t%s=%lld", f->key,
+                                    (long long)f->num); break;
+        default:            fprintf(ctx->out, "\t%s=?", f->key);
+      }
+
+    }
+
+    fputc('\n', ctx->out);
+
+    tally(ctx, r->module);
+
+  }
+
+  fflush(ctx->out);
+
+}
+
+
+static void sink_fini(void* opaque) {
+
+  struct sink_ctx* ctx = opaque;
+  u32 i;
+
+  for (i = 0; i < MAX_MODS && ctx->mod_name[i]; i++)
+    fprintf(stderr, "[sample] %-16s %llu\n", ctx->mod_name[i],
+            (unsigned long long)ctx->mod_cnt[i]);
+
+  if (ctx->out != stderr) fclose(ctx->out);
+  free(ctx);
+
+}
+
+
+struct p0f_plugin p0f_plugin = {
+
+  .abi   = P0F_PLUGIN_ABI,
+  .name  = "sample",
+  .init  = sink_init,
+  .batch = sink_batch,
+  .fini  = sink_fini
+
+};